@@ -0,0 +1,309 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tree.h"
+#include "ctree.h"
+#include "stree.h"
+
+#define DEFAULT_SIZE 1000000
+#define DEFAULT_SEED 12345
+#define DURATION 0.5
+#define SHARDS 64
+
+static long *keys = NULL;
+static long nkeys = 0;
+
+static int cmp_long(const void *a, const void *b)
+{
+    if( *((long *)a) < *((long *)b) )
+        return -1;
+    else if( *((long *)a) > *((long *)b) )
+        return 1;
+
+    return 0;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+// Either a plain tree behind a mutex or a concurrent tree.
+struct Bench {
+    tree_t *tree;
+    pthread_mutex_t lock;
+    ctree_t *ctree;
+    int stop;
+};
+
+struct Worker {
+    struct Bench *bench;
+    unsigned int seed;
+    long ops;
+};
+
+static void * bench_find(struct Bench *bench, void *key)
+{
+    void *value;
+
+    if( bench->ctree )
+        return ctree_find(bench->ctree, key);
+
+    pthread_mutex_lock(&bench->lock);
+    value = tree_find(bench->tree, key);
+    pthread_mutex_unlock(&bench->lock);
+
+    return value;
+}
+
+static void * reader(void *arg)
+{
+    struct Worker *worker = arg;
+    struct Bench *bench = worker->bench;
+    long i;
+
+    while( !__atomic_load_n(&bench->stop, __ATOMIC_RELAXED) ) {
+        for( i = 0 ; i < 1000 ; i++ )
+            bench_find(bench, &keys[rand_r(&worker->seed) % nkeys]);
+        worker->ops += 1000;
+    }
+
+    return NULL;
+}
+
+// Keep deleting and inserting back keys of the second half.
+static void * writer(void *arg)
+{
+    struct Worker *worker = arg;
+    struct Bench *bench = worker->bench;
+    long *key;
+
+    while( !__atomic_load_n(&bench->stop, __ATOMIC_RELAXED) ) {
+        key = &keys[nkeys/2 + rand_r(&worker->seed) % (nkeys - nkeys/2)];
+        if( bench->ctree ) {
+            ctree_delete(bench->ctree, key, NULL);
+            ctree_insert(bench->ctree, key, key);
+        }
+        else {
+            pthread_mutex_lock(&bench->lock);
+            tree_delete(bench->tree, key);
+            tree_insert(bench->tree, key, key);
+            pthread_mutex_unlock(&bench->lock);
+        }
+        worker->ops += 2;
+    }
+
+    return NULL;
+}
+
+static void bench_readers(const char *name, int concurrent, int nreaders, int with_writer)
+{
+    char title[64];
+    struct Bench bench;
+    struct Worker *workers;
+    pthread_t *threads;
+    long i, reads;
+    double start, elapsed;
+    int nthreads;
+
+    memset(&bench, 0, sizeof(bench));
+    if( concurrent ) {
+        bench.ctree = ctree_create(cmp_long);
+        for( i = 0 ; i < nkeys ; i++ )
+            ctree_insert(bench.ctree, &keys[i], &keys[i]);
+    }
+    else {
+        bench.tree = tree_create(cmp_long);
+        for( i = 0 ; i < nkeys ; i++ )
+            tree_insert(bench.tree, &keys[i], &keys[i]);
+        pthread_mutex_init(&bench.lock, NULL);
+    }
+
+    nthreads = nreaders + (with_writer ? 1 : 0);
+    workers = calloc(nthreads, sizeof(struct Worker));
+    threads = calloc(nthreads, sizeof(pthread_t));
+    start = now();
+    for( i = 0 ; i < nthreads ; i++ ) {
+        workers[i].bench = &bench;
+        workers[i].seed = DEFAULT_SEED + i;
+        pthread_create(&threads[i], NULL, i < nreaders ? reader : writer, &workers[i]);
+    }
+
+    while( now() - start < DURATION )
+        usleep(10000);
+    __atomic_store_n(&bench.stop, 1, __ATOMIC_RELAXED);
+    reads = 0;
+    for( i = 0 ; i < nthreads ; i++ ) {
+        pthread_join(threads[i], NULL);
+        if( i < nreaders )
+            reads += workers[i].ops;
+    }
+    elapsed = now() - start;
+
+    snprintf(title, sizeof(title), "%s%s", name, with_writer ? " + writer" : "");
+    printf("%-32s %4d threads %14.0f reads/s", title, nreaders, reads/elapsed);
+    if( with_writer )
+        printf(" %12.0f writes/s", workers[nreaders].ops/elapsed);
+    printf("\n");
+
+    if( concurrent )
+        ctree_destroy(bench.ctree, NULL);
+    else {
+        tree_destroy(bench.tree, NULL);
+        pthread_mutex_destroy(&bench.lock);
+    }
+    free(workers);
+    free(threads);
+}
+
+struct WriteBench {
+    tree_t *tree;
+    pthread_mutex_t lock;
+    stree_t *stree;
+    int stop;
+};
+
+struct Writer {
+    struct WriteBench *bench;
+    unsigned int seed;
+    long ops;
+};
+
+// Delete and insert back random keys.
+static void * sharded_writer(void *arg)
+{
+    struct Writer *worker = arg;
+    struct WriteBench *bench = worker->bench;
+    long *key;
+    int i;
+
+    while( !__atomic_load_n(&bench->stop, __ATOMIC_RELAXED) ) {
+        for( i = 0 ; i < 100 ; i++ ) {
+            key = &keys[rand_r(&worker->seed) % nkeys];
+            if( bench->stree ) {
+                stree_delete(bench->stree, key);
+                stree_insert(bench->stree, key, key);
+            }
+            else {
+                pthread_mutex_lock(&bench->lock);
+                tree_delete(bench->tree, key);
+                pthread_mutex_unlock(&bench->lock);
+                pthread_mutex_lock(&bench->lock);
+                tree_insert(bench->tree, key, key);
+                pthread_mutex_unlock(&bench->lock);
+            }
+        }
+        worker->ops += 200;
+    }
+
+    return NULL;
+}
+
+static void bench_writers(const char *name, int sharded, int nwriters)
+{
+    struct WriteBench bench;
+    struct Writer *workers;
+    pthread_t *threads;
+    long bounds[SHARDS - 1];
+    void *boundaries[SHARDS - 1];
+    long i, writes;
+    double start, elapsed;
+
+    memset(&bench, 0, sizeof(bench));
+    if( sharded ) {
+        // Keys are 0..nkeys - 1, split them evenly.
+        for( i = 0 ; i < SHARDS - 1 ; i++ ) {
+            bounds[i] = (i + 1)*nkeys/SHARDS;
+            boundaries[i] = &bounds[i];
+        }
+        bench.stree = stree_create(cmp_long, boundaries, SHARDS);
+        for( i = 0 ; i < nkeys ; i++ )
+            stree_insert(bench.stree, &keys[i], &keys[i]);
+    }
+    else {
+        bench.tree = tree_create(cmp_long);
+        for( i = 0 ; i < nkeys ; i++ )
+            tree_insert(bench.tree, &keys[i], &keys[i]);
+        pthread_mutex_init(&bench.lock, NULL);
+    }
+
+    workers = calloc(nwriters, sizeof(struct Writer));
+    threads = calloc(nwriters, sizeof(pthread_t));
+    start = now();
+    for( i = 0 ; i < nwriters ; i++ ) {
+        workers[i].bench = &bench;
+        workers[i].seed = DEFAULT_SEED + i;
+        pthread_create(&threads[i], NULL, sharded_writer, &workers[i]);
+    }
+
+    while( now() - start < DURATION )
+        usleep(10000);
+    __atomic_store_n(&bench.stop, 1, __ATOMIC_RELAXED);
+    writes = 0;
+    for( i = 0 ; i < nwriters ; i++ ) {
+        pthread_join(threads[i], NULL);
+        writes += workers[i].ops;
+    }
+    elapsed = now() - start;
+
+    printf("%-32s %4d threads %14.0f writes/s\n", name, nwriters, writes/elapsed);
+
+    if( sharded )
+        stree_destroy(bench.stree, NULL);
+    else {
+        tree_destroy(bench.tree, NULL);
+        pthread_mutex_destroy(&bench.lock);
+    }
+    free(workers);
+    free(threads);
+}
+
+int main(int argc, char **argv)
+{
+    long i, j, tmp, ncpu;
+    int nreaders, nwriters;
+
+    nkeys = argc > 1 ? atol(argv[1]) : DEFAULT_SIZE;
+    if( nkeys <= 1 ) {
+        fprintf(stderr, "Usage: %s [size]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    keys = malloc(nkeys*sizeof(long));
+    for( i = 0 ; i < nkeys ; i++ )
+        keys[i] = i;
+    srandom(DEFAULT_SEED);
+    for( i = nkeys - 1 ; i > 0 ; i-- ) {
+        j = random() % (i + 1);
+        tmp = keys[i];
+        keys[i] = keys[j];
+        keys[j] = tmp;
+    }
+
+    // Reads per second against the number of reader threads,
+    // up to twice the number of CPUs.
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    for( nreaders = 1 ; nreaders <= 2*ncpu ; nreaders *= 2 ) {
+        bench_readers("find (mutex)", 0, nreaders, 0);
+        bench_readers("find (ctree)", 1, nreaders, 0);
+        bench_readers("find (mutex)", 0, nreaders, 1);
+        bench_readers("find (ctree)", 1, nreaders, 1);
+    }
+
+    // Writes per second against the number of writer threads.
+    for( nwriters = 1 ; nwriters <= 2*ncpu ; nwriters *= 2 ) {
+        bench_writers("delete + insert (mutex)", 0, nwriters);
+        bench_writers("delete + insert (sharded)", 1, nwriters);
+    }
+
+    free(keys);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <map>
+#include <string>
+
+#include "tree.h"
+#include "tree.hpp"
+
+#define DEFAULT_SIZE 1000000
+#define DEFAULT_SEED 12345
+
+static long *keys = NULL;
+static long nkeys = 0;
+// Keeps the compiler from dropping loops whose results aren't used.
+static volatile long sink;
+
+static int cmp_long(const void *a, const void *b)
+{
+    if( *((long *)a) < *((long *)b) )
+        return -1;
+    else if( *((long *)a) > *((long *)b) )
+        return 1;
+
+    return 0;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+static void report(const std::string &name, long ops, double elapsed)
+{
+    printf("%-32s %10ld ops %10.3f s %14.0f ops/s\n",
+        name.c_str(), ops, elapsed, ops/elapsed);
+}
+
+// The same workloads for rbtree::map and std::map: inserts, random
+// lookups, a walk in order, delete + insert churn, deletes.
+template<class Map>
+static void bench_map(const std::string &name)
+{
+    Map m;
+    long i, found, sum, half;
+    double start;
+
+    start = now();
+    for( i = 0 ; i < nkeys ; i++ )
+        m.emplace(keys[i], keys[i]);
+    report("insert " + name, nkeys, now() - start);
+
+    found = 0;
+    start = now();
+    for( i = 0 ; i < nkeys ; i++ )
+        found += m.find(keys[(i*7919) % nkeys]) != m.end();
+    report("find " + name, found, now() - start);
+
+    sum = 0;
+    start = now();
+    for( typename Map::const_iterator it = m.begin() ; it != m.end() ; ++it )
+        sum += it->second;
+    report("iterate " + name, (long)m.size(), now() - start);
+    sink = sum;
+
+    half = nkeys/2;
+    start = now();
+    for( i = 0 ; i < half ; i++ ) {
+        m.erase(keys[i]);
+        m.emplace(keys[i] + nkeys, keys[i]);
+    }
+    report("churn " + name, 2*half, now() - start);
+
+    start = now();
+    for( i = half ; i < nkeys ; i++ )
+        m.erase(keys[i]);
+    report("erase " + name, nkeys - half, now() - start);
+}
+
+// The C tree behind a comparator call on the same workloads.
+static void bench_tree(const std::string &name)
+{
+    tree_t *tree;
+    long *extra;
+    long i, found, half;
+    tree_iter_t iter;
+    double start;
+
+    tree = tree_create(cmp_long);
+    start = now();
+    for( i = 0 ; i < nkeys ; i++ )
+        tree_insert(tree, &keys[i], &keys[i]);
+    report("insert " + name, nkeys, now() - start);
+
+    found = 0;
+    start = now();
+    for( i = 0 ; i < nkeys ; i++ )
+        found += tree_find(tree, &keys[(i*7919) % nkeys]) != NULL;
+    report("find " + name, found, now() - start);
+
+    found = 0;
+    start = now();
+    if( tree_iter_first(tree, &iter) ) {
+        do {
+            found++;
+        }
+        while( tree_iter_next(&iter) );
+    }
+    report("iterate " + name, found, now() - start);
+
+    half = nkeys/2;
+    extra = (long *)malloc(half*sizeof(long));
+    start = now();
+    for( i = 0 ; i < half ; i++ ) {
+        extra[i] = keys[i] + nkeys;
+        tree_delete(tree, &keys[i]);
+        tree_insert(tree, &extra[i], &keys[i]);
+    }
+    report("churn " + name, 2*half, now() - start);
+
+    start = now();
+    for( i = half ; i < nkeys ; i++ )
+        tree_delete(tree, &keys[i]);
+    report("erase " + name, nkeys - half, now() - start);
+
+    tree_destroy(tree, NULL);
+    free(extra);
+}
+
+int main(int argc, char **argv)
+{
+    long i, j, tmp;
+
+    nkeys = argc > 1 ? atol(argv[1]) : DEFAULT_SIZE;
+    if( nkeys <= 0 ) {
+        fprintf(stderr, "Usage: %s [size]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // Unique keys in random order.
+    keys = (long *)malloc(nkeys*sizeof(long));
+    for( i = 0 ; i < nkeys ; i++ )
+        keys[i] = i;
+    srandom(DEFAULT_SEED);
+    for( i = nkeys - 1 ; i > 0 ; i-- ) {
+        j = random() % (i + 1);
+        tmp = keys[i];
+        keys[i] = keys[j];
+        keys[j] = tmp;
+    }
+
+    bench_map<rbtree::map<long, long> >("(rbtree::map)");
+    bench_map<std::map<long, long> >("(std::map)");
+    bench_tree("(tree_t)");
+
+    free(keys);
+
+    return EXIT_SUCCESS;
+}
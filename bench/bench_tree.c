@@ -0,0 +1,968 @@
+
+#include <malloc.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "tree.h"
+#include "ptree.h"
+
+#define DEFAULT_SIZE 1000000
+#define DEFAULT_SEED 12345
+
+static long *keys = NULL;
+static long nkeys = 0;
+
+static int cmp_long(const void *a, const void *b)
+{
+    if( *((long *)a) < *((long *)b) )
+        return -1;
+    else if( *((long *)a) > *((long *)b) )
+        return 1;
+
+    return 0;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+static void report(const char *name, long ops, double elapsed)
+{
+    printf("%-32s %10ld ops %10.3f s %14.0f ops/s\n",
+        name, ops, elapsed, ops/elapsed);
+}
+
+static void * malloc_hook(size_t size, void *ctx)
+{
+    return malloc(size);
+}
+
+static void free_hook(void *ptr, void *ctx)
+{
+    free(ptr);
+}
+
+// Fill the tree with the first half of keys, then repeatedly delete
+// an existing key and insert a fresh one.
+static void bench_churn(const char *name, const tree_options_t *options)
+{
+    tree_t *tree;
+    long half, i;
+    double start;
+
+    tree = tree_create_ext(cmp_long, options);
+    half = nkeys/2;
+
+    start = now();
+    for( i = 0 ; i < half ; i++ )
+        tree_insert(tree, &keys[i], &keys[i]);
+    for( i = half ; i < nkeys ; i++ ) {
+        tree_delete(tree, &keys[i - half]);
+        tree_insert(tree, &keys[i], &keys[i]);
+    }
+    report(name, half + 2*(nkeys - half), now() - start);
+
+    tree_destroy(tree, NULL);
+}
+
+struct KthAcc {
+    long k;
+    void *key;
+};
+
+static void * kth_cb(void *key, void *value, void *acc)
+{
+    struct KthAcc *kth = acc;
+
+    if( kth->k-- == 0 )
+        kth->key = key;
+
+    return acc;
+}
+
+// k-th smallest entry via tree_select() against a full tree_foldl().
+static void bench_select(long queries)
+{
+    tree_options_t options;
+    struct KthAcc kth;
+    tree_iter_t iter;
+    tree_t *tree;
+    long i;
+    double start;
+
+    memset(&options, 0, sizeof(options));
+    options.flags = TREE_ORDER_STATISTICS;
+    tree = tree_create_ext(cmp_long, &options);
+    for( i = 0 ; i < nkeys ; i++ )
+        tree_insert(tree, &keys[i], &keys[i]);
+
+    start = now();
+    for( i = 0 ; i < queries ; i++ )
+        tree_select(tree, keys[i], &iter);
+    report("select (tree_select)", queries, now() - start);
+
+    // A fold visits the whole tree, keep the number of queries small.
+    queries = queries > 10 ? 10 : queries;
+    start = now();
+    for( i = 0 ; i < queries ; i++ ) {
+        kth.k = keys[i];
+        tree_foldl(tree, kth_cb, &kth);
+    }
+    report("select (tree_foldl)", queries, now() - start);
+
+    tree_destroy(tree, NULL);
+}
+
+static void * count_cb(void *key, void *value, void *acc)
+{
+    (*(long *)acc)++;
+    return acc;
+}
+
+static void nop_destructor(void *value)
+{
+}
+
+// Whole-tree walks: folds, info, integrity check and teardown,
+// and as many O(1) counts as the tree has keys.
+static void bench_traversal(const char *name, const tree_options_t *options)
+{
+    char title[64];
+    tree_info_t info;
+    tree_t *tree;
+    long i, count;
+    double start;
+
+    tree = tree_create_ext(cmp_long, options);
+    for( i = 0 ; i < nkeys ; i++ )
+        tree_insert(tree, &keys[i], &keys[i]);
+
+    count = 0;
+    start = now();
+    tree_foldl(tree, count_cb, &count);
+    snprintf(title, sizeof(title), "foldl %s", name);
+    report(title, nkeys, now() - start);
+
+    start = now();
+    tree_foldr(tree, count_cb, &count);
+    snprintf(title, sizeof(title), "foldr %s", name);
+    report(title, nkeys, now() - start);
+
+    start = now();
+    tree_info(tree, &info);
+    snprintf(title, sizeof(title), "info %s", name);
+    report(title, nkeys, now() - start);
+
+    start = now();
+    for( i = 0 ; i < nkeys ; i++ )
+        tree_counts(tree, &info);
+    snprintf(title, sizeof(title), "counts %s", name);
+    report(title, nkeys, now() - start);
+
+    start = now();
+    tree_check_integrity(tree);
+    snprintf(title, sizeof(title), "check_integrity %s", name);
+    report(title, nkeys, now() - start);
+
+    start = now();
+    tree_destroy(tree, nop_destructor);
+    snprintf(title, sizeof(title), "destroy %s", name);
+    report(title, nkeys, now() - start);
+}
+
+// Startup from already sorted input: repeated tree_insert()
+// against tree_build_sorted().
+static void bench_build(void)
+{
+    long *sorted;
+    void **pkeys;
+    tree_t *tree;
+    long i;
+    double start;
+
+    sorted = malloc(nkeys*sizeof(long));
+    pkeys = malloc(nkeys*sizeof(void *));
+    for( i = 0 ; i < nkeys ; i++ ) {
+        sorted[i] = i;
+        pkeys[i] = &sorted[i];
+    }
+
+    start = now();
+    tree = tree_create(cmp_long);
+    for( i = 0 ; i < nkeys ; i++ )
+        tree_insert(tree, pkeys[i], pkeys[i]);
+    report("build (tree_insert)", nkeys, now() - start);
+    tree_destroy(tree, NULL);
+
+    start = now();
+    tree = tree_build_sorted(cmp_long, pkeys, pkeys, nkeys);
+    report("build (tree_build_sorted)", nkeys, now() - start);
+    tree_destroy(tree, NULL);
+
+    free(pkeys);
+    free(sorted);
+}
+
+// Apply batches of updates to a tree holding the first half of keys
+// one by one and with tree_insert_batch()/tree_delete_batch().
+static void bench_batch(long batch)
+{
+    char title[64];
+    void **pkeys;
+    tree_t *tree;
+    long half, i, j, ops;
+    double start;
+
+    half = nkeys/2;
+    if( batch > half )
+        return;
+
+    pkeys = malloc(nkeys*sizeof(void *));
+    for( i = 0 ; i < nkeys ; i++ )
+        pkeys[i] = &keys[i];
+
+    tree = tree_build_sorted(cmp_long, NULL, NULL, 0);
+    tree_insert_batch(tree, pkeys, pkeys, half);
+    ops = 0;
+    start = now();
+    for( i = half ; i + batch <= nkeys ; i += batch ) {
+        for( j = i ; j < i + batch ; j++ )
+            tree_insert(tree, pkeys[j], pkeys[j]);
+        for( j = i ; j < i + batch ; j++ )
+            tree_delete(tree, pkeys[j - half]);
+        ops += 2*batch;
+    }
+    snprintf(title, sizeof(title), "batch %ld (single)", batch);
+    report(title, ops, now() - start);
+    tree_destroy(tree, NULL);
+
+    tree = tree_build_sorted(cmp_long, NULL, NULL, 0);
+    tree_insert_batch(tree, pkeys, pkeys, half);
+    ops = 0;
+    start = now();
+    for( i = half ; i + batch <= nkeys ; i += batch ) {
+        tree_insert_batch(tree, pkeys + i, pkeys + i, batch);
+        tree_delete_batch(tree, pkeys + i - half, batch, NULL);
+        ops += 2*batch;
+    }
+    snprintf(title, sizeof(title), "batch %ld (batch)", batch);
+    report(title, ops, now() - start);
+    tree_destroy(tree, NULL);
+
+    free(pkeys);
+}
+
+// Merge a tree of n keys into a tree holding the first half of keys
+// by inserting one by one and with tree_union().
+static void bench_union(long n)
+{
+    char title[64];
+    tree_t *tree, *other;
+    long half, i;
+    double elapsed, start;
+
+    half = nkeys/2;
+    if( n > nkeys - half )
+        return;
+
+    tree = tree_create(cmp_long);
+    other = tree_create(cmp_long);
+    for( i = 0 ; i < half ; i++ )
+        tree_insert(tree, &keys[i], &keys[i]);
+    for( i = half ; i < half + n ; i++ )
+        tree_insert(other, &keys[i], &keys[i]);
+    start = now();
+    for( i = half ; i < half + n ; i++ )
+        tree_insert(tree, &keys[i], &keys[i]);
+    elapsed = now() - start;
+    snprintf(title, sizeof(title), "union %ld (insert)", n);
+    report(title, n, elapsed);
+    tree_destroy(tree, NULL);
+    tree_destroy(other, NULL);
+
+    tree = tree_create(cmp_long);
+    other = tree_create(cmp_long);
+    for( i = 0 ; i < half ; i++ )
+        tree_insert(tree, &keys[i], &keys[i]);
+    for( i = half ; i < half + n ; i++ )
+        tree_insert(other, &keys[i], &keys[i]);
+    start = now();
+    tree_union(tree, other, NULL);
+    elapsed = now() - start;
+    snprintf(title, sizeof(title), "union %ld (tree_union)", n);
+    report(title, n, elapsed);
+    tree_destroy(tree, NULL);
+}
+
+// Heap bytes held by the tree per entry, including pool slack.
+static void bench_memory(const char *name, const tree_options_t *options)
+{
+    struct mallinfo2 before, after;
+    tree_t *tree;
+    long i;
+
+    before = mallinfo2();
+    tree = tree_create_ext(cmp_long, options);
+    for( i = 0 ; i < nkeys ; i++ )
+        tree_insert(tree, &keys[i], &keys[i]);
+    after = mallinfo2();
+
+    printf("%-32s %10ld entries %8.1f bytes/entry\n", name, nkeys,
+        (double)(after.uordblks + after.hblkhd - before.uordblks - before.hblkhd)/nkeys);
+
+    tree_destroy(tree, NULL);
+}
+
+// Random lookups in the pointer tree and in its frozen copy.
+static void bench_freeze(void)
+{
+    tree_t *tree;
+    tree_frozen_t *frozen;
+    long i, found, queries;
+    double start;
+
+    tree = tree_create(cmp_long);
+    for( i = 0 ; i < nkeys ; i++ )
+        tree_insert(tree, &keys[i], &keys[i]);
+    queries = nkeys < 1000000 ? 1000000 : nkeys;
+
+    found = 0;
+    start = now();
+    for( i = 0 ; i < queries ; i++ )
+        found += tree_find(tree, &keys[(i*7919) % nkeys]) != NULL;
+    report("find (tree)", found, now() - start);
+
+    start = now();
+    frozen = tree_freeze(tree);
+    report("freeze", nkeys, now() - start);
+
+    found = 0;
+    start = now();
+    for( i = 0 ; i < queries ; i++ )
+        found += tree_frozen_find(frozen, &keys[(i*7919) % nkeys]) != NULL;
+    report("find (frozen)", found, now() - start);
+
+    tree_frozen_destroy(frozen);
+    tree_destroy(tree, NULL);
+}
+
+// Inserts and random lookups with long keys behind a comparator
+// and with the same keys stored in the nodes.
+static void bench_int_keys(const char *name, int flags)
+{
+    tree_options_t options;
+    char title[64];
+    tree_t *tree;
+    long i, found, queries;
+    double start;
+
+    memset(&options, 0, sizeof(options));
+    options.flags = flags;
+    tree = tree_create_ext(cmp_long, &options);
+    start = now();
+    for( i = 0 ; i < nkeys ; i++ )
+        tree_insert(tree, &keys[i], &keys[i]);
+    snprintf(title, sizeof(title), "insert %s", name);
+    report(title, nkeys, now() - start);
+
+    queries = nkeys < 1000000 ? 1000000 : nkeys;
+    found = 0;
+    start = now();
+    for( i = 0 ; i < queries ; i++ )
+        found += tree_find(tree, &keys[(i*7919) % nkeys]) != NULL;
+    snprintf(title, sizeof(title), "find %s", name);
+    report(title, found, now() - start);
+
+    tree_destroy(tree, NULL);
+}
+
+// Replace values of existing keys: delete + insert against one upsert.
+static void bench_upsert(void)
+{
+    tree_t *tree;
+    long i, updates;
+    double start;
+
+    tree = tree_create(cmp_long);
+    for( i = 0 ; i < nkeys ; i++ )
+        tree_insert(tree, &keys[i], &keys[i]);
+    updates = nkeys < 1000000 ? 1000000 : nkeys;
+
+    start = now();
+    for( i = 0 ; i < updates ; i++ ) {
+        tree_delete(tree, &keys[(i*7919) % nkeys]);
+        tree_insert(tree, &keys[(i*7919) % nkeys], &keys[i % nkeys]);
+    }
+    report("update (delete + insert)", updates, now() - start);
+
+    start = now();
+    for( i = 0 ; i < updates ; i++ )
+        tree_upsert(tree, &keys[(i*7919) % nkeys], &keys[i % nkeys], NULL);
+    report("update (upsert)", updates, now() - start);
+
+    tree_destroy(tree, NULL);
+}
+
+struct Object {
+    tree_hook_t hook;
+    long key;
+};
+
+// Objects of the caller linked into an intrusive tree against a tree
+// of nodes pointing to them.
+static void bench_intrusive(void)
+{
+    struct Object *objects;
+    tree_t *tree;
+    long i, found, queries;
+    double start;
+
+    objects = malloc(nkeys*sizeof(struct Object));
+    for( i = 0 ; i < nkeys ; i++ )
+        objects[i].key = keys[i];
+    queries = nkeys < 1000000 ? 1000000 : nkeys;
+
+    tree = tree_create(cmp_long);
+    start = now();
+    for( i = 0 ; i < nkeys ; i++ )
+        tree_insert(tree, &objects[i].key, &objects[i]);
+    report("insert (nodes)", nkeys, now() - start);
+    found = 0;
+    start = now();
+    for( i = 0 ; i < queries ; i++ )
+        found += tree_find(tree, &keys[(i*7919) % nkeys]) != NULL;
+    report("find (nodes)", found, now() - start);
+    tree_destroy(tree, NULL);
+
+    tree = tree_create_intrusive(cmp_long, TREE_HOOK_KEY_OFFSET(struct Object, hook, key));
+    start = now();
+    for( i = 0 ; i < nkeys ; i++ )
+        tree_hook_insert(tree, &objects[i].hook);
+    report("insert (intrusive)", nkeys, now() - start);
+    found = 0;
+    start = now();
+    for( i = 0 ; i < queries ; i++ )
+        found += tree_hook_find(tree, &keys[(i*7919) % nkeys]) != NULL;
+    report("find (intrusive)", found, now() - start);
+    start = now();
+    for( i = 0 ; i < nkeys ; i++ )
+        tree_hook_delete(tree, &objects[i].hook);
+    report("delete (intrusive)", nkeys, now() - start);
+    tree_destroy(tree, NULL);
+
+    free(objects);
+}
+
+// Keep snapshots of a persistent tree while changing it: each snapshot
+// costs the nodes copied by the changes made after it was taken.
+static void bench_snapshot(long changes)
+{
+    struct mallinfo2 before, after;
+    char title[64];
+    ptree_t *tree, **snapshots;
+    long nsnapshots, i, j, k;
+    double start;
+
+    nsnapshots = 1000;
+    if( changes*nsnapshots > nkeys/2 )
+        nsnapshots = nkeys/2/changes;
+    if( nsnapshots == 0 )
+        return;
+
+    tree = ptree_create(cmp_long);
+    for( i = 0 ; i < nkeys/2 ; i++ )
+        ptree_insert(tree, &keys[i], &keys[i]);
+
+    snapshots = malloc(nsnapshots*sizeof(ptree_t *));
+    before = mallinfo2();
+    start = now();
+    k = 0;
+    for( i = 0 ; i < nsnapshots ; i++ ) {
+        snapshots[i] = ptree_snapshot(tree);
+        for( j = 0 ; j < changes ; j++, k++ ) {
+            ptree_delete(tree, &keys[k]);
+            ptree_insert(tree, &keys[nkeys/2 + k], &keys[nkeys/2 + k]);
+        }
+    }
+    snprintf(title, sizeof(title), "snapshot + %ld changes", changes);
+    report(title, 2*k, now() - start);
+    after = mallinfo2();
+    printf("%-32s %10ld snapshots %8.1f bytes/snapshot\n", title, nsnapshots,
+        (double)(after.uordblks + after.hblkhd - before.uordblks - before.hblkhd)/nsnapshots);
+
+    for( i = 0 ; i < nsnapshots ; i++ )
+        ptree_destroy(snapshots[i]);
+    ptree_destroy(tree);
+    free(snapshots);
+}
+
+static long encode_long(void *key, void *value, void *buf, long size, void *ctx)
+{
+    if( size >= (long)sizeof(long) )
+        memcpy(buf, key, sizeof(long));
+
+    return sizeof(long);
+}
+
+// Keys are decoded into the array ctx points to, one after another.
+static int decode_long(const void *buf, long size, void **key, void **value, void *ctx)
+{
+    long **next = ctx;
+
+    memcpy(*next, buf, sizeof(long));
+    *key = *value = (*next)++;
+
+    return 0;
+}
+
+// Restart from an image: tree_load() against inserting the same
+// entries one by one (without reading them), and mapping an image
+// to search it in place.
+static void bench_startup(void)
+{
+    tree_t *tree, *loaded;
+    tree_image_t *image;
+    long *decoded, *next, i, found;
+    double start;
+    FILE *f;
+
+    tree = tree_create(cmp_long);
+    for( i = 0 ; i < nkeys ; i++ )
+        tree_insert(tree, &keys[i], &keys[i]);
+
+    f = tmpfile();
+    start = now();
+    tree_save(tree, fileno(f), encode_long, NULL);
+    report("save", nkeys, now() - start);
+
+    decoded = malloc(nkeys*sizeof(long));
+    next = decoded;
+    lseek(fileno(f), 0, SEEK_SET);
+    start = now();
+    loaded = tree_load(cmp_long, NULL, fileno(f), decode_long, NULL, &next);
+    report("startup (tree_load)", nkeys, now() - start);
+    tree_destroy(loaded, NULL);
+    fclose(f);
+
+    loaded = tree_create(cmp_long);
+    start = now();
+    for( i = 0 ; i < nkeys ; i++ )
+        tree_insert(loaded, &decoded[i], &decoded[i]);
+    report("startup (tree_insert)", nkeys, now() - start);
+    tree_destroy(loaded, NULL);
+
+    f = tmpfile();
+    start = now();
+    // Values are copies of the keys.
+    tree_image_save(tree, fileno(f), encode_long, encode_long, NULL);
+    report("save (image)", nkeys, now() - start);
+
+    start = now();
+    image = tree_image_map(fileno(f), cmp_long);
+    report("startup (tree_image_map)", 1, now() - start);
+
+    found = 0;
+    start = now();
+    for( i = 0 ; i < nkeys ; i++ )
+        found += tree_image_find(image, &keys[(i*7919) % nkeys]) != NULL;
+    report("find (image)", found, now() - start);
+
+    found = 0;
+    start = now();
+    for( i = 0 ; i < nkeys ; i++ )
+        found += tree_find(tree, &keys[(i*7919) % nkeys]) != NULL;
+    report("find (tree)", found, now() - start);
+    tree_image_unmap(image);
+    fclose(f);
+
+    tree_destroy(tree, NULL);
+    free(decoded);
+}
+
+// The suite: fixed workloads at sizes from SUITE_MIN_SIZE up to the
+// given size, every 10 times bigger. Latencies are sampled on every
+// SUITE_SAMPLE_EVERY-th operation, comparisons are counted by the
+// comparator, rotations by the tree if it's built with TREE_STATS, the
+// peak RSS is the peak since the workload started.
+#define SUITE_MIN_SIZE      1000
+#define SUITE_MAX_SIZE      10000000
+#define SUITE_MIN_OPS       1000000
+#define SUITE_SAMPLE_EVERY  8
+#define SUITE_ZIPF_S        0.99
+
+struct SuiteResult {
+    const char *workload;
+    long size;
+    long ops;
+    double elapsed;
+    long comparisons;
+    // -1 without TREE_STATS.
+    long rotations;
+    long peak_rss;
+};
+
+static long suite_comparisons = 0;
+static tree_t *suite_tree = NULL;
+static tree_stats_t suite_stats;
+static double *suite_samples = NULL;
+static long suite_nsamples = 0;
+static double suite_start = 0;
+
+static int cmp_long_counted(const void *a, const void *b)
+{
+    suite_comparisons++;
+    return cmp_long(a, b);
+}
+
+// The first i with cdf[i] >= u.
+static long suite_cdf_search(double *cdf, long n, double u)
+{
+    long lo, hi, mid;
+
+    lo = 0;
+    hi = n - 1;
+    while( lo < hi ) {
+        mid = lo + (hi - lo)/2;
+        if( cdf[mid] < u )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    if( *((double *)a) < *((double *)b) )
+        return -1;
+    else if( *((double *)a) > *((double *)b) )
+        return 1;
+
+    return 0;
+}
+
+// Time op if it's the sampled one.
+#define SUITE_OP(i, op) \
+    do { \
+        if( (i) % SUITE_SAMPLE_EVERY ) { \
+            op; \
+        } \
+        else { \
+            double t_ = now(); \
+            op; \
+            suite_samples[suite_nsamples++] = now() - t_; \
+        } \
+    } while( 0 )
+
+// Peak RSS in KB. Writing 5 to clear_refs resets the peak to the current
+// RSS, without it (old kernels, not Linux) it's the peak of the process.
+static void suite_rss_reset(void)
+{
+    FILE *f;
+
+    if( (f = fopen("/proc/self/clear_refs", "w")) ) {
+        fputs("5", f);
+        fclose(f);
+    }
+}
+
+static long suite_rss_peak(void)
+{
+    struct rusage usage;
+    char line[128];
+    long peak;
+    FILE *f;
+
+    peak = -1;
+    if( (f = fopen("/proc/self/status", "r")) ) {
+        while( fgets(line, sizeof(line), f) )
+            if( sscanf(line, "VmHWM: %ld", &peak) == 1 )
+                break;
+        fclose(f);
+    }
+    if( peak < 0 ) {
+        getrusage(RUSAGE_SELF, &usage);
+        peak = usage.ru_maxrss;
+    }
+
+    return peak;
+}
+
+static void suite_begin(struct SuiteResult *result, const char *workload, long size, tree_t *tree)
+{
+    result->workload = workload;
+    result->size = size;
+    suite_nsamples = 0;
+    suite_comparisons = 0;
+    suite_tree = tree;
+    tree_stats(tree, &suite_stats);
+    suite_rss_reset();
+    suite_start = now();
+}
+
+static void suite_end(struct SuiteResult *result, long ops, int csv)
+{
+    tree_stats_t stats;
+    char rotations[32];
+    double p50, p90, p99;
+
+    result->elapsed = now() - suite_start;
+    result->ops = ops;
+    result->comparisons = suite_comparisons;
+    result->rotations = -1;
+    if( tree_stats(suite_tree, &stats) )
+        result->rotations = stats.rotations - suite_stats.rotations;
+    result->peak_rss = suite_rss_peak();
+
+    // Operations that aren't timed one by one (folds) have no percentiles.
+    p50 = p90 = p99 = 0;
+    if( suite_nsamples > 0 ) {
+        qsort(suite_samples, suite_nsamples, sizeof(double), cmp_double);
+        p50 = suite_samples[suite_nsamples*50/100]*1e9;
+        p90 = suite_samples[suite_nsamples*90/100]*1e9;
+        p99 = suite_samples[suite_nsamples*99/100]*1e9;
+    }
+
+    // Empty in CSV, "-" in the table when rotations aren't counted.
+    rotations[0] = '\0';
+    if( result->rotations >= 0 )
+        snprintf(rotations, sizeof(rotations), "%.3f", (double)result->rotations/result->ops);
+    else if( !csv )
+        strcpy(rotations, "-");
+
+    if( csv )
+        printf("%s,%ld,%ld,%.6f,%.0f,%.0f,%.0f,%.0f,%.2f,%s,%ld\n",
+            result->workload, result->size, result->ops, result->elapsed,
+            result->ops/result->elapsed, p50, p90, p99,
+            (double)result->comparisons/result->ops, rotations, result->peak_rss);
+    else
+        printf("%-18s %9ld %10ld %14.0f %8.0f %8.0f %8.0f %8.1f %8s %10ld\n",
+            result->workload, result->size, result->ops,
+            result->ops/result->elapsed, p50, p90, p99,
+            (double)result->comparisons/result->ops, rotations, result->peak_rss);
+    fflush(stdout);
+}
+
+// Insert n keys in order: 0 random, 1 ascending, -1 descending.
+static void suite_insert(const char *workload, long *values, long *order, long n, int direction, int csv)
+{
+    struct SuiteResult result;
+    tree_t *tree;
+    long i, k;
+
+    tree = tree_create(cmp_long_counted);
+    suite_begin(&result, workload, n, tree);
+    for( i = 0 ; i < n ; i++ ) {
+        k = direction == 0 ? order[i] : direction > 0 ? i : n - 1 - i;
+        SUITE_OP(i, tree_insert(tree, &values[k], &values[k]));
+    }
+    suite_end(&result, n, csv);
+    tree_destroy(tree, NULL);
+}
+
+static void suite_size(long n, long *values, long *order, double *zipf, int csv)
+{
+    struct SuiteResult result;
+    tree_t *tree;
+    long *queries, i, ops, k, found;
+    double u;
+    int op;
+
+    suite_insert("insert_random", values, order, n, 0, csv);
+    suite_insert("insert_sequential", values, order, n, 1, csv);
+    suite_insert("insert_reverse", values, order, n, -1, csv);
+
+    tree = tree_create(cmp_long_counted);
+    for( i = 0 ; i < n ; i++ )
+        tree_insert(tree, &values[order[i]], &values[order[i]]);
+
+    // Zipfian ranks over keys in random order: the hot keys are spread
+    // over the tree. zipf is the cumulative distribution over ranks.
+    ops = n < SUITE_MIN_OPS ? SUITE_MIN_OPS : n;
+    queries = malloc(ops*sizeof(long));
+    for( i = 0 ; i < n ; i++ )
+        zipf[i] = (i > 0 ? zipf[i - 1] : 0) + 1/pow(i + 1, SUITE_ZIPF_S);
+    for( i = 0 ; i < ops ; i++ ) {
+        u = (double)random()/RAND_MAX*zipf[n - 1];
+        queries[i] = order[suite_cdf_search(zipf, n, u)];
+    }
+    found = 0;
+    suite_begin(&result, "find_zipf", n, tree);
+    for( i = 0 ; i < ops ; i++ )
+        SUITE_OP(i, found += tree_find(tree, &values[queries[i]]) != NULL);
+    suite_end(&result, ops, csv);
+
+    for( i = 0 ; i < ops ; i++ )
+        queries[i] = random() % n;
+    suite_begin(&result, "find_uniform", n, tree);
+    for( i = 0 ; i < ops ; i++ )
+        SUITE_OP(i, found += tree_find(tree, &values[queries[i]]) != NULL);
+    suite_end(&result, ops, csv);
+
+    // 80% lookups, 10% inserts, 10% deletes over twice as many keys as
+    // the tree holds, so its size stays around n. The operation is drawn
+    // apart from the key and packed with it as key*10 + operation.
+    for( i = 0 ; i < ops ; i++ )
+        queries[i] = (random() % (2*n))*10 + random() % 10;
+    suite_begin(&result, "mixed_churn", n, tree);
+    for( i = 0 ; i < ops ; i++ ) {
+        k = queries[i]/10;
+        op = (int)(queries[i] % 10);
+        if( op < 8 )
+            SUITE_OP(i, found += tree_find(tree, &values[k]) != NULL);
+        else if( op == 8 )
+            SUITE_OP(i, tree_insert(tree, &values[k], &values[k]));
+        else
+            SUITE_OP(i, tree_delete(tree, &values[k]));
+    }
+    suite_end(&result, ops, csv);
+    free(queries);
+
+    found = 0;
+    suite_begin(&result, "foldl", n, tree);
+    tree_foldl(tree, count_cb, &found);
+    suite_end(&result, found, csv);
+
+    found = 0;
+    suite_begin(&result, "foldr", n, tree);
+    tree_foldr(tree, count_cb, &found);
+    suite_end(&result, found, csv);
+
+    suite_begin(&result, "delete_random", n, tree);
+    for( i = 0 ; i < n ; i++ )
+        SUITE_OP(i, tree_delete(tree, &values[order[i]]));
+    suite_end(&result, n, csv);
+
+    tree_destroy(tree, NULL);
+}
+
+static void bench_suite(long max_size, int csv)
+{
+    long *values, *order, i, j, tmp, n, ops;
+    double *zipf;
+
+    // Keys 0 .. 2*max_size - 1, the second half is for churn inserts.
+    values = malloc(2*max_size*sizeof(long));
+    for( i = 0 ; i < 2*max_size ; i++ )
+        values[i] = i;
+    order = malloc(max_size*sizeof(long));
+    zipf = malloc(max_size*sizeof(double));
+    ops = max_size < SUITE_MIN_OPS ? SUITE_MIN_OPS : max_size;
+    suite_samples = malloc((ops/SUITE_SAMPLE_EVERY + 1)*sizeof(double));
+
+    if( csv )
+        printf("workload,size,ops,seconds,ops_per_sec,p50_ns,p90_ns,p99_ns,cmp_per_op,rot_per_op,peak_rss_kb\n");
+    else
+        printf("%-18s %9s %10s %14s %8s %8s %8s %8s %8s %10s\n", "workload", "size", "ops",
+            "ops/s", "p50 ns", "p90 ns", "p99 ns", "cmp/op", "rot/op", "rss KB");
+
+    for( n = SUITE_MIN_SIZE ; n <= max_size ; n *= 10 ) {
+        // The same random order for the same size on every run.
+        srandom(DEFAULT_SEED + n);
+        for( i = 0 ; i < n ; i++ )
+            order[i] = i;
+        for( i = n - 1 ; i > 0 ; i-- ) {
+            j = random() % (i + 1);
+            tmp = order[i];
+            order[i] = order[j];
+            order[j] = tmp;
+        }
+        suite_size(n, values, order, zipf, csv);
+    }
+
+    free(values);
+    free(order);
+    free(zipf);
+    free(suite_samples);
+}
+
+int main(int argc, char **argv)
+{
+    tree_options_t malloc_options;
+    long i, j, tmp;
+    int opt, suite, csv, usage;
+
+    suite = csv = usage = 0;
+    while( (opt = getopt(argc, argv, "sc")) != -1 ) {
+        switch( opt ) {
+            case 's':
+                suite = 1;
+                break;
+            case 'c':
+                csv = 1;
+                break;
+            default:
+                usage = 1;
+        }
+    }
+
+    if( optind < argc )
+        nkeys = atol(argv[optind]);
+    else
+        nkeys = suite ? SUITE_MAX_SIZE : DEFAULT_SIZE;
+    if( usage || nkeys <= 0 || (csv && !suite) ) {
+        fprintf(stderr, "Usage: %s [size]\n", argv[0]);
+        fprintf(stderr, "       %s -s [-c] [max size]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if( suite ) {
+        bench_suite(nkeys, csv);
+        return EXIT_SUCCESS;
+    }
+
+    // Unique keys in random order.
+    keys = malloc(nkeys*sizeof(long));
+    for( i = 0 ; i < nkeys ; i++ )
+        keys[i] = i;
+    srandom(DEFAULT_SEED);
+    for( i = nkeys - 1 ; i > 0 ; i-- ) {
+        j = random() % (i + 1);
+        tmp = keys[i];
+        keys[i] = keys[j];
+        keys[j] = tmp;
+    }
+
+    memset(&malloc_options, 0, sizeof(malloc_options));
+    malloc_options.alloc = malloc_hook;
+    malloc_options.free = free_hook;
+
+    bench_churn("churn (malloc)", &malloc_options);
+    bench_churn("churn (pool)", NULL);
+    bench_memory("memory (malloc)", &malloc_options);
+    bench_memory("memory (pool)", NULL);
+    bench_select(nkeys);
+    bench_traversal("(malloc)", &malloc_options);
+    bench_traversal("(pool)", NULL);
+    bench_build();
+    bench_batch(10);
+    bench_batch(1000);
+    bench_batch(100000);
+    bench_batch(nkeys/2);
+    bench_union(100);
+    bench_union(10000);
+    bench_union(nkeys/2);
+    bench_freeze();
+    bench_int_keys("(comparator)", 0);
+    bench_int_keys("(int64 keys)", TREE_KEY_INT64);
+    bench_intrusive();
+    bench_upsert();
+    bench_startup();
+    bench_snapshot(1);
+    bench_snapshot(10);
+    bench_snapshot(100);
+
+    free(keys);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,359 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ctree.h"
+
+// Readers register in one of the slots, the slot is picked once per thread.
+// Slots are cache line sized so readers of different threads don't
+// fight over the same line.
+#define CTREE_READER_SLOTS  64
+#define CTREE_CACHE_LINE    64
+
+// Optimistic lookups to try before taking the writers' mutex.
+#define CTREE_READ_RETRIES  16
+
+// Try to free retired memory every this many retirements.
+#define CTREE_RECLAIM_BATCH 128
+
+struct CTreeReaders {
+    // Readers in sections entered at even and odd epochs.
+    long count[2];
+} __attribute__((aligned(CTREE_CACHE_LINE)));
+
+struct CTreeRetired {
+    void *ptr;
+    void (*destructor)(void *);
+};
+
+struct CTreeRetiredList {
+    struct CTreeRetired *entries;
+    long size;
+    long capacity;
+};
+
+// Reclamation is epoch based. Memory retired at epoch e goes to
+// retired[e & 1]. The epoch advances from e to e + 1 only when no reader
+// entered at e - 1 is left, and then everything retired at e - 1 is freed:
+// readers entered at e and later couldn't reach it.
+struct CTree {
+    struct CTreeReaders readers[CTREE_READER_SLOTS];
+
+    tree_t *tree;
+    tree_cmp_t cmp;
+    pthread_mutex_t lock;
+
+    // Odd while a writer changes the tree.
+    unsigned long seq;
+    unsigned long epoch;
+    struct CTreeRetiredList retired[2];
+    long pending;
+};
+
+static __thread int ctree_slot = -1;
+static int ctree_slots_taken = 0;
+
+static int ctree_reader_slot(void);
+static void ctree_write_begin(ctree_t *tree);
+static void ctree_write_end(ctree_t *tree);
+static int ctree_lookup(ctree_t *tree, void *key, int next, void **found_key, void **found_value);
+static int ctree_lookup_once(ctree_t *tree, void *key, int next, void **found_key, void **found_value);
+
+static void * ctree_node_alloc(size_t size, void *ctx);
+static void ctree_node_free(void *ptr, void *ctx);
+static void ctree_retire(ctree_t *tree, void *ptr, void (*destructor)(void *));
+static void ctree_reclaim(ctree_t *tree);
+static void ctree_synchronize(ctree_t *tree);
+static void ctree_retired_free(struct CTreeRetiredList *list);
+
+ctree_t * ctree_create(tree_cmp_t cmp)
+{
+    tree_options_t options;
+    ctree_t *tree;
+
+    if( posix_memalign((void **)&tree, CTREE_CACHE_LINE, sizeof(ctree_t)) )
+        return NULL;
+    memset(tree, 0, sizeof(*tree));
+
+    // Nodes can't come from the tree's pool: a deleted node may be
+    // reused right away while readers still walk through it.
+    memset(&options, 0, sizeof(options));
+    options.alloc = ctree_node_alloc;
+    options.free = ctree_node_free;
+    options.alloc_ctx = tree;
+    options.flags = TREE_SHARED;
+    tree->tree = tree_create_ext(cmp, &options);
+    tree->cmp = cmp;
+    pthread_mutex_init(&tree->lock, NULL);
+
+    return tree;
+}
+
+void ctree_destroy(ctree_t *tree, void (*destructor)(void *))
+{
+    tree_destroy(tree->tree, destructor);
+    ctree_retired_free(&tree->retired[0]);
+    ctree_retired_free(&tree->retired[1]);
+    free(tree->retired[0].entries);
+    free(tree->retired[1].entries);
+    pthread_mutex_destroy(&tree->lock);
+    free(tree);
+}
+
+long ctree_size(ctree_t *tree)
+{
+    return tree_size(tree->tree);
+}
+
+void * ctree_find(ctree_t *tree, void *key)
+{
+    void *value;
+    int token;
+
+    token = ctree_read_lock(tree);
+    if( !ctree_lookup(tree, key, 0, NULL, &value) )
+        value = NULL;
+    ctree_read_unlock(tree, token);
+
+    return value;
+}
+
+void * ctree_insert(ctree_t *tree, void *key, void *value)
+{
+    ctree_write_begin(tree);
+    value = tree_insert(tree->tree, key, value);
+    ctree_write_end(tree);
+
+    return value;
+}
+
+int ctree_delete(ctree_t *tree, void *key, void (*destructor)(void *))
+{
+    tree_iter_t iter;
+    void *value;
+    int deleted;
+
+    // The bound is the entry itself, deleting it at the iterator
+    // doesn't descend again.
+    ctree_write_begin(tree);
+    deleted = tree_lower_bound(tree->tree, key, &iter)
+        && tree->cmp(key, tree_iter_key(&iter)) == 0;
+    if( deleted ) {
+        value = tree_delete_at(&iter);
+        if( destructor )
+            ctree_retire(tree, value, destructor);
+    }
+    ctree_write_end(tree);
+
+    return deleted;
+}
+
+void * ctree_foldl(ctree_t *tree, void * (*fun)(void *, void *, void *), void *acc)
+{
+    void *key, *value;
+    int token;
+
+    // Each step looks the next entry up from the root, so the fold never
+    // stands on a node a writer may have moved.
+    token = ctree_read_lock(tree);
+    if( ctree_lookup(tree, NULL, 0, &key, &value) ) {
+        do {
+            acc = fun(key, value, acc);
+        }
+        while( ctree_lookup(tree, key, 1, &key, &value) );
+    }
+    ctree_read_unlock(tree, token);
+
+    return acc;
+}
+
+int ctree_read_lock(ctree_t *tree)
+{
+    unsigned long epoch;
+    int slot;
+
+    slot = ctree_reader_slot();
+    for( ;; ) {
+        epoch = __atomic_load_n(&tree->epoch, __ATOMIC_SEQ_CST);
+        __atomic_fetch_add(&tree->readers[slot].count[epoch & 1], 1, __ATOMIC_SEQ_CST);
+        // The epoch has moved on before the reader got counted,
+        // the writer may have missed it.
+        if( __atomic_load_n(&tree->epoch, __ATOMIC_SEQ_CST) == epoch )
+            break;
+        __atomic_fetch_sub(&tree->readers[slot].count[epoch & 1], 1, __ATOMIC_RELEASE);
+    }
+
+    return slot*2 + (int)(epoch & 1);
+}
+
+void ctree_read_unlock(ctree_t *tree, int token)
+{
+    __atomic_fetch_sub(&tree->readers[token/2].count[token & 1], 1, __ATOMIC_RELEASE);
+}
+
+static int ctree_reader_slot(void)
+{
+    if( ctree_slot < 0 )
+        ctree_slot = __atomic_fetch_add(&ctree_slots_taken, 1, __ATOMIC_RELAXED) % CTREE_READER_SLOTS;
+
+    return ctree_slot;
+}
+
+static void ctree_write_begin(ctree_t *tree)
+{
+    pthread_mutex_lock(&tree->lock);
+    __atomic_store_n(&tree->seq, tree->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void ctree_write_end(ctree_t *tree)
+{
+    __atomic_store_n(&tree->seq, tree->seq + 1, __ATOMIC_RELEASE);
+    if( tree->pending >= CTREE_RECLAIM_BATCH )
+        ctree_reclaim(tree);
+    pthread_mutex_unlock(&tree->lock);
+}
+
+// Look key up (next == 0), the entry after key (next != 0) or the first
+// entry (key == NULL). The caller must be in a read section.
+static int ctree_lookup(ctree_t *tree, void *key, int next, void **found_key, void **found_value)
+{
+    unsigned long seq;
+    void *k, *v;
+    int found, i;
+
+    // Whatever the walk found is good if no writer started meanwhile.
+    // Walking through a tree in the middle of a change is safe: nodes are
+    // published initialized and not freed while the reader is in a section.
+    found = 0;
+    for( i = 0 ; i < CTREE_READ_RETRIES ; i++ ) {
+        seq = __atomic_load_n(&tree->seq, __ATOMIC_ACQUIRE);
+        if( seq & 1 ) {
+            sched_yield();
+            continue;
+        }
+        found = ctree_lookup_once(tree, key, next, &k, &v);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if( __atomic_load_n(&tree->seq, __ATOMIC_RELAXED) == seq )
+            break;
+    }
+
+    // Too many writers, queue up with them.
+    if( i == CTREE_READ_RETRIES ) {
+        pthread_mutex_lock(&tree->lock);
+        found = ctree_lookup_once(tree, key, next, &k, &v);
+        pthread_mutex_unlock(&tree->lock);
+    }
+
+    if( found ) {
+        if( found_key )
+            *found_key = k;
+        if( found_value )
+            *found_value = v;
+    }
+
+    return found;
+}
+
+static int ctree_lookup_once(ctree_t *tree, void *key, int next, void **found_key, void **found_value)
+{
+    tree_iter_t iter, *found;
+
+    // Like tree_find(), an entry with a NULL value is as good as no entry.
+    if( key && !next ) {
+        *found_key = key;
+        *found_value = tree_find(tree->tree, key);
+        return *found_value != NULL;
+    }
+
+    if( key )
+        found = tree_upper_bound(tree->tree, key, &iter);
+    else
+        found = tree_iter_first(tree->tree, &iter);
+    if( !found )
+        return 0;
+
+    *found_key = tree_iter_key(found);
+    *found_value = tree_iter_value(found);
+
+    return 1;
+}
+
+static void * ctree_node_alloc(size_t size, void *ctx)
+{
+    return malloc(size);
+}
+
+static void ctree_node_free(void *ptr, void *ctx)
+{
+    ctree_retire((ctree_t *)ctx, ptr, free);
+}
+
+// Called by writers only.
+static void ctree_retire(ctree_t *tree, void *ptr, void (*destructor)(void *))
+{
+    struct CTreeRetiredList *list;
+    struct CTreeRetired *entries;
+    long capacity;
+
+    list = &tree->retired[tree->epoch & 1];
+    if( list->size == list->capacity ) {
+        capacity = list->capacity ? list->capacity*2 : CTREE_RECLAIM_BATCH;
+        entries = realloc(list->entries, capacity*sizeof(struct CTreeRetired));
+        if( !entries ) {
+            // No room to retire ptr, it's freed right away instead,
+            // once readers that may still see it are gone.
+            ctree_synchronize(tree);
+            destructor(ptr);
+            return;
+        }
+        list->entries = entries;
+        list->capacity = capacity;
+    }
+    list->entries[list->size].ptr = ptr;
+    list->entries[list->size].destructor = destructor;
+    list->size++;
+    tree->pending++;
+}
+
+// Advance the epoch if readers allow and free what's retired two epochs ago.
+// It never waits for readers: if some are in the way the memory stays
+// retired until a later try.
+static void ctree_reclaim(ctree_t *tree)
+{
+    unsigned long epoch;
+    int old, i;
+
+    epoch = tree->epoch;
+    old = (epoch + 1) & 1;
+    for( i = 0 ; i < CTREE_READER_SLOTS ; i++ )
+        if( __atomic_load_n(&tree->readers[i].count[old], __ATOMIC_SEQ_CST) )
+            return;
+
+    __atomic_store_n(&tree->epoch, epoch + 1, __ATOMIC_SEQ_CST);
+    ctree_retired_free(&tree->retired[old]);
+    tree->pending = tree->retired[epoch & 1].size;
+}
+
+// Wait until every reader in a section has left it. Readers entering
+// meanwhile can't reach what's unlinked already, though a slot that never
+// empties keeps the wait going: it's for when memory is short only.
+static void ctree_synchronize(ctree_t *tree)
+{
+    int i, j;
+
+    for( i = 0 ; i < CTREE_READER_SLOTS ; i++ )
+        for( j = 0 ; j < 2 ; j++ )
+            while( __atomic_load_n(&tree->readers[i].count[j], __ATOMIC_SEQ_CST) )
+                sched_yield();
+}
+
+static void ctree_retired_free(struct CTreeRetiredList *list)
+{
+    long i;
+
+    for( i = 0 ; i < list->size ; i++ )
+        list->entries[i].destructor(list->entries[i].ptr);
+    list->size = 0;
+}
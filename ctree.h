@@ -0,0 +1,46 @@
+#ifndef CTREE_H
+#define CTREE_H
+
+#include "tree.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Tree shared between threads. Writers are serialized with a mutex,
+// readers don't lock: they walk the tree optimistically and retry if
+// a writer got in the way. Deleted nodes and values are freed only when
+// no reader can see them anymore.
+typedef struct CTree ctree_t;
+
+ctree_t * ctree_create(tree_cmp_t cmp);
+// No other thread may use the tree at this point.
+void ctree_destroy(ctree_t *tree, void (*destructor)(void *));
+
+long ctree_size(ctree_t *tree);
+void * ctree_find(ctree_t *tree, void *key);
+void * ctree_insert(ctree_t *tree, void *key, void *value);
+// destructor (if not NULL) is called for the value of the deleted entry
+// once no reader can see it. Return 1 if the entry was deleted.
+// Only values are retired this way: readers may still compare against
+// the key of a deleted entry, and ctree_foldl() looks the next entry up
+// by the key it handed out. A key must stay alive until ctree_destroy()
+// unless it's part of its value and goes with it.
+int ctree_delete(ctree_t *tree, void *key, void (*destructor)(void *));
+
+// Fold the entries in ascending order. The fold doesn't stop writers,
+// it sees each entry that stays in the tree while the fold runs.
+void * ctree_foldl(ctree_t *tree, void * (*fun)(void *, void *, void *), void *acc);
+
+// Values found between ctree_read_lock() and ctree_read_unlock() are not
+// destroyed until the section ends, even if their entries are deleted
+// meanwhile. Sections may nest. Pass the token ctree_read_lock() returns
+// to ctree_read_unlock().
+int ctree_read_lock(ctree_t *tree);
+void ctree_read_unlock(ctree_t *tree, int token);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* CTREE_H */
@@ -0,0 +1,422 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "ptree.h"
+
+#define RED     0
+#define BLACK   1
+
+#define IS_RED(node)    ((node) != NULL && (node)->color == RED)
+
+// Left-leaning red-black tree: a red node is always the left child.
+// It needs no parent pointers, which is what makes sharing nodes between
+// versions possible, and its insert and delete are recursive and change
+// only the nodes on the way down and their children.
+//
+// refs is the number of parents and versions pointing to the node.
+// A node can be changed in place only if it and all nodes above it
+// have a single reference, otherwise it's copied first.
+struct PTreeNode {
+    struct PTreeNode *left;
+    struct PTreeNode *right;
+    void *key;
+    void *value;
+    long refs;
+    int color;
+};
+
+struct PTree {
+    struct PTreeNode *root;
+    tree_cmp_t cmp;
+    long size;
+};
+
+static struct PTreeNode * ptree_node_create(void *key, void *value);
+static struct PTreeNode * ptree_node_own(struct PTreeNode *node);
+static void ptree_node_release(struct PTreeNode *node);
+
+static struct PTreeNode * ptree_node_insert(ptree_t *tree, struct PTreeNode *node, void *key, void *value);
+static struct PTreeNode * ptree_node_delete(ptree_t *tree, struct PTreeNode *node, void *key);
+static struct PTreeNode * ptree_node_delete_min(struct PTreeNode *node);
+
+static struct PTreeNode * ptree_rotate_left(struct PTreeNode *node);
+static struct PTreeNode * ptree_rotate_right(struct PTreeNode *node);
+static void ptree_flip_colors(struct PTreeNode *node);
+static struct PTreeNode * ptree_move_red_left(struct PTreeNode *node);
+static struct PTreeNode * ptree_move_red_right(struct PTreeNode *node);
+static struct PTreeNode * ptree_fix_up(struct PTreeNode *node);
+
+static void * ptree_node_foldl(struct PTreeNode *node, void * (*fun)(void *, void *, void *), void *acc);
+static void * ptree_node_foldr(struct PTreeNode *node, void * (*fun)(void *, void *, void *), void *acc);
+static long ptree_node_check_integrity(ptree_t *tree, struct PTreeNode *node,
+    struct PTreeNode *min, struct PTreeNode *max, long *size);
+
+ptree_t * ptree_create(tree_cmp_t cmp)
+{
+    ptree_t *tree;
+
+    tree = malloc(sizeof(ptree_t));
+    memset(tree, 0, sizeof(*tree));
+    tree->cmp = cmp;
+
+    return tree;
+}
+
+ptree_t * ptree_snapshot(ptree_t *tree)
+{
+    ptree_t *snapshot;
+
+    snapshot = malloc(sizeof(ptree_t));
+    *snapshot = *tree;
+    if( snapshot->root )
+        __atomic_fetch_add(&snapshot->root->refs, 1, __ATOMIC_RELAXED);
+
+    return snapshot;
+}
+
+void ptree_destroy(ptree_t *tree)
+{
+    if( tree->root )
+        ptree_node_release(tree->root);
+    free(tree);
+}
+
+long ptree_size(ptree_t *tree)
+{
+    return tree->size;
+}
+
+void * ptree_find(ptree_t *tree, void *key)
+{
+    struct PTreeNode *node;
+    int cmp;
+
+    node = tree->root;
+    while( node ) {
+        cmp = tree->cmp(key, node->key);
+        if( cmp == 0 )
+            return node->value;
+        else if( cmp < 0 )
+            node = node->left;
+        else
+            node = node->right;
+    }
+
+    return NULL;
+}
+
+void * ptree_insert(ptree_t *tree, void *key, void *value)
+{
+    struct PTreeNode *node;
+    int cmp;
+
+    // Like tree_insert(), an existing entry is left as it is.
+    // Look it up first so nothing is copied for nothing.
+    node = tree->root;
+    while( node ) {
+        cmp = tree->cmp(key, node->key);
+        if( cmp == 0 )
+            return node->value;
+        node = cmp < 0 ? node->left : node->right;
+    }
+
+    tree->root = ptree_node_insert(tree, tree->root, key, value);
+    tree->root->color = BLACK;
+    tree->size++;
+
+    return value;
+}
+
+void * ptree_delete(ptree_t *tree, void *key)
+{
+    struct PTreeNode *node;
+    void *value;
+    int cmp;
+
+    // The recursive delete expects the key to be there.
+    node = tree->root;
+    while( node ) {
+        cmp = tree->cmp(key, node->key);
+        if( cmp == 0 )
+            break;
+        node = cmp < 0 ? node->left : node->right;
+    }
+    if( !node )
+        return NULL;
+    value = node->value;
+
+    tree->root = ptree_node_own(tree->root);
+    if( !IS_RED(tree->root->left) && !IS_RED(tree->root->right) )
+        tree->root->color = RED;
+    tree->root = ptree_node_delete(tree, tree->root, key);
+    if( tree->root )
+        tree->root->color = BLACK;
+    tree->size--;
+
+    return value;
+}
+
+void * ptree_foldl(ptree_t *tree, void * (*fun)(void *, void *, void *), void *acc)
+{
+    return ptree_node_foldl(tree->root, fun, acc);
+}
+
+void * ptree_foldr(ptree_t *tree, void * (*fun)(void *, void *, void *), void *acc)
+{
+    return ptree_node_foldr(tree->root, fun, acc);
+}
+
+int ptree_check_integrity(ptree_t *tree)
+{
+    long size;
+
+    if( IS_RED(tree->root) )
+        return 0;
+
+    size = 0;
+    if( ptree_node_check_integrity(tree, tree->root, NULL, NULL, &size) < 0 )
+        return 0;
+
+    return size == tree->size;
+}
+
+static struct PTreeNode * ptree_node_create(void *key, void *value)
+{
+    struct PTreeNode *node;
+
+    node = malloc(sizeof(struct PTreeNode));
+    node->left = NULL;
+    node->right = NULL;
+    node->key = key;
+    node->value = value;
+    node->refs = 1;
+    node->color = RED;
+
+    return node;
+}
+
+// Make node safe to change: the parent is already owned, so a single
+// reference means nobody else sees the node. A shared node is replaced
+// with a copy, the caller must put the result where node was.
+static struct PTreeNode * ptree_node_own(struct PTreeNode *node)
+{
+    struct PTreeNode *copy;
+
+    if( __atomic_load_n(&node->refs, __ATOMIC_ACQUIRE) == 1 )
+        return node;
+
+    copy = malloc(sizeof(struct PTreeNode));
+    *copy = *node;
+    copy->refs = 1;
+    if( copy->left )
+        __atomic_fetch_add(&copy->left->refs, 1, __ATOMIC_RELAXED);
+    if( copy->right )
+        __atomic_fetch_add(&copy->right->refs, 1, __ATOMIC_RELAXED);
+    ptree_node_release(node);
+
+    return copy;
+}
+
+static void ptree_node_release(struct PTreeNode *node)
+{
+    struct PTreeNode *right;
+
+    // Loop on the right child, recurse on the left one.
+    while( node && __atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL) == 0 ) {
+        if( node->left )
+            ptree_node_release(node->left);
+        right = node->right;
+        free(node);
+        node = right;
+    }
+}
+
+static struct PTreeNode * ptree_node_insert(ptree_t *tree, struct PTreeNode *node, void *key, void *value)
+{
+    if( !node )
+        return ptree_node_create(key, value);
+
+    node = ptree_node_own(node);
+    if( tree->cmp(key, node->key) < 0 )
+        node->left = ptree_node_insert(tree, node->left, key, value);
+    else
+        node->right = ptree_node_insert(tree, node->right, key, value);
+
+    if( IS_RED(node->right) && !IS_RED(node->left) )
+        node = ptree_rotate_left(node);
+    if( IS_RED(node->left) && IS_RED(node->left->left) )
+        node = ptree_rotate_right(node);
+    if( IS_RED(node->left) && IS_RED(node->right) )
+        ptree_flip_colors(node);
+
+    return node;
+}
+
+// node is owned, key is in the subtree.
+static struct PTreeNode * ptree_node_delete(ptree_t *tree, struct PTreeNode *node, void *key)
+{
+    struct PTreeNode *min;
+
+    if( tree->cmp(key, node->key) < 0 ) {
+        if( !IS_RED(node->left) && !IS_RED(node->left->left) )
+            node = ptree_move_red_left(node);
+        node->left = ptree_node_delete(tree, ptree_node_own(node->left), key);
+    }
+    else {
+        if( IS_RED(node->left) )
+            node = ptree_rotate_right(node);
+        if( !node->right && tree->cmp(key, node->key) == 0 ) {
+            ptree_node_release(node);
+            return NULL;
+        }
+        if( !IS_RED(node->right) && !IS_RED(node->right->left) )
+            node = ptree_move_red_right(node);
+        if( tree->cmp(key, node->key) == 0 ) {
+            // Take the place of the successor.
+            for( min = node->right ; min->left ; min = min->left );
+            node->key = min->key;
+            node->value = min->value;
+            node->right = ptree_node_delete_min(ptree_node_own(node->right));
+        }
+        else
+            node->right = ptree_node_delete(tree, ptree_node_own(node->right), key);
+    }
+
+    return ptree_fix_up(node);
+}
+
+static struct PTreeNode * ptree_node_delete_min(struct PTreeNode *node)
+{
+    if( !node->left ) {
+        ptree_node_release(node);
+        return NULL;
+    }
+
+    if( !IS_RED(node->left) && !IS_RED(node->left->left) )
+        node = ptree_move_red_left(node);
+    node->left = ptree_node_delete_min(ptree_node_own(node->left));
+
+    return ptree_fix_up(node);
+}
+
+// Rotations and color flips change the children of node,
+// they are owned on the way.
+static struct PTreeNode * ptree_rotate_left(struct PTreeNode *node)
+{
+    struct PTreeNode *right;
+
+    right = node->right = ptree_node_own(node->right);
+    node->right = right->left;
+    right->left = node;
+    right->color = node->color;
+    node->color = RED;
+
+    return right;
+}
+
+static struct PTreeNode * ptree_rotate_right(struct PTreeNode *node)
+{
+    struct PTreeNode *left;
+
+    left = node->left = ptree_node_own(node->left);
+    node->left = left->right;
+    left->right = node;
+    left->color = node->color;
+    node->color = RED;
+
+    return left;
+}
+
+static void ptree_flip_colors(struct PTreeNode *node)
+{
+    node->color = !node->color;
+    node->left = ptree_node_own(node->left);
+    node->left->color = !node->left->color;
+    node->right = ptree_node_own(node->right);
+    node->right->color = !node->right->color;
+}
+
+// Make node->left or one of its children red.
+static struct PTreeNode * ptree_move_red_left(struct PTreeNode *node)
+{
+    ptree_flip_colors(node);
+    if( IS_RED(node->right->left) ) {
+        node->right = ptree_rotate_right(node->right);
+        node = ptree_rotate_left(node);
+        ptree_flip_colors(node);
+    }
+
+    return node;
+}
+
+// Make node->right or one of its children red.
+static struct PTreeNode * ptree_move_red_right(struct PTreeNode *node)
+{
+    ptree_flip_colors(node);
+    if( IS_RED(node->left->left) ) {
+        node = ptree_rotate_right(node);
+        ptree_flip_colors(node);
+    }
+
+    return node;
+}
+
+static struct PTreeNode * ptree_fix_up(struct PTreeNode *node)
+{
+    if( IS_RED(node->right) )
+        node = ptree_rotate_left(node);
+    if( IS_RED(node->left) && IS_RED(node->left->left) )
+        node = ptree_rotate_right(node);
+    if( IS_RED(node->left) && IS_RED(node->right) )
+        ptree_flip_colors(node);
+
+    return node;
+}
+
+static void * ptree_node_foldl(struct PTreeNode *node, void * (*fun)(void *, void *, void *), void *acc)
+{
+    while( node ) {
+        acc = ptree_node_foldl(node->left, fun, acc);
+        acc = fun(node->key, node->value, acc);
+        node = node->right;
+    }
+
+    return acc;
+}
+
+static void * ptree_node_foldr(struct PTreeNode *node, void * (*fun)(void *, void *, void *), void *acc)
+{
+    while( node ) {
+        acc = ptree_node_foldr(node->right, fun, acc);
+        acc = fun(node->key, node->value, acc);
+        node = node->left;
+    }
+
+    return acc;
+}
+
+// Return the black height of the subtree or -1 if it's broken.
+// Keys of the subtree must be between min and max.
+static long ptree_node_check_integrity(ptree_t *tree, struct PTreeNode *node,
+    struct PTreeNode *min, struct PTreeNode *max, long *size)
+{
+    long left, right;
+
+    if( !node )
+        return 0;
+
+    if( __atomic_load_n(&node->refs, __ATOMIC_RELAXED) < 1 )
+        return -1;
+    if( (min && tree->cmp(node->key, min->key) <= 0) || (max && tree->cmp(node->key, max->key) >= 0) )
+        return -1;
+    if( IS_RED(node->right) || (IS_RED(node) && IS_RED(node->left)) )
+        return -1;
+
+    (*size)++;
+    left = ptree_node_check_integrity(tree, node->left, min, node, size);
+    right = ptree_node_check_integrity(tree, node->right, node, max, size);
+    if( left < 0 || left != right )
+        return -1;
+
+    return left + (node->color == BLACK ? 1 : 0);
+}
@@ -0,0 +1,41 @@
+#ifndef PTREE_H
+#define PTREE_H
+
+#include "tree.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Persistent tree: insert and delete copy the O(log n) nodes on the path
+// they change instead of changing them in place, so any number of versions
+// share the unchanged nodes. ptree_snapshot() is O(1).
+//
+// A ptree_t is one version. Versions may be used by different threads,
+// a single version by one thread at a time. Keys and values are not owned
+// by the tree: several versions may hold the same value.
+typedef struct PTree ptree_t;
+
+ptree_t * ptree_create(tree_cmp_t cmp);
+// A new version equal to tree. Later changes of either don't affect the other.
+ptree_t * ptree_snapshot(ptree_t *tree);
+// Release the version. Nodes no other version uses are freed.
+void ptree_destroy(ptree_t *tree);
+
+long ptree_size(ptree_t *tree);
+void * ptree_find(ptree_t *tree, void *key);
+void * ptree_insert(ptree_t *tree, void *key, void *value);
+void * ptree_delete(ptree_t *tree, void *key);
+
+void * ptree_foldl(ptree_t *tree, void * (*fun)(void *, void *, void *), void *acc);
+void * ptree_foldr(ptree_t *tree, void * (*fun)(void *, void *, void *), void *acc);
+
+// Check the order, the red-black invariants and node reference counts.
+// Return 1 if the tree is fine, 0 otherwise.
+int ptree_check_integrity(ptree_t *tree);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* PTREE_H */
@@ -0,0 +1,204 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stree.h"
+
+#define STREE_CACHE_LINE    64
+
+// Shards are cache line aligned so locks of neighbour shards
+// don't share a line.
+struct STreeShard {
+    tree_t *tree;
+    pthread_rwlock_t lock;
+} __attribute__((aligned(STREE_CACHE_LINE)));
+
+struct STree {
+    tree_cmp_t cmp;
+    int nshards;
+    void **boundaries;
+    struct STreeShard *shards;
+};
+
+static int stree_shard(stree_t *tree, void *key);
+static stree_iter_t * stree_iter_seek(stree_iter_t *iter, int shard, void *key);
+
+stree_t * stree_create(tree_cmp_t cmp, void **boundaries, int nshards)
+{
+    tree_options_t options;
+    stree_t *tree;
+    int i;
+
+    if( nshards < 1 )
+        return NULL;
+    for( i = 1 ; i < nshards - 1 ; i++ )
+        if( cmp(boundaries[i - 1], boundaries[i]) >= 0 )
+            return NULL;
+
+    tree = malloc(sizeof(stree_t));
+    tree->cmp = cmp;
+    tree->nshards = nshards;
+    tree->boundaries = malloc(nshards*sizeof(void *));
+    if( nshards > 1 )
+        memcpy(tree->boundaries, boundaries, (nshards - 1)*sizeof(void *));
+    if( posix_memalign((void **)&tree->shards, STREE_CACHE_LINE, nshards*sizeof(struct STreeShard)) ) {
+        free(tree->boundaries);
+        free(tree);
+        return NULL;
+    }
+    // Shards are read under a shared lock.
+    memset(&options, 0, sizeof(options));
+    options.flags = TREE_SHARED;
+    for( i = 0 ; i < nshards ; i++ ) {
+        tree->shards[i].tree = tree_create_ext(cmp, &options);
+        pthread_rwlock_init(&tree->shards[i].lock, NULL);
+    }
+
+    return tree;
+}
+
+void stree_destroy(stree_t *tree, void (*destructor)(void *))
+{
+    int i;
+
+    for( i = 0 ; i < tree->nshards ; i++ ) {
+        tree_destroy(tree->shards[i].tree, destructor);
+        pthread_rwlock_destroy(&tree->shards[i].lock);
+    }
+    free(tree->shards);
+    free(tree->boundaries);
+    free(tree);
+}
+
+long stree_size(stree_t *tree)
+{
+    long size;
+    int i;
+
+    size = 0;
+    for( i = 0 ; i < tree->nshards ; i++ ) {
+        pthread_rwlock_rdlock(&tree->shards[i].lock);
+        size += tree_size(tree->shards[i].tree);
+        pthread_rwlock_unlock(&tree->shards[i].lock);
+    }
+
+    return size;
+}
+
+void * stree_find(stree_t *tree, void *key)
+{
+    struct STreeShard *shard;
+    void *value;
+
+    shard = &tree->shards[stree_shard(tree, key)];
+    pthread_rwlock_rdlock(&shard->lock);
+    value = tree_find(shard->tree, key);
+    pthread_rwlock_unlock(&shard->lock);
+
+    return value;
+}
+
+void * stree_insert(stree_t *tree, void *key, void *value)
+{
+    struct STreeShard *shard;
+
+    shard = &tree->shards[stree_shard(tree, key)];
+    pthread_rwlock_wrlock(&shard->lock);
+    value = tree_insert(shard->tree, key, value);
+    pthread_rwlock_unlock(&shard->lock);
+
+    return value;
+}
+
+void * stree_delete(stree_t *tree, void *key)
+{
+    struct STreeShard *shard;
+    void *value;
+
+    shard = &tree->shards[stree_shard(tree, key)];
+    pthread_rwlock_wrlock(&shard->lock);
+    value = tree_delete(shard->tree, key);
+    pthread_rwlock_unlock(&shard->lock);
+
+    return value;
+}
+
+void * stree_foldl(stree_t *tree, void * (*fun)(void *, void *, void *), void *acc)
+{
+    int i;
+
+    for( i = 0 ; i < tree->nshards ; i++ ) {
+        pthread_rwlock_rdlock(&tree->shards[i].lock);
+        acc = tree_foldl(tree->shards[i].tree, fun, acc);
+        pthread_rwlock_unlock(&tree->shards[i].lock);
+    }
+
+    return acc;
+}
+
+void * stree_foldr(stree_t *tree, void * (*fun)(void *, void *, void *), void *acc)
+{
+    int i;
+
+    for( i = tree->nshards - 1 ; i >= 0 ; i-- ) {
+        pthread_rwlock_rdlock(&tree->shards[i].lock);
+        acc = tree_foldr(tree->shards[i].tree, fun, acc);
+        pthread_rwlock_unlock(&tree->shards[i].lock);
+    }
+
+    return acc;
+}
+
+stree_iter_t * stree_iter_first(stree_t *tree, stree_iter_t *iter)
+{
+    iter->tree = tree;
+    return stree_iter_seek(iter, 0, NULL);
+}
+
+stree_iter_t * stree_iter_next(stree_iter_t *iter)
+{
+    return stree_iter_seek(iter, iter->shard, iter->key);
+}
+
+// Index of the shard key belongs to.
+static int stree_shard(stree_t *tree, void *key)
+{
+    int lo, hi, mid;
+
+    // The first boundary greater than key.
+    lo = 0;
+    hi = tree->nshards - 1;
+    while( lo < hi ) {
+        mid = lo + (hi - lo)/2;
+        if( tree->cmp(key, tree->boundaries[mid]) < 0 )
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    return lo;
+}
+
+// Move to the first entry after key (or the very first one if key is NULL)
+// starting from shard.
+static stree_iter_t * stree_iter_seek(stree_iter_t *iter, int shard, void *key)
+{
+    struct STreeShard *s;
+    tree_iter_t it, *found;
+
+    for( ; shard < iter->tree->nshards ; shard++, key = NULL ) {
+        s = &iter->tree->shards[shard];
+        pthread_rwlock_rdlock(&s->lock);
+        found = key ? tree_upper_bound(s->tree, key, &it) : tree_iter_first(s->tree, &it);
+        if( found ) {
+            iter->shard = shard;
+            iter->key = tree_iter_key(found);
+            iter->value = tree_iter_value(found);
+        }
+        pthread_rwlock_unlock(&s->lock);
+        if( found )
+            return iter;
+    }
+
+    return NULL;
+}
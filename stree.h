@@ -0,0 +1,52 @@
+#ifndef STREE_H
+#define STREE_H
+
+#include "tree.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Tree sharded by key ranges for concurrent writers. Each shard is a tree
+// with its own lock, so writers to different shards don't wait for each
+// other. Shards hold adjacent key ranges, which keeps ordered folds and
+// iteration across shards cheap.
+typedef struct STree stree_t;
+
+typedef struct STreeIter {
+    stree_t *tree;
+    int shard;
+    void *key;
+    void *value;
+} stree_iter_t;
+
+// nshards - 1 strictly ascending boundaries split the key space:
+// shard i holds keys from boundaries[i - 1] (inclusive) to boundaries[i]
+// (exclusive). Return NULL if boundaries are not sorted.
+stree_t * stree_create(tree_cmp_t cmp, void **boundaries, int nshards);
+// No other thread may use the tree at this point.
+void stree_destroy(stree_t *tree, void (*destructor)(void *));
+
+long stree_size(stree_t *tree);
+void * stree_find(stree_t *tree, void *key);
+void * stree_insert(stree_t *tree, void *key, void *value);
+void * stree_delete(stree_t *tree, void *key);
+
+// Folds lock one shard at a time: each shard is seen consistent,
+// the whole tree isn't.
+void * stree_foldl(stree_t *tree, void * (*fun)(void *, void *, void *), void *acc);
+void * stree_foldr(stree_t *tree, void * (*fun)(void *, void *, void *), void *acc);
+
+// Iterate across shards in key order. Each step looks up the entry
+// after the current key, so the iterator survives concurrent changes.
+// The iterator holds no locks, only pointers to the current key and value:
+// stree_iter_next() compares against that key. The caller keeps keys (and
+// values it still uses) of entries deleted meanwhile alive while iterating.
+stree_iter_t * stree_iter_first(stree_t *tree, stree_iter_t *iter);
+stree_iter_t * stree_iter_next(stree_iter_t *iter);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* STREE_H */
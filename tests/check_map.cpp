@@ -0,0 +1,309 @@
+#include <stdlib.h>
+#include <time.h>
+#include <check.h>
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "tree.hpp"
+#include "config.h"
+
+#define RANDOM_ARRAY_SIZE 1000
+
+// Counts live objects to catch copies and leaks.
+struct Tracked {
+    static int live;
+    static int copies;
+    int value;
+
+    explicit Tracked(int v) : value(v) { live++; }
+    Tracked(const Tracked &other) : value(other.value) { live++; copies++; }
+    Tracked(Tracked &&other) : value(other.value) { live++; }
+    ~Tracked() { live--; }
+};
+
+int Tracked::live = 0;
+int Tracked::copies = 0;
+
+// Allocator that counts what it hands out.
+template<class T>
+struct CountingAlloc {
+    typedef T value_type;
+
+    long *allocated;
+
+    explicit CountingAlloc(long *counter) : allocated(counter) {}
+    template<class U>
+    CountingAlloc(const CountingAlloc<U> &other) : allocated(other.allocated) {}
+
+    T * allocate(std::size_t n)
+    {
+        *allocated += n;
+        return std::allocator<T>().allocate(n);
+    }
+
+    void deallocate(T *p, std::size_t n)
+    {
+        *allocated -= n;
+        std::allocator<T>().deallocate(p, n);
+    }
+
+    template<class U>
+    bool operator==(const CountingAlloc<U> &other) const { return allocated == other.allocated; }
+    template<class U>
+    bool operator!=(const CountingAlloc<U> &other) const { return allocated != other.allocated; }
+};
+
+// Counting allocator that goes along with the entries on move assignment.
+// What a move leaves behind counts apart and isn't equal to it anymore.
+static long left_behind = 0;
+
+template<class T>
+struct MovingAlloc : CountingAlloc<T> {
+    typedef std::true_type propagate_on_container_move_assignment;
+
+    explicit MovingAlloc(long *counter) : CountingAlloc<T>(counter) {}
+    template<class U>
+    MovingAlloc(const MovingAlloc<U> &other) : CountingAlloc<T>(other.allocated) {}
+    MovingAlloc(const MovingAlloc &other) = default;
+    MovingAlloc(MovingAlloc &&other) : CountingAlloc<T>(other.allocated) { other.allocated = &left_behind; }
+
+    MovingAlloc & operator=(const MovingAlloc &other) = default;
+    MovingAlloc & operator=(MovingAlloc &&other)
+    {
+        this->allocated = other.allocated;
+        other.allocated = &left_behind;
+        return *this;
+    }
+};
+
+START_TEST(test_map_against_std)
+{
+    rbtree::map<int, int> m;
+    std::map<int, int> ref;
+    rbtree::map<int, int>::iterator it;
+    std::map<int, int>::iterator rit;
+    int i, key;
+
+    srandom(time(NULL));
+    for( i = 0 ; i < 20*RANDOM_ARRAY_SIZE ; i++ ) {
+        key = random() % RANDOM_ARRAY_SIZE;
+        switch( random() % 3 ) {
+        case 0:
+            ck_assert_int_eq(m.insert(std::make_pair(key, i)).second, ref.insert(std::make_pair(key, i)).second);
+            break;
+        case 1:
+            ck_assert_int_eq(m.erase(key), ref.erase(key));
+            break;
+        default:
+            it = m.lower_bound(key);
+            rit = ref.lower_bound(key);
+            ck_assert_int_eq(it == m.end(), rit == ref.end());
+            if( it != m.end() ) {
+                ck_assert_int_eq(it->first, rit->first);
+                ck_assert_int_eq(it->second, rit->second);
+            }
+        }
+    }
+    ck_assert(m.check_integrity());
+    ck_assert_int_eq(m.size(), ref.size());
+    ck_assert(std::equal(m.begin(), m.end(), ref.begin()));
+    ck_assert(std::equal(m.rbegin(), m.rend(), ref.rbegin()));
+
+    // Erasing keeps other iterators valid, nodes aren't copied around.
+    it = m.begin();
+    std::advance(it, m.size()/2);
+    key = it->first;
+    while( m.size() > 1 ) {
+        if( m.begin() != it )
+            m.erase(m.begin());
+        else
+            m.erase(std::prev(m.end()));
+        ck_assert_int_eq(it->first, key);
+    }
+    ck_assert(m.check_integrity());
+    ck_assert_int_eq(m.begin()->first, key);
+    ck_assert(--m.end() == m.begin());
+}
+END_TEST
+
+START_TEST(test_map_access)
+{
+    rbtree::map<std::string, int> m = {{"b", 2}, {"a", 1}, {"c", 3}};
+    const rbtree::map<std::string, int> &cm = m;
+    rbtree::map<std::string, int> copy;
+
+    ck_assert_int_eq(m.size(), 3);
+    ck_assert_str_eq(m.begin()->first.c_str(), "a");
+    ck_assert_int_eq(m["b"], 2);
+    ck_assert_int_eq(m["d"], 0);
+    ck_assert_int_eq(m.size(), 4);
+    ck_assert_int_eq(cm.at("c"), 3);
+    ck_assert_int_eq(cm.count("e"), 0);
+    ck_assert(cm.find("e") == cm.end());
+    ck_assert_int_eq(cm.upper_bound("b")->second, 3);
+    ck_assert_int_eq(m.insert_or_assign("a", 10).second, 0);
+    ck_assert_int_eq(m["a"], 10);
+    try {
+        m.at("e");
+        ck_abort_msg("at() of a missing key didn't throw");
+    }
+    catch( std::out_of_range & ) {
+    }
+
+    copy = m;
+    ck_assert(copy == m);
+    copy.erase(copy.find("a"), copy.end());
+    ck_assert(copy.empty());
+    ck_assert(copy.begin() == copy.end());
+    ck_assert(copy != m);
+
+    copy = std::move(m);
+    ck_assert_int_eq(copy.size(), 4);
+    ck_assert_int_eq(m.size(), 0);
+    ck_assert(copy.check_integrity());
+
+    // Iterators follow the entries to the other map, the end they run
+    // into is that map's end().
+    rbtree::map<std::string, int>::iterator it = copy.find("d");
+    m = {{"x", 24}};
+    m.swap(copy);
+    ck_assert(++it == m.end());
+    ck_assert_str_eq((--it)->first.c_str(), "d");
+    ck_assert_str_eq((--copy.end())->first.c_str(), "x");
+    rbtree::map<std::string, int> moved(std::move(m));
+    ck_assert(++it == moved.end());
+    ck_assert_str_eq((--it)->first.c_str(), "d");
+    ck_assert(m.begin() == m.end());
+    ck_assert(moved.check_integrity() && copy.check_integrity());
+}
+END_TEST
+
+START_TEST(test_map_emplace)
+{
+    rbtree::map<int, std::unique_ptr<int> > m;
+    rbtree::map<int, Tracked> t;
+    std::unique_ptr<int> p(new int(7));
+    int i;
+
+    // Move-only values.
+    ck_assert(m.emplace(1, std::move(p)).second);
+    ck_assert_int_eq(*m[1], 7);
+    p.reset(new int(8));
+    ck_assert(!m.try_emplace(1, std::move(p)).second);
+    ck_assert_ptr_nonnull(p.get());
+    ck_assert(m.try_emplace(2, std::move(p)).second);
+    ck_assert_ptr_null(p.get());
+    ck_assert_int_eq(*m.at(2), 8);
+
+    // Values are built in place, never copied.
+    Tracked::live = 0;
+    Tracked::copies = 0;
+    for( i = 0 ; i < RANDOM_ARRAY_SIZE ; i++ )
+        t.try_emplace(i % 100, i);
+    for( i = 0 ; i < RANDOM_ARRAY_SIZE ; i++ )
+        t.emplace(std::piecewise_construct, std::forward_as_tuple(i), std::forward_as_tuple(i));
+    ck_assert_int_eq(Tracked::copies, 0);
+    ck_assert_int_eq(Tracked::live, RANDOM_ARRAY_SIZE);
+    ck_assert_int_eq(t.at(5).value, 5);
+    t.clear();
+    ck_assert_int_eq(Tracked::live, 0);
+}
+END_TEST
+
+START_TEST(test_map_allocator)
+{
+    typedef CountingAlloc<std::pair<const int, int> > alloc_t;
+    long allocated = 0, other_allocated = 0;
+    int i;
+
+    {
+        rbtree::map<int, int, std::less<int>, alloc_t> m((alloc_t(&allocated)));
+        rbtree::map<int, int, std::less<int>, alloc_t> other((alloc_t(&other_allocated)));
+
+        for( i = 0 ; i < RANDOM_ARRAY_SIZE ; i++ )
+            m.emplace(i, i);
+        ck_assert_int_eq(allocated, RANDOM_ARRAY_SIZE);
+        m.erase(0);
+        ck_assert_int_eq(allocated, RANDOM_ARRAY_SIZE - 1);
+
+        // Allocators don't propagate on move, entries move one by one.
+        other = std::move(m);
+        ck_assert_int_eq(allocated, 0);
+        ck_assert_int_eq(other_allocated, RANDOM_ARRAY_SIZE - 1);
+        ck_assert(other.check_integrity());
+    }
+    ck_assert_int_eq(other_allocated, 0);
+}
+END_TEST
+
+START_TEST(test_map_allocator_propagation)
+{
+    typedef MovingAlloc<std::pair<const int, int> > alloc_t;
+    typedef rbtree::map<int, int, std::less<int>, alloc_t> map_t;
+    long allocated = 0, other_allocated = 0;
+    int i;
+
+    {
+        map_t m((alloc_t(&allocated)));
+        map_t other((alloc_t(&other_allocated)));
+        map_t::iterator it;
+
+        for( i = 0 ; i < RANDOM_ARRAY_SIZE ; i++ )
+            m.emplace(i, i);
+        other.emplace(1, 1);
+        it = m.find(5);
+
+        // The allocator propagates, the nodes go along with it.
+        other = std::move(m);
+        ck_assert(other.find(5) == it);
+        ck_assert_int_eq(allocated, RANDOM_ARRAY_SIZE);
+        ck_assert_int_eq(other_allocated, 0);
+        ck_assert_int_eq(left_behind, 0);
+        ck_assert(m.empty());
+        ck_assert_int_eq(other.size(), RANDOM_ARRAY_SIZE);
+        ck_assert(other.check_integrity());
+    }
+    ck_assert_int_eq(allocated, 0);
+    ck_assert_int_eq(left_behind, 0);
+}
+END_TEST
+
+Suite * map_suite(void)
+{
+    Suite *s;
+    TCase *tc;
+
+    s = suite_create("Map");
+
+    tc = tcase_create("Map basics");
+    tcase_add_test(tc, test_map_against_std);
+    tcase_add_test(tc, test_map_access);
+    tcase_add_test(tc, test_map_emplace);
+    tcase_add_test(tc, test_map_allocator);
+    tcase_add_test(tc, test_map_allocator_propagation);
+    suite_add_tcase(s, tc);
+
+    return s;
+}
+
+int main(int argc, char **argv)
+{
+    int failed;
+    Suite *s;
+    SRunner *sr;
+
+    s = map_suite();
+    sr = srunner_create(s);
+#ifdef CHECK_MODE_NOFORK
+    srunner_set_fork_status(sr, CK_NOFORK);
+#endif
+    srunner_run_all(sr, CK_NORMAL);
+    failed = srunner_ntests_failed(sr);
+
+    srunner_free(sr);
+
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,10 +1,18 @@
 
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
 #include <check.h>
 
 #include "tree.h"
+#include "ctree.h"
+#include "ptree.h"
+#include "stree.h"
 #include "config.h"
 
 tree_t *tree = NULL;
@@ -32,6 +40,14 @@ int cmp_int(const void *a, const void *b)
     return cmp_int_lt(a, b);
 }
 
+// Comparator that can change its mind to break the tree order.
+int cmp_int_reversed = 0;
+
+int cmp_int_switch(const void *a, const void *b)
+{
+    return cmp_int_reversed ? cmp_int_gt(a, b) : cmp_int_lt(a, b);
+}
+
 void init_testcase(void)
 {
     tree = tree_create(cmp_int);
@@ -60,6 +76,23 @@ void init_testcase_random_data(void)
     }
 }
 
+void init_testcase_random_data_os(void)
+{
+    tree_options_t options;
+    int i;
+
+    memset(&options, 0, sizeof(options));
+    options.flags = TREE_ORDER_STATISTICS;
+    tree = tree_create_ext(cmp_int, &options);
+    for( i = 0 ; i < RANDOM_ARRAY_SIZE ; i++ ) {
+        do {
+            random_array[i] = random();
+        }
+        while( tree_find(tree, &random_array[i]) );
+        tree_insert(tree, &random_array[i], &random_array[i]);
+    }
+}
+
 void end_testcase_random_data(void)
 {
     tree_destroy(tree, NULL);
@@ -74,6 +107,17 @@ void * test_fold_cb(void *key, void *value, void *acc)
     return arr;
 }
 
+// Collect up to 10 entries.
+void * test_fold_until_cb(void *key, void *value, void *acc, int *stop)
+{
+    int *arr = (int *)acc;
+
+    arr[++arr[0]] = *(int *)value;
+    if( arr[0] == 10 )
+        *stop = 1;
+    return arr;
+}
+
 START_TEST(test_tree_create)
 {
     tree_t *tree = tree_create(cmp_int);
@@ -83,6 +127,204 @@ START_TEST(test_tree_create)
 }
 END_TEST
 
+long alloc_count = 0;
+
+void * test_alloc(size_t size, void *ctx)
+{
+    (*(long *)ctx)++;
+    return malloc(size);
+}
+
+void test_free(void *ptr, void *ctx)
+{
+    (*(long *)ctx)--;
+    free(ptr);
+}
+
+START_TEST(test_tree_create_ext)
+{
+    tree_options_t options;
+    tree_t *tree;
+    int i, keys[100];
+
+    memset(&options, 0, sizeof(options));
+    options.alloc = test_alloc;
+    options.free = test_free;
+    options.alloc_ctx = &alloc_count;
+
+    tree = tree_create_ext(cmp_int, &options);
+    ck_assert_ptr_ne(tree, NULL);
+    for( i = 0 ; i < 100 ; i++ ) {
+        keys[i] = i;
+        tree_insert(tree, &keys[i], &keys[i]);
+    }
+    ck_assert_int_eq(alloc_count, 100);
+
+    for( i = 0 ; i < 50 ; i++ )
+        tree_delete(tree, &keys[i]);
+    ck_assert_int_eq(alloc_count, 50);
+
+    tree_destroy(tree, NULL);
+    ck_assert_int_eq(alloc_count, 0);
+}
+END_TEST
+
+// Hands out *ctx nodes, then none.
+void * test_alloc_limited(size_t size, void *ctx)
+{
+    if( *(long *)ctx == 0 )
+        return NULL;
+    (*(long *)ctx)--;
+    return malloc(size);
+}
+
+void test_free_limited(void *ptr, void *ctx)
+{
+    free(ptr);
+}
+
+void * test_factory(void *key, void *ctx)
+{
+    (*(int *)ctx)++;
+    return key;
+}
+
+START_TEST(test_tree_no_memory)
+{
+    tree_options_t options;
+    tree_t *tree, *other;
+    void *batch[100];
+    long budget;
+    int i, keys[100], made;
+
+    memset(&options, 0, sizeof(options));
+    options.alloc = test_alloc_limited;
+    options.free = test_free_limited;
+    options.alloc_ctx = &budget;
+
+    // Failed inserts leave the tree as it was.
+    budget = 50;
+    tree = tree_create_ext(cmp_int, &options);
+    for( i = 0 ; i < 100 ; i++ ) {
+        keys[i] = i;
+        errno = 0;
+        ck_assert_ptr_eq(tree_insert(tree, &keys[i], &keys[i]), i < 50 ? &keys[i] : NULL);
+        ck_assert_int_eq(errno, i < 50 ? 0 : ENOMEM);
+    }
+    ck_assert_int_eq(tree_size(tree), 50);
+    ck_assert_int_gt(tree_check_integrity(tree), 0);
+    ck_assert_int_eq(tree_upsert(tree, &keys[60], &keys[60], NULL), -1);
+    ck_assert_int_eq(tree_upsert(tree, &keys[10], &keys[11], NULL), 0);
+    made = 0;
+    ck_assert_ptr_eq(tree_find_or_insert(tree, &keys[60], test_factory, &made, &i), NULL);
+    ck_assert_int_eq(i, 0);
+    ck_assert_int_eq(made, 0);
+
+    // A small batch goes in key by key and keeps what it inserted,
+    // a large one is merged and leaves the tree as it was.
+    for( i = 0 ; i < 100 ; i++ )
+        batch[i] = &keys[i];
+    budget = 5;
+    ck_assert_int_eq(tree_insert_batch(tree, batch + 50, batch + 50, 10), -1);
+    ck_assert_int_eq(tree_size(tree), 55);
+    budget = 5;
+    ck_assert_int_eq(tree_insert_batch(tree, batch, batch, 100), -1);
+    ck_assert_int_eq(tree_size(tree), 55);
+    ck_assert_int_gt(tree_check_integrity(tree), 0);
+    ck_assert_int_eq(tree_delete_batch(tree, batch + 50, 5, NULL), 5);
+    ck_assert_int_eq(tree_size(tree), 50);
+
+    // Nodes built before memory ran out go back.
+    budget = 70;
+    errno = 0;
+    ck_assert_ptr_eq(tree_build_sorted_ext(cmp_int, &options, batch, NULL, 100), NULL);
+    ck_assert_int_eq(errno, ENOMEM);
+
+    other = tree_create_ext(cmp_int, &options);
+    ck_assert_ptr_eq(tree_join(tree, &keys[60], NULL, other), NULL);
+    ck_assert_int_eq(tree_size(tree), 50);
+    ck_assert_int_gt(tree_check_integrity(tree), 0);
+    tree_destroy(other, NULL);
+    tree_destroy(tree, NULL);
+}
+END_TEST
+
+long destructor_count = 0;
+
+void test_destructor(void *value)
+{
+    destructor_count++;
+}
+
+START_TEST(test_tree_destroy)
+{
+    tree_options_t options;
+    tree_t *tree;
+    int i, keys[1000];
+
+    memset(&options, 0, sizeof(options));
+    options.alloc = test_alloc;
+    options.free = test_free;
+    options.alloc_ctx = &alloc_count;
+
+    tree = tree_create_ext(cmp_int, &options);
+    for( i = 0 ; i < 1000 ; i++ ) {
+        keys[i] = i;
+        tree_insert(tree, &keys[i], &keys[i]);
+    }
+
+    destructor_count = 0;
+    tree_destroy(tree, test_destructor);
+    ck_assert_int_eq(destructor_count, 1000);
+    ck_assert_int_eq(alloc_count, 0);
+}
+END_TEST
+
+START_TEST(test_tree_build_sorted)
+{
+    tree_options_t options;
+    tree_iter_t iter, *it;
+    tree_t *tree;
+    int keys[300];
+    void *pkeys[300];
+    int i, n;
+
+    for( i = 0 ; i < 300 ; i++ ) {
+        keys[i] = i*2;
+        pkeys[i] = &keys[i];
+    }
+
+    memset(&options, 0, sizeof(options));
+    options.flags = TREE_ORDER_STATISTICS;
+    for( n = 0 ; n <= 300 ; n++ ) {
+        tree = tree_build_sorted_ext(cmp_int, n % 2 ? &options : NULL, pkeys, pkeys, n);
+        ck_assert_ptr_ne(tree, NULL);
+        ck_assert_int_eq(tree_size(tree), n);
+        ck_assert_int_gt(tree_check_integrity(tree), 0);
+
+        i = 0;
+        for( it = tree_iter_first(tree, &iter) ; it ; it = tree_iter_next(it) ) {
+            ck_assert_int_eq(*(int *)tree_iter_key(it), keys[i]);
+            i++;
+        }
+        ck_assert_int_eq(i, n);
+
+        // The tree stays valid under updates.
+        if( n > 0 ) {
+            tree_delete(tree, &keys[n/2]);
+            i = 1;
+            tree_insert(tree, &i, &i);
+            ck_assert_int_gt(tree_check_integrity(tree), 0);
+        }
+
+        tree_destroy(tree, NULL);
+    }
+
+    pkeys[10] = &keys[5];
+    ck_assert_ptr_eq(tree_build_sorted(cmp_int, pkeys, NULL, 20), NULL);
+}
+END_TEST
+
 START_TEST(test_tree_basics)
 {
     int seven = 7, one = 1, three = 3;
@@ -113,6 +355,44 @@ START_TEST(test_tree_basics)
 }
 END_TEST
 
+// Counts calls in ctx and hands out ctx as the value.
+void * test_factory_cb(void *key, void *ctx)
+{
+    (*(int *)ctx)++;
+    return ctx;
+}
+
+START_TEST(test_tree_upsert)
+{
+    int seven = 7, one = 1, other_seven = 7, calls = 0, inserted;
+    void *old;
+
+    ck_assert_int_eq(tree_upsert(tree, &seven, &seven, &old), 1);
+    ck_assert_int_eq(tree_upsert(tree, &one, &one, NULL), 1);
+    ck_assert_int_eq(tree_size(tree), 2);
+
+    // The value is replaced, the key stays.
+    old = NULL;
+    ck_assert_int_eq(tree_upsert(tree, &other_seven, &one, &old), 0);
+    ck_assert_ptr_eq(old, &seven);
+    ck_assert_ptr_eq(tree_find(tree, &seven), &one);
+    ck_assert_ptr_eq(tree_delete(tree, &other_seven), &one);
+    ck_assert_int_eq(tree_size(tree), 1);
+
+    ck_assert_ptr_eq(tree_find_or_insert(tree, &one, test_factory_cb, &calls, &inserted), &one);
+    ck_assert_int_eq(inserted, 0);
+    ck_assert_int_eq(calls, 0);
+    ck_assert_ptr_eq(tree_find_or_insert(tree, &seven, test_factory_cb, &calls, &inserted), &calls);
+    ck_assert_int_eq(inserted, 1);
+    ck_assert_int_eq(calls, 1);
+    ck_assert_ptr_eq(tree_find_or_insert(tree, &seven, test_factory_cb, &calls, NULL), &calls);
+    ck_assert_int_eq(calls, 1);
+    ck_assert_ptr_eq(tree_find(tree, &seven), &calls);
+    ck_assert_int_eq(tree_size(tree), 2);
+    ck_assert_int_gt(tree_check_integrity(tree), 0);
+}
+END_TEST
+
 START_TEST(test_tree_foldl)
 {
     int sorted[RANDOM_ARRAY_SIZE], acc[RANDOM_ARRAY_SIZE+1];
@@ -147,48 +427,1508 @@ START_TEST(test_tree_foldr)
 }
 END_TEST
 
-START_TEST(test_tree_properties)
+START_TEST(test_tree_integrity_report)
 {
-    tree_info_t info;
+    tree_integrity_t report;
 
-    ck_assert_ptr_eq(tree_info(tree, &info), &info);
-    ck_assert_int_eq(info.size, tree_size(tree));
-    ck_assert_int_le(info.height, info.min_height*2);
+    ck_assert_int_eq(tree_check_integrity_report(tree, &report), 1);
+    ck_assert_int_eq(report.error, TREE_INTEGRITY_OK);
+    ck_assert_str_eq(tree_integrity_error(report.error), "ok");
 }
 END_TEST
 
-START_TEST(test_tree_integrity)
+START_TEST(test_tree_integrity_order)
+{
+    tree_integrity_t report;
+    tree_t *tree;
+    int i, keys[100];
+
+    cmp_int_reversed = 0;
+    tree = tree_create(cmp_int_switch);
+    for( i = 0 ; i < 100 ; i++ ) {
+        keys[i] = i;
+        tree_insert(tree, &keys[i], &keys[i]);
+    }
+    ck_assert_int_eq(tree_check_integrity_report(tree, &report), 1);
+
+    cmp_int_reversed = 1;
+    ck_assert_int_eq(tree_check_integrity(tree), 0);
+    ck_assert_int_eq(tree_check_integrity_report(tree, &report), 0);
+    ck_assert_int_eq(report.error, TREE_INTEGRITY_ORDER);
+    // The second smallest key is the first one out of order.
+    ck_assert_int_eq(*(int *)report.key, 1);
+    ck_assert_int_gt(report.depth, 0);
+
+    cmp_int_reversed = 0;
+    tree_destroy(tree, NULL);
+}
+END_TEST
+
+START_TEST(test_tree_churn)
 {
+    int i;
+
+    // Deleted nodes go to the free list and are reused by inserts.
+    for( i = 0 ; i < RANDOM_ARRAY_SIZE ; i += 2 )
+        ck_assert_ptr_eq(tree_delete(tree, &random_array[i]), &random_array[i]);
+    ck_assert_int_eq(tree_size(tree), RANDOM_ARRAY_SIZE/2);
+    ck_assert_int_gt(tree_check_integrity(tree), 0);
+
+    for( i = 0 ; i < RANDOM_ARRAY_SIZE ; i += 2 )
+        ck_assert_ptr_eq(tree_insert(tree, &random_array[i], &random_array[i]), &random_array[i]);
+    ck_assert_int_eq(tree_size(tree), RANDOM_ARRAY_SIZE);
     ck_assert_int_gt(tree_check_integrity(tree), 0);
+
+    for( i = 0 ; i < RANDOM_ARRAY_SIZE ; i++ )
+        ck_assert_ptr_eq(tree_find(tree, &random_array[i]), &random_array[i]);
 }
 END_TEST
 
-Suite * tree_suite()
+START_TEST(test_tree_iter)
 {
-    Suite *s;
-    TCase *tc;
+    int sorted[RANDOM_ARRAY_SIZE];
+    tree_iter_t iter, *it;
+    int i;
 
-    s = suite_create("Red-black Tree");
+    memcpy(sorted, random_array, sizeof(sorted));
+    qsort(sorted, RANDOM_ARRAY_SIZE, sizeof(int), cmp_int_lt);
 
-    tc = tcase_create("Tree create");
-    tcase_add_test(tc, test_tree_create);
-    suite_add_tcase(s, tc);
+    i = 0;
+    for( it = tree_iter_first(tree, &iter) ; it ; it = tree_iter_next(it) ) {
+        ck_assert_int_lt(i, RANDOM_ARRAY_SIZE);
+        ck_assert_int_eq(*(int *)tree_iter_key(it), sorted[i]);
+        ck_assert_int_eq(*(int *)tree_iter_value(it), sorted[i]);
+        i++;
+    }
+    ck_assert_int_eq(i, RANDOM_ARRAY_SIZE);
 
-    tc = tcase_create("Tree basics");
-    tcase_add_checked_fixture(tc, init_testcase, end_testcase);
-    tcase_add_test(tc, test_tree_basics);
-    suite_add_tcase(s, tc);
+    for( it = tree_iter_last(tree, &iter) ; it ; it = tree_iter_prev(it) ) {
+        i--;
+        ck_assert_int_eq(*(int *)tree_iter_key(it), sorted[i]);
+    }
+    ck_assert_int_eq(i, 0);
+    ck_assert_ptr_eq(tree_iter_key(&iter), NULL);
+}
+END_TEST
 
-    tc = tcase_create("Tree fold");
-    tcase_add_checked_fixture(tc, init_testcase_random_data, end_testcase_random_data);
-    tcase_add_test(tc, test_tree_foldl);
-    tcase_add_test(tc, test_tree_foldr);
-    suite_add_tcase(s, tc);
+START_TEST(test_tree_delete_at)
+{
+    tree_iter_t iter, last, *it;
+    void *key, *last_key;
+    int i, n;
 
-    tc = tcase_create("Tree properties");
-    tcase_add_checked_fixture(tc, init_testcase_random_data, end_testcase_random_data);
-    tcase_add_test(tc, test_tree_properties);
-    tcase_add_test(tc, test_tree_integrity);
+    // Delete every other entry while walking, the last one stays
+    // where its iterator points all along.
+    tree_iter_last(tree, &last);
+    last_key = tree_iter_key(&last);
+    n = 0;
+    i = 0;
+    for( it = tree_iter_first(tree, &iter) ; it && it->node != last.node ; i++ ) {
+        if( i % 2 == 0 ) {
+            // Values are the keys.
+            key = tree_iter_key(it);
+            ck_assert_ptr_eq(tree_delete_at(it), key);
+            ck_assert_ptr_eq(tree_find(tree, key), NULL);
+            n++;
+        }
+        else
+            it = tree_iter_next(it);
+        ck_assert_ptr_eq(tree_iter_key(&last), last_key);
+    }
+    ck_assert_int_eq(tree_size(tree), RANDOM_ARRAY_SIZE - n);
+    ck_assert_int_gt(tree_check_integrity(tree), 0);
+
+    // Delete the rest from the back.
+    while( tree_iter_last(tree, &iter) ) {
+        key = tree_iter_key(&iter);
+        ck_assert_ptr_eq(tree_delete_at(&iter), key);
+        ck_assert_ptr_eq(iter.node, NULL);
+    }
+    ck_assert_int_eq(tree_size(tree), 0);
+    ck_assert_ptr_eq(tree_delete_at(&iter), NULL);
+}
+END_TEST
+
+START_TEST(test_tree_iter_empty)
+{
+    tree_iter_t iter;
+
+    ck_assert_ptr_eq(tree_iter_first(tree, &iter), NULL);
+    ck_assert_ptr_eq(tree_iter_last(tree, &iter), NULL);
+    ck_assert_ptr_eq(tree_iter_next(&iter), NULL);
+}
+END_TEST
+
+START_TEST(test_tree_bounds)
+{
+    int sorted[RANDOM_ARRAY_SIZE];
+    tree_iter_t iter;
+    int i, key;
+
+    memcpy(sorted, random_array, sizeof(sorted));
+    qsort(sorted, RANDOM_ARRAY_SIZE, sizeof(int), cmp_int_lt);
+
+    for( i = 0 ; i < RANDOM_ARRAY_SIZE ; i++ ) {
+        key = sorted[i];
+        ck_assert_ptr_eq(tree_lower_bound(tree, &key, &iter), &iter);
+        ck_assert_int_eq(*(int *)tree_iter_key(&iter), sorted[i]);
+        ck_assert_ptr_eq(tree_ceiling(tree, &key, &iter), &iter);
+        ck_assert_int_eq(*(int *)tree_iter_key(&iter), sorted[i]);
+        ck_assert_ptr_eq(tree_floor(tree, &key, &iter), &iter);
+        ck_assert_int_eq(*(int *)tree_iter_key(&iter), sorted[i]);
+
+        if( i < RANDOM_ARRAY_SIZE - 1 ) {
+            ck_assert_ptr_eq(tree_upper_bound(tree, &key, &iter), &iter);
+            ck_assert_int_eq(*(int *)tree_iter_key(&iter), sorted[i+1]);
+        }
+        else {
+            ck_assert_ptr_eq(tree_upper_bound(tree, &key, &iter), NULL);
+        }
+
+        // Between two neighbours.
+        if( i > 0 && sorted[i-1] + 1 < sorted[i] ) {
+            key = sorted[i] - 1;
+            ck_assert_ptr_eq(tree_lower_bound(tree, &key, &iter), &iter);
+            ck_assert_int_eq(*(int *)tree_iter_key(&iter), sorted[i]);
+            ck_assert_ptr_eq(tree_floor(tree, &key, &iter), &iter);
+            ck_assert_int_eq(*(int *)tree_iter_key(&iter), sorted[i-1]);
+        }
+    }
+
+    key = sorted[0] - 1;
+    ck_assert_ptr_eq(tree_floor(tree, &key, &iter), NULL);
+    key = sorted[RANDOM_ARRAY_SIZE-1] + 1;
+    ck_assert_ptr_eq(tree_lower_bound(tree, &key, &iter), NULL);
+}
+END_TEST
+
+START_TEST(test_tree_fold_range)
+{
+    int sorted[RANDOM_ARRAY_SIZE], acc[RANDOM_ARRAY_SIZE+1];
+    int i, lo, hi;
+
+    memcpy(sorted, random_array, sizeof(sorted));
+    qsort(sorted, RANDOM_ARRAY_SIZE, sizeof(int), cmp_int_lt);
+    memset(acc, 0, sizeof(acc));
+
+    lo = sorted[100];
+    hi = sorted[199];
+    ck_assert_ptr_eq(tree_fold_range(tree, &lo, &hi, test_fold_cb, acc), acc);
+    ck_assert_int_eq(acc[0], 100);
+    for( i = 0 ; i < 100 ; i++ ) {
+        ck_assert_int_eq(acc[i+1], sorted[100+i]);
+    }
+
+    // Empty range.
+    memset(acc, 0, sizeof(acc));
+    tree_fold_range(tree, &hi, &lo, test_fold_cb, acc);
+    ck_assert_int_eq(acc[0], 0);
+}
+END_TEST
+
+START_TEST(test_tree_select_rank)
+{
+    int sorted[RANDOM_ARRAY_SIZE];
+    tree_iter_t iter;
+    int i, key;
+
+    memcpy(sorted, random_array, sizeof(sorted));
+    qsort(sorted, RANDOM_ARRAY_SIZE, sizeof(int), cmp_int_lt);
+
+    for( i = 0 ; i < RANDOM_ARRAY_SIZE ; i++ ) {
+        ck_assert_ptr_eq(tree_select(tree, i, &iter), &iter);
+        ck_assert_int_eq(*(int *)tree_iter_key(&iter), sorted[i]);
+        ck_assert_int_eq(tree_rank(tree, &sorted[i]), i);
+    }
+    ck_assert_ptr_eq(tree_select(tree, -1, &iter), NULL);
+    ck_assert_ptr_eq(tree_select(tree, RANDOM_ARRAY_SIZE, &iter), NULL);
+    key = sorted[RANDOM_ARRAY_SIZE-1] + 1;
+    ck_assert_int_eq(tree_rank(tree, &key), RANDOM_ARRAY_SIZE);
+
+    // Counts survive deletes.
+    for( i = 0 ; i < RANDOM_ARRAY_SIZE ; i += 2 )
+        tree_delete(tree, &sorted[i]);
+    ck_assert_int_gt(tree_check_integrity(tree), 0);
+    for( i = 1 ; i < RANDOM_ARRAY_SIZE ; i += 2 ) {
+        ck_assert_ptr_eq(tree_select(tree, i/2, &iter), &iter);
+        ck_assert_int_eq(*(int *)tree_iter_key(&iter), sorted[i]);
+        ck_assert_int_eq(tree_rank(tree, &sorted[i]), i/2);
+    }
+}
+END_TEST
+
+START_TEST(test_tree_fold_until)
+{
+    int sorted[RANDOM_ARRAY_SIZE], acc[RANDOM_ARRAY_SIZE+1];
+    int i;
+
+    memcpy(sorted, random_array, sizeof(sorted));
+    qsort(sorted, RANDOM_ARRAY_SIZE, sizeof(int), cmp_int_lt);
+
+    memset(acc, 0, sizeof(acc));
+    ck_assert_ptr_eq(tree_foldl_until(tree, test_fold_until_cb, acc), acc);
+    ck_assert_int_eq(acc[0], 10);
+    for( i = 0 ; i < 10 ; i++ ) {
+        ck_assert_int_eq(acc[i+1], sorted[i]);
+    }
+
+    memset(acc, 0, sizeof(acc));
+    ck_assert_ptr_eq(tree_foldr_until(tree, test_fold_until_cb, acc), acc);
+    ck_assert_int_eq(acc[0], 10);
+    for( i = 0 ; i < 10 ; i++ ) {
+        ck_assert_int_eq(acc[i+1], sorted[RANDOM_ARRAY_SIZE-1-i]);
+    }
+}
+END_TEST
+
+START_TEST(test_tree_batch)
+{
+    int extra[RANDOM_ARRAY_SIZE];
+    void *keys[2*RANDOM_ARRAY_SIZE];
+    int i, n;
+
+    // Small batch with some keys already present and some repeated.
+    for( i = 0 ; i < 100 ; i++ ) {
+        extra[i] = random_array[i] ^ 0x5a5a5a;
+        keys[i] = tree_find(tree, &extra[i]) ? &random_array[i] : &extra[i];
+    }
+    keys[100] = keys[0];
+    keys[101] = &random_array[500];
+    n = 0;
+    for( i = 0 ; i < 100 ; i++ )
+        n += keys[i] == &extra[i];
+    ck_assert_int_eq(tree_insert_batch(tree, keys, keys, 102), n);
+    ck_assert_int_eq(tree_size(tree), RANDOM_ARRAY_SIZE + n);
+    ck_assert_int_gt(tree_check_integrity(tree), 0);
+    for( i = 0 ; i < 100 ; i++ )
+        ck_assert_ptr_eq(tree_find(tree, keys[i]), keys[i]);
+    ck_assert_ptr_eq(tree_find(tree, &random_array[500]), &random_array[500]);
+
+    ck_assert_int_eq(tree_delete_batch(tree, keys, 102, NULL), 100 + 1);
+    ck_assert_int_eq(tree_size(tree), RANDOM_ARRAY_SIZE + n - 101);
+    ck_assert_int_gt(tree_check_integrity(tree), 0);
+    for( i = 0 ; i < 100 ; i++ )
+        ck_assert_ptr_eq(tree_find(tree, keys[i]), NULL);
+
+    // Large batches rebuild the tree.
+    for( i = 0 ; i < RANDOM_ARRAY_SIZE ; i++ ) {
+        keys[i] = &random_array[i];
+        keys[RANDOM_ARRAY_SIZE + i] = &random_array[i];
+    }
+    tree_insert_batch(tree, keys, keys, 2*RANDOM_ARRAY_SIZE);
+    ck_assert_int_eq(tree_size(tree), RANDOM_ARRAY_SIZE + n - 100);
+    ck_assert_int_gt(tree_check_integrity(tree), 0);
+    for( i = 0 ; i < RANDOM_ARRAY_SIZE ; i++ )
+        ck_assert_ptr_eq(tree_find(tree, &random_array[i]), &random_array[i]);
+
+    ck_assert_int_eq(tree_delete_batch(tree, keys, RANDOM_ARRAY_SIZE/2, NULL), RANDOM_ARRAY_SIZE/2);
+    ck_assert_int_eq(tree_size(tree), RANDOM_ARRAY_SIZE/2 + n - 100);
+    ck_assert_int_gt(tree_check_integrity(tree), 0);
+    for( i = 0 ; i < RANDOM_ARRAY_SIZE ; i++ )
+        ck_assert_ptr_eq(tree_find(tree, &random_array[i]), i < RANDOM_ARRAY_SIZE/2 ? NULL : &random_array[i]);
+}
+END_TEST
+
+int cmp_int_qsort(const void *a, const void *b)
+{
+    return cmp_int_lt(a, b);
+}
+
+START_TEST(test_tree_join_split)
+{
+    int sorted[RANDOM_ARRAY_SIZE];
+    tree_t *lo, *hi;
+    tree_iter_t iter;
+    int i, k;
+
+    memcpy(sorted, random_array, sizeof(sorted));
+    qsort(sorted, RANDOM_ARRAY_SIZE, sizeof(int), cmp_int_qsort);
+
+    for( i = 0 ; i < 20 ; i++ ) {
+        k = (i*i*37) % RANDOM_ARRAY_SIZE;
+        tree_split(tree, &sorted[k], &lo, &hi);
+        ck_assert_ptr_eq(lo, tree);
+        ck_assert_int_eq(tree_size(lo), k);
+        ck_assert_int_eq(tree_size(hi), RANDOM_ARRAY_SIZE - k);
+        ck_assert_int_gt(tree_check_integrity(lo), 0);
+        ck_assert_int_gt(tree_check_integrity(hi), 0);
+        ck_assert_ptr_ne(tree_iter_first(hi, &iter), NULL);
+        ck_assert_int_eq(*(int *)tree_iter_key(&iter), sorted[k]);
+
+        // Keys must be in order.
+        ck_assert_ptr_eq(tree_join(hi, &sorted[k], &sorted[k], lo), NULL);
+
+        ck_assert_ptr_ne(tree_delete(hi, &sorted[k]), NULL);
+        ck_assert_ptr_eq(tree_join(lo, &sorted[k], &sorted[k], hi), tree);
+        ck_assert_int_eq(tree_size(tree), RANDOM_ARRAY_SIZE);
+        ck_assert_int_gt(tree_check_integrity(tree), 0);
+    }
+
+    // Split at either end.
+    tree_split(tree, &sorted[0], &lo, &hi);
+    ck_assert_int_eq(tree_size(lo), 0);
+    ck_assert_int_eq(tree_size(hi), RANDOM_ARRAY_SIZE);
+    ck_assert_int_gt(tree_check_integrity(hi), 0);
+    ck_assert_ptr_eq(tree_union(lo, hi, NULL), tree);
+    tree_split(tree, &sorted[RANDOM_ARRAY_SIZE - 1], &lo, &hi);
+    ck_assert_int_eq(tree_size(lo), RANDOM_ARRAY_SIZE - 1);
+    ck_assert_int_eq(tree_size(hi), 1);
+    ck_assert_ptr_eq(tree_union(lo, hi, NULL), tree);
+    ck_assert_int_eq(tree_size(tree), RANDOM_ARRAY_SIZE);
+    ck_assert_int_gt(tree_check_integrity(tree), 0);
+}
+END_TEST
+
+START_TEST(test_tree_set_operations)
+{
+    int sorted[RANDOM_ARRAY_SIZE];
+    tree_t *other;
+    int i, *value;
+
+    memcpy(sorted, random_array, sizeof(sorted));
+    qsort(sorted, RANDOM_ARRAY_SIZE, sizeof(int), cmp_int_qsort);
+
+    // Keep the upper half.
+    other = tree_create(cmp_int);
+    for( i = RANDOM_ARRAY_SIZE/2 ; i < RANDOM_ARRAY_SIZE ; i++ )
+        tree_insert(other, &sorted[i], &sorted[i]);
+    destructor_count = 0;
+    ck_assert_ptr_eq(tree_intersection(tree, other, test_destructor), tree);
+    ck_assert_int_eq(destructor_count, RANDOM_ARRAY_SIZE);
+    ck_assert_int_eq(tree_size(tree), RANDOM_ARRAY_SIZE/2);
+    ck_assert_int_gt(tree_check_integrity(tree), 0);
+    for( i = 0 ; i < RANDOM_ARRAY_SIZE ; i++ ) {
+        value = tree_find(tree, &sorted[i]);
+        if( i < RANDOM_ARRAY_SIZE/2 )
+            ck_assert_ptr_eq(value, NULL);
+        else
+            ck_assert_int_eq(*value, sorted[i]);
+        ck_assert_ptr_ne(value, &sorted[i]);
+    }
+
+    // Drop the third quarter.
+    other = tree_create(cmp_int);
+    for( i = RANDOM_ARRAY_SIZE/2 ; i < RANDOM_ARRAY_SIZE*3/4 ; i++ )
+        tree_insert(other, &sorted[i], &sorted[i]);
+    destructor_count = 0;
+    ck_assert_ptr_eq(tree_difference(tree, other, test_destructor), tree);
+    ck_assert_int_eq(destructor_count, RANDOM_ARRAY_SIZE/2);
+    ck_assert_int_eq(tree_size(tree), RANDOM_ARRAY_SIZE/4);
+    ck_assert_int_gt(tree_check_integrity(tree), 0);
+
+    // Bring everything back, values of the last quarter stay.
+    other = tree_create(cmp_int);
+    for( i = 0 ; i < RANDOM_ARRAY_SIZE ; i++ )
+        tree_insert(other, &sorted[i], &sorted[i]);
+    destructor_count = 0;
+    ck_assert_ptr_eq(tree_union(tree, other, test_destructor), tree);
+    ck_assert_int_eq(destructor_count, RANDOM_ARRAY_SIZE/4);
+    ck_assert_int_eq(tree_size(tree), RANDOM_ARRAY_SIZE);
+    ck_assert_int_gt(tree_check_integrity(tree), 0);
+    for( i = 0 ; i < RANDOM_ARRAY_SIZE ; i++ ) {
+        value = tree_find(tree, &sorted[i]);
+        ck_assert_int_eq(*value, sorted[i]);
+        if( i < RANDOM_ARRAY_SIZE*3/4 )
+            ck_assert_ptr_eq(value, &sorted[i]);
+        else
+            ck_assert_ptr_ne(value, &sorted[i]);
+    }
+
+    // Trees with different options can't be mixed.
+    other = tree_create(cmp_int_gt);
+    ck_assert_ptr_eq(tree_union(tree, other, NULL), NULL);
+    tree_destroy(other, NULL);
+}
+END_TEST
+
+void * test_ctree_sum_cb(void *key, void *value, void *acc)
+{
+    *(int *)acc += *(int *)value;
+    return acc;
+}
+
+// acc holds the last key seen and the number of keys out of order.
+void * test_ctree_order_cb(void *key, void *value, void *acc)
+{
+    int *state = acc;
+
+    if( *(int *)key <= state[0] )
+        state[1]++;
+    state[0] = *(int *)key;
+    return acc;
+}
+
+START_TEST(test_ctree_basics)
+{
+    ctree_t *ctree;
+    int i, keys[1000], sum;
+
+    ctree = ctree_create(cmp_int);
+    for( i = 0 ; i < 1000 ; i++ ) {
+        keys[i] = i;
+        ck_assert_ptr_eq(ctree_insert(ctree, &keys[i], &keys[i]), &keys[i]);
+    }
+    ck_assert_int_eq(ctree_size(ctree), 1000);
+
+    destructor_count = 0;
+    for( i = 0 ; i < 1000 ; i += 2 )
+        ck_assert_int_eq(ctree_delete(ctree, &keys[i], test_destructor), 1);
+    ck_assert_int_eq(ctree_delete(ctree, &keys[0], test_destructor), 0);
+    ck_assert_int_eq(ctree_size(ctree), 500);
+    for( i = 0 ; i < 1000 ; i++ )
+        ck_assert_ptr_eq(ctree_find(ctree, &keys[i]), i % 2 ? &keys[i] : NULL);
+
+    sum = 0;
+    ctree_foldl(ctree, test_ctree_sum_cb, &sum);
+    ck_assert_int_eq(sum, 500*500);
+
+    ctree_destroy(ctree, test_destructor);
+    ck_assert_int_eq(destructor_count, 1000);
+}
+END_TEST
+
+#define CTREE_TEST_KEYS     2000
+#define CTREE_TEST_READERS  4
+
+struct CTreeTest {
+    ctree_t *ctree;
+    int keys[CTREE_TEST_KEYS];
+    int stop;
+    long errors;
+};
+
+// Readers look up even keys which stay in the tree and check the order
+// of folds while the writer keeps adding and deleting odd keys.
+void * test_ctree_reader(void *arg)
+{
+    struct CTreeTest *test = arg;
+    int i, state[2], rounds;
+
+    for( rounds = 0 ; !__atomic_load_n(&test->stop, __ATOMIC_RELAXED) || rounds < 10 ; rounds++ ) {
+        for( i = 0 ; i < CTREE_TEST_KEYS ; i += 2 )
+            if( ctree_find(test->ctree, &test->keys[i]) != &test->keys[i] )
+                __atomic_fetch_add(&test->errors, 1, __ATOMIC_RELAXED);
+
+        state[0] = -1;
+        state[1] = 0;
+        ctree_foldl(test->ctree, test_ctree_order_cb, state);
+        if( state[1] || state[0] < CTREE_TEST_KEYS - 2 )
+            __atomic_fetch_add(&test->errors, 1, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+START_TEST(test_ctree_threads)
+{
+    struct CTreeTest test;
+    pthread_t readers[CTREE_TEST_READERS];
+    int i, round;
+
+    memset(&test, 0, sizeof(test));
+    test.ctree = ctree_create(cmp_int);
+    for( i = 0 ; i < CTREE_TEST_KEYS ; i++ ) {
+        test.keys[i] = i;
+        if( i % 2 == 0 )
+            ctree_insert(test.ctree, &test.keys[i], &test.keys[i]);
+    }
+
+    for( i = 0 ; i < CTREE_TEST_READERS ; i++ )
+        pthread_create(&readers[i], NULL, test_ctree_reader, &test);
+
+    for( round = 0 ; round < 50 ; round++ ) {
+        for( i = 1 ; i < CTREE_TEST_KEYS ; i += 2 )
+            ctree_insert(test.ctree, &test.keys[i], &test.keys[i]);
+        for( i = 1 ; i < CTREE_TEST_KEYS ; i += 2 )
+            ctree_delete(test.ctree, &test.keys[i], NULL);
+    }
+    __atomic_store_n(&test.stop, 1, __ATOMIC_RELAXED);
+
+    for( i = 0 ; i < CTREE_TEST_READERS ; i++ )
+        pthread_join(readers[i], NULL);
+
+    ck_assert_int_eq(test.errors, 0);
+    ck_assert_int_eq(ctree_size(test.ctree), CTREE_TEST_KEYS/2);
+    ctree_destroy(test.ctree, NULL);
+}
+END_TEST
+
+START_TEST(test_ptree_snapshot)
+{
+    ptree_t *ptree, *snapshot, *versions[10];
+    int i, v, values[RANDOM_ARRAY_SIZE + 1];
+
+    ptree = ptree_create(cmp_int);
+    for( i = 0 ; i < RANDOM_ARRAY_SIZE ; i++ )
+        ck_assert_ptr_eq(ptree_insert(ptree, &random_array[i], &random_array[i]), &random_array[i]);
+    ck_assert_int_eq(ptree_size(ptree), RANDOM_ARRAY_SIZE);
+    ck_assert_int_eq(ptree_check_integrity(ptree), 1);
+
+    // Versions differ by a tenth of the entries each.
+    for( v = 0 ; v < 10 ; v++ ) {
+        versions[v] = ptree_snapshot(ptree);
+        for( i = v*RANDOM_ARRAY_SIZE/10 ; i < (v + 1)*RANDOM_ARRAY_SIZE/10 ; i++ )
+            ck_assert_ptr_eq(ptree_delete(ptree, &random_array[i]), &random_array[i]);
+        ck_assert_ptr_eq(ptree_delete(ptree, &random_array[0]), NULL);
+        ck_assert_int_eq(ptree_check_integrity(ptree), 1);
+    }
+    ck_assert_int_eq(ptree_size(ptree), 0);
+
+    for( v = 0 ; v < 10 ; v++ ) {
+        ck_assert_int_eq(ptree_size(versions[v]), RANDOM_ARRAY_SIZE - v*RANDOM_ARRAY_SIZE/10);
+        ck_assert_int_eq(ptree_check_integrity(versions[v]), 1);
+        for( i = 0 ; i < RANDOM_ARRAY_SIZE ; i++ )
+            ck_assert_ptr_eq(ptree_find(versions[v], &random_array[i]),
+                i < v*RANDOM_ARRAY_SIZE/10 ? NULL : &random_array[i]);
+    }
+
+    // Changing a snapshot leaves the tree it was taken from alone.
+    snapshot = ptree_snapshot(versions[5]);
+    for( i = 0 ; i < RANDOM_ARRAY_SIZE ; i++ )
+        ptree_insert(snapshot, &random_array[i], &random_array[i]);
+    ck_assert_int_eq(ptree_size(snapshot), RANDOM_ARRAY_SIZE);
+    ck_assert_int_eq(ptree_check_integrity(snapshot), 1);
+    ck_assert_int_eq(ptree_size(versions[5]), RANDOM_ARRAY_SIZE/2);
+    ck_assert_int_eq(ptree_check_integrity(versions[5]), 1);
+
+    values[0] = 0;
+    ptree_foldl(versions[9], test_fold_cb, values);
+    ck_assert_int_eq(values[0], RANDOM_ARRAY_SIZE/10);
+    for( i = 2 ; i <= values[0] ; i++ )
+        ck_assert_int_lt(values[i - 1], values[i]);
+
+    // Release in an order that is neither oldest nor newest first.
+    for( v = 0 ; v < 10 ; v++ ) {
+        ptree_destroy(versions[(v*3) % 10]);
+        if( v == 4 )
+            ck_assert_int_eq(ptree_check_integrity(snapshot), 1);
+    }
+    ptree_destroy(snapshot);
+    ptree_destroy(ptree);
+}
+END_TEST
+
+#define STREE_TEST_SHARDS   8
+#define STREE_TEST_WRITERS  4
+
+struct STreeTest {
+    stree_t *stree;
+    int *keys;
+    int first;
+};
+
+// Each writer inserts and deletes every STREE_TEST_WRITERS-th key.
+void * test_stree_writer(void *arg)
+{
+    struct STreeTest *test = arg;
+    int i, round;
+
+    for( round = 0 ; round < 5 ; round++ ) {
+        for( i = test->first ; i < 4000 ; i += STREE_TEST_WRITERS )
+            stree_insert(test->stree, &test->keys[i], &test->keys[i]);
+        if( round < 4 )
+            for( i = test->first ; i < 4000 ; i += STREE_TEST_WRITERS )
+                stree_delete(test->stree, &test->keys[i]);
+    }
+
+    return NULL;
+}
+
+START_TEST(test_stree)
+{
+    struct STreeTest tests[STREE_TEST_WRITERS];
+    pthread_t writers[STREE_TEST_WRITERS];
+    int keys[4000], bounds[STREE_TEST_SHARDS - 1], values[4000 + 1];
+    void *boundaries[STREE_TEST_SHARDS - 1];
+    stree_iter_t iter;
+    stree_t *stree;
+    int i, n;
+
+    for( i = 0 ; i < 4000 ; i++ )
+        keys[i] = i;
+    for( i = 0 ; i < STREE_TEST_SHARDS - 1 ; i++ ) {
+        bounds[i] = (i + 1)*500;
+        boundaries[i] = &bounds[i];
+    }
+    boundaries[0] = &bounds[1];
+    ck_assert_ptr_eq(stree_create(cmp_int, boundaries, STREE_TEST_SHARDS), NULL);
+    boundaries[0] = &bounds[0];
+    stree = stree_create(cmp_int, boundaries, STREE_TEST_SHARDS);
+
+    for( i = 0 ; i < STREE_TEST_WRITERS ; i++ ) {
+        tests[i].stree = stree;
+        tests[i].keys = keys;
+        tests[i].first = i;
+        pthread_create(&writers[i], NULL, test_stree_writer, &tests[i]);
+    }
+    for( i = 0 ; i < STREE_TEST_WRITERS ; i++ )
+        pthread_join(writers[i], NULL);
+
+    ck_assert_int_eq(stree_size(stree), 4000);
+    for( i = 0 ; i < 4000 ; i++ )
+        ck_assert_ptr_eq(stree_find(stree, &keys[i]), &keys[i]);
+
+    // Ordered across shards.
+    values[0] = 0;
+    stree_foldl(stree, test_fold_cb, values);
+    ck_assert_int_eq(values[0], 4000);
+    for( i = 1 ; i <= 4000 ; i++ )
+        ck_assert_int_eq(values[i], i - 1);
+
+    values[0] = 0;
+    stree_foldr(stree, test_fold_cb, values);
+    for( i = 1 ; i <= 4000 ; i++ )
+        ck_assert_int_eq(values[i], 4000 - i);
+
+    // Skip over empty shards.
+    for( i = 500 ; i < 1500 ; i++ )
+        ck_assert_ptr_eq(stree_delete(stree, &keys[i]), &keys[i]);
+    n = 0;
+    if( stree_iter_first(stree, &iter) ) {
+        do {
+            ck_assert_int_eq(*(int *)iter.key, n < 500 ? n : n + 1000);
+            n++;
+        }
+        while( stree_iter_next(&iter) );
+    }
+    ck_assert_int_eq(n, 3000);
+
+    stree_destroy(stree, NULL);
+}
+END_TEST
+
+START_TEST(test_tree_freeze)
+{
+    tree_frozen_t *frozen;
+    tree_frozen_iter_t fiter;
+    tree_iter_t iter;
+    int i, n, probe;
+
+    frozen = tree_freeze(tree);
+    ck_assert_int_eq(tree_frozen_size(frozen), RANDOM_ARRAY_SIZE);
+
+    // The frozen copy doesn't depend on the tree.
+    for( i = 0 ; i < RANDOM_ARRAY_SIZE/2 ; i++ )
+        tree_delete(tree, &random_array[i]);
+    for( i = 0 ; i < RANDOM_ARRAY_SIZE ; i++ )
+        ck_assert_ptr_eq(tree_frozen_find(frozen, &random_array[i]), &random_array[i]);
+    for( i = 0 ; i < RANDOM_ARRAY_SIZE/2 ; i++ )
+        tree_insert(tree, &random_array[i], &random_array[i]);
+
+    for( i = 0 ; i < RANDOM_ARRAY_SIZE ; i++ ) {
+        probe = random_array[i] - (i % 2);
+        if( tree_lower_bound(tree, &probe, &iter) ) {
+            ck_assert_ptr_eq(tree_frozen_lower_bound(frozen, &probe, &fiter), &fiter);
+            ck_assert_ptr_eq(tree_frozen_iter_key(&fiter), tree_iter_key(&iter));
+            ck_assert_ptr_eq(tree_frozen_iter_value(&fiter), tree_iter_value(&iter));
+        }
+        else
+            ck_assert_ptr_eq(tree_frozen_lower_bound(frozen, &probe, &fiter), NULL);
+        if( !tree_find(tree, &probe) )
+            ck_assert_ptr_eq(tree_frozen_find(frozen, &probe), NULL);
+    }
+
+    // Walk all entries in order.
+    probe = -1;
+    n = 0;
+    tree_iter_first(tree, &iter);
+    if( tree_frozen_lower_bound(frozen, &probe, &fiter) ) {
+        do {
+            ck_assert_ptr_eq(tree_frozen_iter_key(&fiter), tree_iter_key(&iter));
+            tree_iter_next(&iter);
+            n++;
+        }
+        while( tree_frozen_iter_next(&fiter) );
+    }
+    ck_assert_int_eq(n, RANDOM_ARRAY_SIZE);
+
+    tree_frozen_destroy(frozen);
+}
+END_TEST
+
+START_TEST(test_tree_freeze_empty)
+{
+    tree_frozen_t *frozen;
+    tree_frozen_iter_t iter;
+    int key = 0;
+
+    frozen = tree_freeze(tree);
+    ck_assert_int_eq(tree_frozen_size(frozen), 0);
+    ck_assert_ptr_eq(tree_frozen_find(frozen, &key), NULL);
+    ck_assert_ptr_eq(tree_frozen_lower_bound(frozen, &key, &iter), NULL);
+    tree_frozen_destroy(frozen);
+}
+END_TEST
+
+START_TEST(test_tree_int_keys)
+{
+    tree_options_t options;
+    tree_frozen_t *frozen;
+    tree_iter_t iter;
+    int64_t ikeys[RANDOM_ARRAY_SIZE], ikey, *prev;
+    uint64_t ukey;
+    void *keys[RANDOM_ARRAY_SIZE];
+    int i, n;
+
+    // Only random_array of the fixture is needed.
+    tree_destroy(tree, NULL);
+    memset(&options, 0, sizeof(options));
+    options.flags = TREE_KEY_INT64 | TREE_ORDER_STATISTICS;
+    tree = tree_create_ext(NULL, &options);
+
+    // Negative keys go first, values come back as given.
+    for( i = 0 ; i < RANDOM_ARRAY_SIZE ; i++ ) {
+        ikeys[i] = (int64_t)random_array[i] - RAND_MAX/2;
+        tree_insert(tree, &ikeys[i], &random_array[i]);
+    }
+    ck_assert_int_eq(tree_size(tree), RANDOM_ARRAY_SIZE);
+    ck_assert_int_gt(tree_check_integrity(tree), 0);
+
+    // Keys live in the nodes, a copy of the key finds the entry.
+    for( i = 0 ; i < RANDOM_ARRAY_SIZE ; i++ ) {
+        ikey = ikeys[i];
+        ck_assert_ptr_eq(tree_find(tree, &ikey), &random_array[i]);
+    }
+
+    prev = NULL;
+    n = 0;
+    if( tree_iter_first(tree, &iter) ) {
+        do {
+            ck_assert_ptr_ne(tree_iter_key(&iter), ikeys);
+            if( prev )
+                ck_assert(*prev < *(int64_t *)tree_iter_key(&iter));
+            prev = tree_iter_key(&iter);
+            ck_assert_ptr_eq(tree_select(tree, n, &iter), &iter);
+            ck_assert_int_eq(tree_rank(tree, prev), n);
+            n++;
+        }
+        while( tree_iter_next(&iter) );
+    }
+    ck_assert_int_eq(n, RANDOM_ARRAY_SIZE);
+
+    frozen = tree_freeze(tree);
+    for( i = 0 ; i < RANDOM_ARRAY_SIZE ; i++ )
+        ck_assert_ptr_eq(tree_frozen_find(frozen, &ikeys[i]), &random_array[i]);
+    tree_frozen_destroy(frozen);
+
+    for( i = 0 ; i < RANDOM_ARRAY_SIZE ; i++ )
+        keys[i] = &ikeys[i];
+    ck_assert_int_eq(tree_delete_batch(tree, keys, RANDOM_ARRAY_SIZE/2, NULL), RANDOM_ARRAY_SIZE/2);
+    ck_assert_int_gt(tree_check_integrity(tree), 0);
+    for( i = 0 ; i < RANDOM_ARRAY_SIZE/2 ; i++ )
+        ck_assert_ptr_eq(tree_find(tree, &ikeys[i]), NULL);
+    for( i = RANDOM_ARRAY_SIZE/2 ; i < RANDOM_ARRAY_SIZE ; i++ )
+        ck_assert_ptr_eq(tree_delete(tree, &ikeys[i]), &random_array[i]);
+    ck_assert_int_eq(tree_size(tree), 0);
+    ck_assert_int_eq(tree_insert_batch(tree, keys, keys, RANDOM_ARRAY_SIZE), RANDOM_ARRAY_SIZE);
+    ck_assert_int_gt(tree_check_integrity(tree), 0);
+    tree_destroy(tree, NULL);
+
+    // Unsigned keys above INT64_MAX sort after the small ones.
+    options.flags = TREE_KEY_UINT64;
+    tree = tree_create_ext(NULL, &options);
+    for( i = 0 ; i < RANDOM_ARRAY_SIZE ; i++ ) {
+        ukey = (uint64_t)random_array[i] << (i % 2 ? 32 : 0);
+        ukey |= i % 2 ? UINT64_C(1) << 63 : 0;
+        tree_insert(tree, &ukey, &random_array[i]);
+    }
+    ck_assert_int_gt(tree_check_integrity(tree), 0);
+    ck_assert_ptr_eq(tree_iter_last(tree, &iter), &iter);
+    ck_assert(*(uint64_t *)tree_iter_key(&iter) >> 63);
+    ck_assert_ptr_eq(tree_iter_first(tree, &iter), &iter);
+    ck_assert(!(*(uint64_t *)tree_iter_key(&iter) >> 63));
+    for( i = 0 ; i < RANDOM_ARRAY_SIZE ; i++ ) {
+        ukey = (uint64_t)random_array[i] << (i % 2 ? 32 : 0);
+        ukey |= i % 2 ? UINT64_C(1) << 63 : 0;
+        ck_assert_ptr_eq(tree_delete(tree, &ukey), &random_array[i]);
+    }
+    ck_assert_int_eq(tree_size(tree), 0);
+}
+END_TEST
+
+// Objects of intrusive trees, the key comes after the hook.
+struct TestItem {
+    tree_hook_t hook;
+    int key;
+};
+
+START_TEST(test_tree_intrusive)
+{
+    struct TestItem items[RANDOM_ARRAY_SIZE], dup, *item;
+    tree_hook_t *hook;
+    tree_t *itree;
+    int i, n, prev;
+
+    itree = tree_create_intrusive(cmp_int, TREE_HOOK_KEY_OFFSET(struct TestItem, hook, key));
+    for( i = 0 ; i < RANDOM_ARRAY_SIZE ; i++ ) {
+        items[i].key = random_array[i];
+        ck_assert_ptr_eq(tree_hook_insert(itree, &items[i].hook), &items[i].hook);
+    }
+    ck_assert_int_eq(tree_size(itree), RANDOM_ARRAY_SIZE);
+    ck_assert_int_gt(tree_check_integrity(itree), 0);
+
+    // A key that's there already leaves the new hook out.
+    dup.key = random_array[0];
+    ck_assert_ptr_eq(tree_hook_insert(itree, &dup.hook), &items[0].hook);
+    ck_assert_int_eq(tree_size(itree), RANDOM_ARRAY_SIZE);
+
+    for( i = 0 ; i < RANDOM_ARRAY_SIZE ; i++ ) {
+        hook = tree_hook_find(itree, &random_array[i]);
+        ck_assert_ptr_eq(TREE_HOOK_ENTRY(hook, struct TestItem, hook), &items[i]);
+    }
+
+    n = 0;
+    for( hook = tree_hook_first(itree) ; hook ; hook = tree_hook_next(hook), n++ ) {
+        item = TREE_HOOK_ENTRY(hook, struct TestItem, hook);
+        if( n > 0 )
+            ck_assert_int_lt(prev, item->key);
+        prev = item->key;
+    }
+    ck_assert_int_eq(n, RANDOM_ARRAY_SIZE);
+    ck_assert_ptr_eq(tree_hook_prev(tree_hook_first(itree)), NULL);
+    item = TREE_HOOK_ENTRY(tree_hook_last(itree), struct TestItem, hook);
+    ck_assert_int_eq(item->key, prev);
+
+    // Deleting relinks hooks, the others stay where they are.
+    for( i = 0 ; i < RANDOM_ARRAY_SIZE/2 ; i++ ) {
+        tree_hook_delete(itree, &items[i].hook);
+        if( i % 50 == 0 )
+            ck_assert_int_gt(tree_check_integrity(itree), 0);
+    }
+    ck_assert_int_gt(tree_check_integrity(itree), 0);
+    ck_assert_int_eq(tree_size(itree), RANDOM_ARRAY_SIZE - RANDOM_ARRAY_SIZE/2);
+    for( i = 0 ; i < RANDOM_ARRAY_SIZE ; i++ ) {
+        hook = tree_hook_find(itree, &random_array[i]);
+        ck_assert_ptr_eq(hook, i < RANDOM_ARRAY_SIZE/2 ? NULL : &items[i].hook);
+        if( i >= RANDOM_ARRAY_SIZE/2 )
+            ck_assert_ptr_eq(tree_hook_lower_bound(itree, &random_array[i]), &items[i].hook);
+    }
+
+    // Deleted hooks can go back in.
+    for( i = 0 ; i < RANDOM_ARRAY_SIZE/2 ; i++ )
+        ck_assert_ptr_eq(tree_hook_insert(itree, &items[i].hook), &items[i].hook);
+    ck_assert_int_gt(tree_check_integrity(itree), 0);
+    ck_assert_int_eq(tree_size(itree), RANDOM_ARRAY_SIZE);
+
+    tree_destroy(itree, NULL);
+}
+END_TEST
+
+START_TEST(test_tree_properties)
+{
+    tree_info_t info;
+
+    ck_assert_ptr_eq(tree_info(tree, &info), &info);
+    ck_assert_int_eq(info.size, tree_size(tree));
+    ck_assert_int_le(info.height, info.min_height*2);
+}
+END_TEST
+
+START_TEST(test_tree_counts)
+{
+    tree_info_t counts, info;
+    int i;
+
+    // Counts kept up by inserts and deletes match a walk over the tree.
+    for( i = 0 ; i < 2 ; i++ ) {
+        tree_info(tree, &info);
+        ck_assert_ptr_eq(tree_counts(tree, &counts), &counts);
+        ck_assert_int_eq(counts.size, info.size);
+        ck_assert_int_eq(counts.black_height, info.black_height);
+        ck_assert_int_eq(counts.red_number, info.red_number);
+        ck_assert_int_eq(counts.black_number, info.black_number);
+        ck_assert_int_eq(counts.height, -1);
+
+        tree_delete(tree, &random_array[0]);
+        tree_delete(tree, &random_array[RANDOM_ARRAY_SIZE/2]);
+        tree_insert(tree, &random_array[0], &random_array[0]);
+    }
+}
+END_TEST
+
+// Entries are saved as the int and as many padding bytes as the int
+// modulo 100, the key 7 takes more than the whole save buffer.
+long encode_int(void *key, void *value, void *buf, long size, void *ctx)
+{
+    long need;
+
+    need = sizeof(int) + (*(int *)key == 7 ? 100000 : *(int *)key % 100);
+    if( need <= size ) {
+        memset(buf, 0xaa, need);
+        memcpy(buf, key, sizeof(int));
+    }
+
+    return need;
+}
+
+int decode_int(const void *buf, long size, void **key, void **value, void *ctx)
+{
+    int *p;
+
+    if( size < (long)sizeof(int) )
+        return -1;
+    p = malloc(sizeof(int));
+    memcpy(p, buf, sizeof(int));
+    *key = *value = p;
+
+    return 0;
+}
+
+int decoded_freed = 0;
+
+void free_decoded(void *value)
+{
+    decoded_freed++;
+    free(value);
+}
+
+long encode_int64(void *key, void *value, void *buf, long size, void *ctx)
+{
+    if( size >= 8 )
+        memcpy(buf, key, 8);
+
+    return 8;
+}
+
+int decode_int64(const void *buf, long size, void **key, void **value, void *ctx)
+{
+    static int64_t ikey;
+
+    memcpy(&ikey, buf, 8);
+    *key = &ikey;
+    *value = NULL;
+
+    return size == 8 ? 0 : -1;
+}
+
+START_TEST(test_tree_save_load)
+{
+    tree_options_t options;
+    tree_iter_t iter, loaded_iter;
+    tree_t *loaded;
+    FILE *f;
+    char *image;
+    long size;
+    int64_t ikey;
+    int seven = 7, i, fd, pipe_fds[2];
+
+    tree_insert(tree, &seven, &seven);
+    f = tmpfile();
+    fd = fileno(f);
+    ck_assert_int_eq(tree_save(tree, fd, encode_int, NULL), 0);
+    size = lseek(fd, 0, SEEK_CUR);
+
+    // The same entries in the same order, built balanced.
+    lseek(fd, 0, SEEK_SET);
+    loaded = tree_load(cmp_int, NULL, fd, decode_int, free, NULL);
+    ck_assert_ptr_ne(loaded, NULL);
+    ck_assert_int_eq(lseek(fd, 0, SEEK_CUR), size);
+    ck_assert_int_eq(tree_size(loaded), tree_size(tree));
+    ck_assert_int_gt(tree_check_integrity(loaded), 0);
+    ck_assert_ptr_ne(tree_iter_first(tree, &iter), NULL);
+    ck_assert_ptr_ne(tree_iter_first(loaded, &loaded_iter), NULL);
+    do {
+        ck_assert_int_eq(*(int *)tree_iter_key(&loaded_iter), *(int *)tree_iter_key(&iter));
+        tree_iter_next(&loaded_iter);
+    }
+    while( tree_iter_next(&iter) );
+    ck_assert_ptr_eq(tree_iter_value(&loaded_iter), NULL);
+    ck_assert_int_eq(*(int *)tree_find(loaded, &seven), 7);
+    tree_destroy(loaded, free);
+
+    // Any damaged byte is caught, what was decoded is handed back.
+    image = malloc(size);
+    lseek(fd, 0, SEEK_SET);
+    ck_assert_int_eq(read(fd, image, size), size);
+    for( i = 0 ; i < 3 ; i++ ) {
+        image[(i + 1)*size/4] ^= 0x10;
+        lseek(fd, 0, SEEK_SET);
+        ck_assert_int_eq(write(fd, image, size), size);
+        lseek(fd, 0, SEEK_SET);
+        decoded_freed = 0;
+        errno = 0;
+        ck_assert_ptr_eq(tree_load(cmp_int, NULL, fd, decode_int, free_decoded, NULL), NULL);
+        ck_assert_int_eq(errno, EINVAL);
+        image[(i + 1)*size/4] ^= 0x10;
+    }
+    ck_assert_int_gt(decoded_freed, 0);
+
+    // Cut short.
+    ck_assert_int_eq(ftruncate(fd, size - 1), 0);
+    lseek(fd, 0, SEEK_SET);
+    ck_assert_ptr_eq(tree_load(cmp_int, NULL, fd, decode_int, free, NULL), NULL);
+    ck_assert_int_eq(errno, EINVAL);
+
+    // A damaged length is caught before the room for the entry is had.
+    lseek(fd, 0, SEEK_SET);
+    ck_assert_int_eq(write(fd, image, size), size);
+    lseek(fd, 16, SEEK_SET);
+    ck_assert_int_eq(write(fd, "\xff\xff\xff\x7f", 4), 4);
+    lseek(fd, 0, SEEK_SET);
+    ck_assert_ptr_eq(tree_load(cmp_int, NULL, fd, decode_int, free, NULL), NULL);
+    ck_assert_int_eq(errno, EINVAL);
+
+    // Keys out of order under another comparator.
+    lseek(fd, 0, SEEK_SET);
+    ck_assert_int_eq(write(fd, image, size), size);
+    lseek(fd, 0, SEEK_SET);
+    ck_assert_ptr_eq(tree_load(cmp_int_gt, NULL, fd, decode_int, free, NULL), NULL);
+    ck_assert_int_eq(errno, EINVAL);
+
+    // A damaged count from a pipe takes no more than the entries that come.
+    image[15] = 0x04;
+    ck_assert_int_eq(pipe(pipe_fds), 0);
+    ck_assert_int_eq(write(pipe_fds[1], image, size < 4096 ? size : 4096), size < 4096 ? size : 4096);
+    close(pipe_fds[1]);
+    ck_assert_ptr_eq(tree_load(cmp_int, NULL, pipe_fds[0], decode_int, free, NULL), NULL);
+    ck_assert_int_eq(errno, EINVAL);
+    close(pipe_fds[0]);
+    free(image);
+    fclose(f);
+
+    // Inline keys, an empty tree.
+    memset(&options, 0, sizeof(options));
+    options.flags = TREE_KEY_INT64 | TREE_ORDER_STATISTICS;
+    for( size = 0 ; size <= RANDOM_ARRAY_SIZE ; size += RANDOM_ARRAY_SIZE ) {
+        tree_destroy(tree, NULL);
+        tree = tree_create_ext(NULL, &options);
+        for( i = 0 ; i < size ; i++ ) {
+            ikey = random_array[i] - RAND_MAX/2;
+            tree_insert(tree, &ikey, NULL);
+        }
+        f = tmpfile();
+        ck_assert_int_eq(tree_save(tree, fileno(f), encode_int64, NULL), 0);
+        lseek(fileno(f), 0, SEEK_SET);
+        loaded = tree_load(NULL, &options, fileno(f), decode_int64, NULL, NULL);
+        ck_assert_ptr_ne(loaded, NULL);
+        ck_assert_int_eq(tree_size(loaded), size);
+        ck_assert_int_gt(tree_check_integrity(loaded), 0);
+        for( i = 0 ; i < size ; i++ ) {
+            ikey = random_array[i] - RAND_MAX/2;
+            ck_assert_int_eq(tree_rank(loaded, &ikey), tree_rank(tree, &ikey));
+        }
+        tree_destroy(loaded, NULL);
+        fclose(f);
+    }
+}
+END_TEST
+
+uint32_t crc32_of(const unsigned char *p, long size)
+{
+    uint32_t c = ~0u;
+    int k;
+
+    while( size-- > 0 ) {
+        c ^= *p++;
+        for( k = 0 ; k < 8 ; k++ )
+            c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+    }
+
+    return ~c;
+}
+
+long encode_key_int(void *key, void *value, void *buf, long size, void *ctx)
+{
+    if( size >= (long)sizeof(int) )
+        memcpy(buf, key, sizeof(int));
+
+    return sizeof(int);
+}
+
+// Values are saved as text.
+long encode_value_text(void *key, void *value, void *buf, long size, void *ctx)
+{
+    char text[32];
+    long n;
+
+    n = snprintf(text, sizeof(text), "v%d", *(int *)value) + 1;
+    if( n <= size )
+        memcpy(buf, text, n);
+
+    return n;
+}
+
+void * sum_image_cb(void *key, void *value, void *acc)
+{
+    *(long *)acc += *(int *)key;
+    return acc;
+}
+
+START_TEST(test_tree_image)
+{
+    tree_image_t *image, *other;
+    tree_image_iter_t iter, *it;
+    tree_iter_t tree_iter;
+    char text[32];
+    FILE *f, *empty;
+    long sum, tree_sum, size;
+    int i, key, lo, hi, fd;
+    unsigned char byte, *data;
+    uint64_t offset, key_offset;
+    uint32_t crc;
+
+    f = tmpfile();
+    fd = fileno(f);
+    ck_assert_int_eq(tree_image_save(tree, fd, encode_key_int, encode_value_text, NULL), 0);
+    image = tree_image_map(fd, cmp_int);
+    ck_assert_ptr_ne(image, NULL);
+    ck_assert_int_eq(tree_image_size(image), RANDOM_ARRAY_SIZE);
+    ck_assert_int_eq(tree_image_check(image), 1);
+
+    // Keys and values are read where they are mapped.
+    for( i = 0 ; i < RANDOM_ARRAY_SIZE ; i++ ) {
+        snprintf(text, sizeof(text), "v%d", random_array[i]);
+        ck_assert_str_eq((char *)tree_image_find(image, &random_array[i]), text);
+        key = random_array[i] + 1;
+        if( !tree_find(tree, &key) )
+            ck_assert_ptr_eq(tree_image_find(image, &key), NULL);
+    }
+
+    // Entries come in key order from the lower bound on.
+    key = INT32_MIN;
+    it = tree_image_lower_bound(image, &key, &iter);
+    ck_assert_ptr_ne(tree_iter_first(tree, &tree_iter), NULL);
+    do {
+        ck_assert_ptr_ne(it, NULL);
+        ck_assert_int_eq(*(int *)tree_image_iter_key(it), *(int *)tree_iter_key(&tree_iter));
+        it = tree_image_iter_next(it);
+    }
+    while( tree_iter_next(&tree_iter) );
+    ck_assert_ptr_eq(it, NULL);
+    key = INT32_MAX;
+    ck_assert_ptr_eq(tree_image_lower_bound(image, &key, &iter), NULL);
+
+    for( i = 0 ; i < 10 ; i++ ) {
+        lo = random_array[i] < random_array[i + 1] ? random_array[i] : random_array[i + 1];
+        hi = random_array[i] < random_array[i + 1] ? random_array[i + 1] : random_array[i];
+        sum = tree_sum = 0;
+        tree_image_fold_range(image, &lo, &hi, sum_image_cb, &sum);
+        tree_fold_range(tree, &lo, &hi, sum_image_cb, &tree_sum);
+        ck_assert_int_eq(sum, tree_sum);
+    }
+
+    // Another mapping of the same file, no values this time.
+    empty = tmpfile();
+    ck_assert_int_eq(tree_image_save(tree, fileno(empty), encode_key_int, NULL, NULL), 0);
+    other = tree_image_map(fileno(empty), cmp_int);
+    ck_assert_ptr_ne(other, NULL);
+    ck_assert_ptr_ne(tree_image_lower_bound(other, &random_array[0], &iter), NULL);
+    ck_assert_ptr_eq(tree_image_iter_value(&iter), NULL);
+    ck_assert_int_eq(tree_image_check(other), 1);
+    tree_image_unmap(other);
+    fclose(empty);
+
+    // A damaged byte fails the check, not the mapping.
+    tree_image_unmap(image);
+    ck_assert_int_eq(pread(fd, &byte, 1, 100), 1);
+    byte ^= 1;
+    ck_assert_int_eq(pwrite(fd, &byte, 1, 100), 1);
+    image = tree_image_map(fd, cmp_int);
+    ck_assert_ptr_ne(image, NULL);
+    ck_assert_int_eq(tree_image_check(image), 0);
+    tree_image_unmap(image);
+    fclose(f);
+
+    // The root as its own left child with the checksum made to match:
+    // the check fails, searches of the unchecked image still end.
+    f = tmpfile();
+    fd = fileno(f);
+    ck_assert_int_eq(tree_image_save(tree, fd, encode_key_int, NULL, NULL), 0);
+    size = lseek(fd, 0, SEEK_END);
+    data = malloc(size);
+    ck_assert_int_eq(pread(fd, data, size, 0), size);
+    memcpy(&offset, data + 40, 8);
+    memcpy(data + offset, &offset, 8);
+    crc = crc32_of(data + 48, size - 48);
+    memcpy(data + 12, &crc, 4);
+    ck_assert_int_eq(pwrite(fd, data, size, 0), size);
+    free(data);
+    image = tree_image_map(fd, cmp_int);
+    ck_assert_ptr_ne(image, NULL);
+    ck_assert_int_eq(tree_image_check(image), 0);
+    key = INT32_MIN;
+    ck_assert_ptr_eq(tree_image_find(image, &key), NULL);
+    ck_assert_ptr_ne(tree_image_lower_bound(image, &key, &iter), NULL);
+    tree_image_unmap(image);
+    fclose(f);
+
+    // A key off its alignment, the checksum made to match again.
+    f = tmpfile();
+    fd = fileno(f);
+    ck_assert_int_eq(tree_image_save(tree, fd, encode_key_int, NULL, NULL), 0);
+    data = malloc(size);
+    ck_assert_int_eq(pread(fd, data, size, 0), size);
+    memcpy(&offset, data + 40, 8);
+    memcpy(&key_offset, data + offset + 24, 8);
+    key_offset += 1;
+    memcpy(data + offset + 24, &key_offset, 8);
+    crc = crc32_of(data + 48, size - 48);
+    memcpy(data + 12, &crc, 4);
+    ck_assert_int_eq(pwrite(fd, data, size, 0), size);
+    free(data);
+    image = tree_image_map(fd, cmp_int);
+    ck_assert_ptr_ne(image, NULL);
+    ck_assert_int_eq(tree_image_check(image), 0);
+    tree_image_unmap(image);
+    fclose(f);
+
+    // Not an image: an image of tree_save(), an empty file.
+    f = tmpfile();
+    ck_assert_int_eq(tree_save(tree, fileno(f), encode_int, NULL), 0);
+    errno = 0;
+    ck_assert_ptr_eq(tree_image_map(fileno(f), cmp_int), NULL);
+    ck_assert_int_eq(errno, EINVAL);
+    // Images start their file.
+    ck_assert_int_eq(tree_image_save(tree, fileno(f), encode_key_int, NULL, NULL), -1);
+    fclose(f);
+
+    tree_destroy(tree, NULL);
+    tree = tree_create(cmp_int);
+    f = tmpfile();
+    ck_assert_int_eq(tree_image_save(tree, fileno(f), encode_key_int, NULL, NULL), 0);
+    image = tree_image_map(fileno(f), cmp_int);
+    ck_assert_ptr_ne(image, NULL);
+    ck_assert_int_eq(tree_image_size(image), 0);
+    ck_assert_ptr_eq(tree_image_find(image, &random_array[0]), NULL);
+    ck_assert_ptr_eq(tree_image_lower_bound(image, &random_array[0], &iter), NULL);
+    ck_assert_int_eq(tree_image_check(image), 1);
+    tree_image_unmap(image);
+    fclose(f);
+}
+END_TEST
+
+START_TEST(test_tree_stats)
+{
+    static int seq[16384];
+    tree_stats_t stats, after;
+    tree_options_t options;
+    tree_t *shared, *singles, *lo, *hi;
+    void *batch[64];
+    long fixups, batch_comparisons;
+    int i;
+
+    if( !tree_stats(tree, &stats) ) {
+        // Built without TREE_STATS.
+        ck_assert_int_eq(stats.inserts, 0);
+        ck_assert_int_eq(stats.comparisons, 0);
+        return;
+    }
+
+    // Every insert enters the fix-up, case 3 may start it over at the
+    // grandparent. A random tree can't be built without rotations.
+    ck_assert_int_eq(stats.inserts, RANDOM_ARRAY_SIZE);
+    ck_assert_int_eq(stats.deletes, 0);
+    ck_assert_int_gt(stats.insert_cases[0], RANDOM_ARRAY_SIZE);
+    ck_assert_int_le(stats.insert_cases[0], RANDOM_ARRAY_SIZE + stats.insert_cases[2]);
+    ck_assert_int_gt(stats.rotations, 0);
+    ck_assert_int_gt(stats.recolorings, 0);
+    ck_assert_int_ge(stats.lookups, 2*RANDOM_ARRAY_SIZE);
+    ck_assert_int_gt(stats.comparisons, stats.lookups);
+
+    for( i = 0 ; i < RANDOM_ARRAY_SIZE/2 ; i++ )
+        tree_delete(tree, &random_array[i]);
+    tree_stats(tree, &after);
+    ck_assert_int_eq(after.deletes, RANDOM_ARRAY_SIZE/2);
+    ck_assert_int_eq(after.inserts, stats.inserts);
+    ck_assert_int_ge(after.lookups, stats.lookups + RANDOM_ARRAY_SIZE/2);
+    ck_assert_int_ge(after.rotations, stats.rotations);
+    fixups = 0;
+    for( i = 0 ; i < 6 ; i++ )
+        fixups += after.delete_cases[i];
+    ck_assert_int_gt(fixups, 0);
+    ck_assert_int_gt(tree_check_integrity(tree), 0);
+
+    // Pieces count into the tree they come from, the tree split off starts
+    // from zero.
+    stats = after;
+    tree_split(tree, &random_array[3*RANDOM_ARRAY_SIZE/4], &lo, &hi);
+    ck_assert_ptr_eq(lo, tree);
+    tree_stats(tree, &after);
+    ck_assert_int_eq(after.inserts, stats.inserts);
+    ck_assert_int_eq(after.deletes, stats.deletes);
+    ck_assert_int_gt(after.comparisons, stats.comparisons);
+    ck_assert_int_ge(after.rotations, stats.rotations);
+    tree_stats(hi, &stats);
+    ck_assert_int_eq(stats.inserts, 0);
+    ck_assert_int_eq(stats.comparisons, 0);
+    stats = after;
+    ck_assert_ptr_eq(tree_union(tree, hi, NULL), tree);
+    tree_stats(tree, &after);
+    ck_assert_int_eq(after.inserts, stats.inserts);
+    ck_assert_int_eq(after.deletes, stats.deletes);
+    ck_assert_int_gt(after.comparisons, stats.comparisons);
+    ck_assert_int_ge(after.rotations, stats.rotations);
+    ck_assert_int_ge(after.recolorings, stats.recolorings);
+    ck_assert_int_eq(tree_size(tree), RANDOM_ARRAY_SIZE - RANDOM_ARRAY_SIZE/2);
+    ck_assert_int_gt(tree_check_integrity(tree), 0);
+
+    // Readers of shared trees would race on lookups and comparisons.
+    memset(&options, 0, sizeof(options));
+    options.flags = TREE_SHARED;
+    shared = tree_create_ext(cmp_int, &options);
+    for( i = 0 ; i < RANDOM_ARRAY_SIZE ; i++ )
+        tree_insert(shared, &random_array[i], &random_array[i]);
+    for( i = 0 ; i < RANDOM_ARRAY_SIZE ; i++ )
+        ck_assert_ptr_eq(tree_find(shared, &random_array[i]), &random_array[i]);
+    tree_stats(shared, &after);
+    ck_assert_int_eq(after.inserts, RANDOM_ARRAY_SIZE);
+    ck_assert_int_eq(after.lookups, 0);
+    ck_assert_int_eq(after.comparisons, 0);
+    tree_destroy(shared, NULL);
+
+    // A small batch of deletes walks from key to key, one by one every
+    // key is looked for from the root.
+    for( i = 0 ; i < 16384 ; i++ )
+        seq[i] = i;
+    for( i = 0 ; i < 64 ; i++ )
+        batch[i] = &seq[1000 + i];
+    singles = tree_create(cmp_int);
+    tree_destroy(tree, NULL);
+    tree = tree_create(cmp_int);
+    for( i = 0 ; i < 16384 ; i++ ) {
+        tree_insert(tree, &seq[i], NULL);
+        tree_insert(singles, &seq[i], NULL);
+    }
+    tree_stats(tree, &stats);
+    ck_assert_int_eq(tree_delete_batch(tree, batch, 64, NULL), 64);
+    tree_stats(tree, &after);
+    ck_assert_int_gt(tree_check_integrity(tree), 0);
+    batch_comparisons = after.comparisons - stats.comparisons;
+    tree_stats(singles, &stats);
+    for( i = 0 ; i < 64 ; i++ )
+        tree_delete(singles, batch[i]);
+    tree_stats(singles, &after);
+    ck_assert_int_lt(batch_comparisons, (after.comparisons - stats.comparisons)/2);
+    tree_destroy(singles, NULL);
+}
+END_TEST
+
+START_TEST(test_tree_integrity)
+{
+    ck_assert_int_gt(tree_check_integrity(tree), 0);
+}
+END_TEST
+
+Suite * tree_suite()
+{
+    Suite *s;
+    TCase *tc;
+
+    s = suite_create("Red-black Tree");
+
+    tc = tcase_create("Tree create");
+    tcase_add_test(tc, test_tree_create);
+    tcase_add_test(tc, test_tree_create_ext);
+    tcase_add_test(tc, test_tree_no_memory);
+    tcase_add_test(tc, test_tree_destroy);
+    tcase_add_test(tc, test_tree_build_sorted);
+    suite_add_tcase(s, tc);
+
+    tc = tcase_create("Tree basics");
+    tcase_add_checked_fixture(tc, init_testcase, end_testcase);
+    tcase_add_test(tc, test_tree_basics);
+    tcase_add_test(tc, test_tree_upsert);
+    suite_add_tcase(s, tc);
+
+    tc = tcase_create("Tree fold");
+    tcase_add_checked_fixture(tc, init_testcase_random_data, end_testcase_random_data);
+    tcase_add_test(tc, test_tree_foldl);
+    tcase_add_test(tc, test_tree_foldr);
+    tcase_add_test(tc, test_tree_fold_until);
+    suite_add_tcase(s, tc);
+
+    tc = tcase_create("Tree iterator");
+    tcase_add_checked_fixture(tc, init_testcase_random_data, end_testcase_random_data);
+    tcase_add_test(tc, test_tree_iter);
+    tcase_add_test(tc, test_tree_bounds);
+    tcase_add_test(tc, test_tree_fold_range);
+    tcase_add_test(tc, test_tree_freeze);
+    tcase_add_test(tc, test_tree_delete_at);
+    suite_add_tcase(s, tc);
+
+    tc = tcase_create("Tree order statistics");
+    tcase_add_checked_fixture(tc, init_testcase_random_data_os, end_testcase_random_data);
+    tcase_add_test(tc, test_tree_select_rank);
+    tcase_add_test(tc, test_tree_churn);
+    tcase_add_test(tc, test_tree_integrity);
+    tcase_add_test(tc, test_tree_delete_at);
+    suite_add_tcase(s, tc);
+
+    tc = tcase_create("Tree order statistics (no counts)");
+    tcase_add_checked_fixture(tc, init_testcase_random_data, end_testcase_random_data);
+    tcase_add_test(tc, test_tree_select_rank);
+    suite_add_tcase(s, tc);
+
+    tc = tcase_create("Tree iterator (empty tree)");
+    tcase_add_checked_fixture(tc, init_testcase, end_testcase);
+    tcase_add_test(tc, test_tree_iter_empty);
+    tcase_add_test(tc, test_tree_freeze_empty);
+    suite_add_tcase(s, tc);
+
+    tc = tcase_create("Tree properties");
+    tcase_add_checked_fixture(tc, init_testcase_random_data, end_testcase_random_data);
+    tcase_add_test(tc, test_tree_properties);
+    tcase_add_test(tc, test_tree_counts);
+    tcase_add_test(tc, test_tree_stats);
+    tcase_add_test(tc, test_tree_integrity);
+    tcase_add_test(tc, test_tree_integrity_report);
+    tcase_add_test(tc, test_tree_churn);
+    suite_add_tcase(s, tc);
+
+    tc = tcase_create("Tree join and split");
+    tcase_add_checked_fixture(tc, init_testcase_random_data, end_testcase_random_data);
+    tcase_add_test(tc, test_tree_join_split);
+    tcase_add_test(tc, test_tree_set_operations);
+    suite_add_tcase(s, tc);
+
+    tc = tcase_create("Tree join and split (order statistics)");
+    tcase_add_checked_fixture(tc, init_testcase_random_data_os, end_testcase_random_data);
+    tcase_add_test(tc, test_tree_join_split);
+    tcase_add_test(tc, test_tree_select_rank);
+    suite_add_tcase(s, tc);
+
+    tc = tcase_create("Concurrent tree");
+    tcase_add_test(tc, test_ctree_basics);
+    tcase_add_test(tc, test_ctree_threads);
+    suite_add_tcase(s, tc);
+
+    tc = tcase_create("Persistent tree");
+    tcase_add_checked_fixture(tc, init_testcase_random_data, end_testcase_random_data);
+    tcase_add_test(tc, test_ptree_snapshot);
+    suite_add_tcase(s, tc);
+
+    tc = tcase_create("Sharded tree");
+    tcase_add_test(tc, test_stree);
+    suite_add_tcase(s, tc);
+
+    tc = tcase_create("Tree batch");
+    tcase_add_checked_fixture(tc, init_testcase_random_data, end_testcase_random_data);
+    tcase_add_test(tc, test_tree_batch);
+    suite_add_tcase(s, tc);
+
+    tc = tcase_create("Tree batch (order statistics)");
+    tcase_add_checked_fixture(tc, init_testcase_random_data_os, end_testcase_random_data);
+    tcase_add_test(tc, test_tree_batch);
+    suite_add_tcase(s, tc);
+
+    tc = tcase_create("Tree integer keys");
+    tcase_add_checked_fixture(tc, init_testcase_random_data, end_testcase_random_data);
+    tcase_add_test(tc, test_tree_int_keys);
+    suite_add_tcase(s, tc);
+
+    tc = tcase_create("Intrusive tree");
+    tcase_add_checked_fixture(tc, init_testcase_random_data, end_testcase_random_data);
+    tcase_add_test(tc, test_tree_intrusive);
+    suite_add_tcase(s, tc);
+
+    tc = tcase_create("Tree save and load");
+    tcase_add_checked_fixture(tc, init_testcase_random_data, end_testcase_random_data);
+    tcase_add_test(tc, test_tree_save_load);
+    tcase_add_test(tc, test_tree_image);
+    suite_add_tcase(s, tc);
+
+    tc = tcase_create("Tree integrity");
+    tcase_add_test(tc, test_tree_integrity_order);
     suite_add_tcase(s, tc);
 
     return s;
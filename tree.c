@@ -1,103 +1,531 @@
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "tree.h"
 
+// The color is kept in the lowest bit of the parent pointer.
+// Nodes are at least pointer aligned so the bit is always free.
+// The links are laid out as tree_hook_t: nodes of intrusive trees are hooks,
+// they have no key or value and are never allocated here.
 struct TreeNode {
-    tree_t *tree;
-    struct TreeNode *parent;
+    uintptr_t parent_color;
     struct TreeNode *left;
     struct TreeNode *right;
-    enum {
-        RED,
-        BLACK
-    } color;
-    void *key;
+    // Trees with TREE_KEY_INT64 or TREE_KEY_UINT64 keep keys in the node.
+    union {
+        void *key;
+        int64_t ikey;
+        uint64_t ukey;
+    };
     void *value;
 };
 
-#define IS_RED(node)       ((node) != NULL && (node)->color == RED)
-#define IS_BLACK(node)     ((node) == NULL || (node)->color == BLACK)
+#define RED     0
+#define BLACK   1
+
+#define PARENT(node)       ((struct TreeNode *)((node)->parent_color & ~(uintptr_t)1))
+#define COLOR(node)        ((int)((node)->parent_color & 1))
+#define SET_PARENT(node, p) \
+    ((node)->parent_color = (uintptr_t)(p) | ((node)->parent_color & 1))
+#define SET_COLOR(node, c) \
+    ((node)->parent_color = ((node)->parent_color & ~(uintptr_t)1) | (c))
+
+#define IS_RED(node)       ((node) != NULL && COLOR(node) == RED)
+#define IS_BLACK(node)     ((node) == NULL || COLOR(node) == BLACK)
+
+// Counters of tree_stats(), compiled in with TREE_STATS only.
+// Readers of TREE_SHARED trees run concurrently, what they do isn't counted.
+#ifdef TREE_STATS
+#define STAT(tree, counter)        ((void)(tree)->stats->counter++)
+#define STAT_READ(tree, counter) \
+    ((tree)->options.flags & TREE_SHARED ? (void)0 : STAT(tree, counter))
+#else
+#define STAT(tree, counter)        ((void)0)
+#define STAT_READ(tree, counter)   ((void)0)
+#endif
+#define CMP(tree, a, b)            (STAT_READ(tree, comparisons), (tree)->cmp(a, b))
+// Recoloring done to rebalance, it keeps the number of red nodes.
+#define RECOLOR(tree, node, c) \
+    (STAT(tree, recolorings), tree_red_add(tree, ((c) == RED) - IS_RED(node)), SET_COLOR(node, c))
+
+// Node layout of trees created with TREE_ORDER_STATISTICS.
+struct TreeNodeOS {
+    struct TreeNode node;
+    long count;
+};
+
+#define COUNT(node)        ((node) ? ((struct TreeNodeOS *)(node))->count : 0)
+#define SET_COUNT(node, c) (((struct TreeNodeOS *)(node))->count = (c))
+#define UPDATE_COUNT(node) SET_COUNT(node, COUNT((node)->left) + COUNT((node)->right) + 1)
+
+#define HAS_COUNT(tree)    ((tree)->options.flags & TREE_ORDER_STATISTICS)
+
+// Set by tree_create_intrusive(), out of the way of the flags of tree.h.
+#define TREE_INTRUSIVE     0x100
+
+#define KEY_TYPE(tree)     ((tree)->options.flags & (TREE_KEY_INT64 | TREE_KEY_UINT64))
+#define INTRUSIVE(tree)    ((tree)->options.flags & TREE_INTRUSIVE)
+#define HOOK_KEY(tree, node) ((void *)((char *)(node) + (tree)->key_offset))
+// The key as callers see it: inline keys are handed out by pointer.
+#define KEY(tree, node) \
+    (!((tree)->options.flags & (TREE_KEY_INT64 | TREE_KEY_UINT64 | TREE_INTRUSIVE)) ? (node)->key \
+        : KEY_TYPE(tree) ? (void *)&(node)->ikey : HOOK_KEY(tree, node))
+
+// Nodes are carved from slabs. Destroyed nodes are kept in a free list
+// and reused by subsequent inserts. Memory goes back to the system only
+// when the tree is destroyed.
+// Trees that exchange nodes (split, join, set operations) share a pool.
+// When two pools are joined one of them hands its slabs over to the other
+// and forwards to it, refs counts trees and pools pointing to a pool.
+#define TREE_POOL_SLAB_MIN 32
+#define TREE_POOL_SLAB_MAX 8192
+
+struct TreePoolSlab {
+    struct TreePoolSlab *next;
+};
+
+struct TreePoolItem {
+    struct TreePoolItem *next;
+};
+
+struct TreePool {
+    long refs;
+    struct TreePool *merged;
+    struct TreePoolSlab *slabs;
+    struct TreePoolSlab *last_slab;
+    struct TreePoolItem *free_list;
+    struct TreePoolItem *last_free;
+    char *next;
+    char *end;
+    size_t slab_nodes;
+};
+
+// A batch is merged into the tree and the tree is rebuilt
+// if the batch is at least 1/TREE_BATCH_REBUILD_RATIO of the tree size.
+#define TREE_BATCH_REBUILD_RATIO 4
+
+struct TreeBatchEntry {
+    void *key;
+    void *value;
+};
 
 struct Tree {
     struct TreeNode *root;
     tree_cmp_t cmp;
+    // Negative if unknown (after split and set operations), see tree_size().
     long size;
+    // Number of black nodes on any path from the root down.
+    long black_height;
+    // Negative if unknown like size, counted again by tree_counts().
+    long red_number;
+    tree_options_t options;
+    size_t node_size;
+    struct TreePool *pool;
+    // Intrusive trees: where the key is relative to the hook.
+    long key_offset;
+#ifdef TREE_STATS
+    // Allocated with the tree, pieces copied from it count into it.
+    tree_stats_t *stats;
+#endif
 };
 
-static void tree_destroy_subtree(struct TreeNode *node, void (*destructor)(void *));
-static struct TreeNode * tree_find_node(tree_t *tree, void *key);
-
-static void tree_insert1(struct TreeNode *node);
-static void tree_insert2(struct TreeNode *node);
-static void tree_insert3(struct TreeNode *node);
-static void tree_insert4(struct TreeNode *node);
-static void tree_insert5(struct TreeNode *node);
-
-static void tree_delete1(struct TreeNode *node);
-static void tree_delete2(struct TreeNode *node);
-static void tree_delete3(struct TreeNode *node);
-static void tree_delete4(struct TreeNode *node);
-static void tree_delete5(struct TreeNode *node);
-static void tree_delete6(struct TreeNode *node);
-
-static void tree_rotate_left(struct TreeNode *node);
-static void tree_rotate_right(struct TreeNode *node);
+// Keys and values of the entry at position i of the Eytzinger layout are
+// keys[i] and values[i], positions start from 1. The children of position
+// i are 2*i and 2*i + 1.
+// Inline keys are copied to ikeys, keys point to them.
+struct TreeFrozen {
+    tree_cmp_t cmp;
+    long size;
+    int key_type;
+    void **keys;
+    void **values;
+    int64_t *ikeys;
+};
 
-static void * tree_node_foldl(struct TreeNode *node, void * (*fun)(void *, void *, void *), void *acc);
-static void * tree_node_foldr(struct TreeNode *node, void * (*fun)(void *, void *, void *), void *acc);
+// Buffered reads and writes of tree_save() and tree_load(). Every byte
+// that goes through buf is added to crc.
+struct TreeFile {
+    int fd;
+    unsigned char *buf;
+    long size;
+    long len;
+    long pos;
+    // Bytes written out of buf so far.
+    long offset;
+    uint32_t crc;
+    uint32_t crc_table[256];
+};
 
-static struct TreeNode * tree_node_create(void *key, void *value);
-static void tree_node_destroy(struct TreeNode *node);
+// Cache line and the number of key pointers in it. Four levels below
+// position i are the 16 positions from 16*i, two cache lines.
+#define TREE_CACHE_LINE         64
+#define TREE_FROZEN_PREFETCH    16
+// Prefetch both lines below pos that are in keys, a pointer past the
+// array is undefined even if nothing is read through it.
+#define FROZEN_PREFETCH(frozen, keys, pos) \
+    do { \
+        if( (pos)*TREE_FROZEN_PREFETCH <= (frozen)->size ) \
+            __builtin_prefetch((keys) + (pos)*TREE_FROZEN_PREFETCH); \
+        if( (pos)*TREE_FROZEN_PREFETCH + TREE_FROZEN_PREFETCH/2 <= (frozen)->size ) \
+            __builtin_prefetch((keys) + (pos)*TREE_FROZEN_PREFETCH + TREE_FROZEN_PREFETCH/2); \
+    } while( 0 )
+
+static int tree_cmp_int64(const void *a, const void *b);
+static int tree_cmp_uint64(const void *a, const void *b);
+
+static tree_t * tree_alloc(void);
+static void tree_destroy_subtree(tree_t *tree, struct TreeNode *node, void (*destructor)(void *));
+static int tree_build(tree_t *tree, struct TreeNode **nodes, void **keys, void **values, long n);
+static struct TreeNode * tree_build_subtree(tree_t *tree, struct TreeNode **nodes,
+    void **keys, void **values, long lo, long hi, long depth, long red_depth, int *failed);
+static struct TreeNode * tree_find_node(tree_t *tree, void *key);
+static struct TreeNode * tree_find_bound(tree_t *tree, void *key, int strict);
+static struct TreeNode * tree_find_floor(tree_t *tree, void *key);
+
+static struct TreeNode ** tree_find_link(tree_t *tree, void *key, struct TreeNode **parent);
+static struct TreeNode * tree_insert_at(tree_t *tree, struct TreeNode *parent,
+    struct TreeNode **link, void *key, void *value);
+static void tree_link_node(tree_t *tree, struct TreeNode *parent,
+    struct TreeNode **link, struct TreeNode *node);
+static void * tree_delete_node(tree_t *tree, struct TreeNode *node);
+static void tree_unlink_node(tree_t *tree, struct TreeNode *node);
+static void tree_swap_nodes(tree_t *tree, struct TreeNode *node, struct TreeNode *heir);
+
+static struct TreeBatchEntry * tree_batch_alloc(long n);
+static long tree_batch_prepare(tree_t *tree, struct TreeBatchEntry *entries, void **keys, void **values, long n);
+static struct TreeNode * tree_finger_climb(tree_t *tree, struct TreeNode *node, void *key);
+static long tree_insert_batch_finger(tree_t *tree, struct TreeBatchEntry *entries, long n);
+static long tree_insert_batch_rebuild(tree_t *tree, struct TreeBatchEntry *entries, long n);
+static long tree_delete_batch_finger(tree_t *tree, struct TreeBatchEntry *entries, long n,
+    void (*destructor)(void *));
+static long tree_delete_batch_rebuild(tree_t *tree, struct TreeBatchEntry *entries, long n,
+    void (*destructor)(void *));
+
+static int tree_compatible(tree_t *tree, tree_t *other);
+static void tree_adopt(tree_t *tree, tree_t *other);
+static void tree_piece_init(tree_t *piece, tree_t *tree, struct TreeNode *root, long black_height);
+static void tree_piece_detach(tree_t *tree, tree_t *piece);
+static struct TreeNode * tree_piece_expose(tree_t *piece, tree_t *left, tree_t *right);
+static void tree_piece_join(tree_t *left, struct TreeNode *node, tree_t *right);
+static struct TreeNode * tree_piece_split(tree_t *piece, void *key, tree_t *lo, tree_t *hi);
+static void tree_piece_concat(tree_t *left, tree_t *right);
+static void tree_piece_destroy(tree_t *piece, void (*destructor)(void *));
+static void tree_piece_node_destroy(tree_t *piece, struct TreeNode *node, void (*destructor)(void *));
+static void tree_piece_union(tree_t *t1, tree_t *t2, void (*destructor)(void *));
+static void tree_piece_intersection(tree_t *t1, tree_t *t2, void (*destructor)(void *));
+static void tree_piece_difference(tree_t *t1, tree_t *t2, void (*destructor)(void *));
+static tree_t * tree_set_operation(tree_t *t1, tree_t *t2, void (*destructor)(void *),
+    void (*operation)(tree_t *, tree_t *, void (*)(void *)));
+
+static void tree_insert1(tree_t *tree, struct TreeNode *node);
+static void tree_insert2(tree_t *tree, struct TreeNode *node);
+static void tree_insert3(tree_t *tree, struct TreeNode *node);
+static void tree_insert4(tree_t *tree, struct TreeNode *node);
+static void tree_insert5(tree_t *tree, struct TreeNode *node);
+
+static void tree_delete1(tree_t *tree, struct TreeNode *node);
+static void tree_delete2(tree_t *tree, struct TreeNode *node);
+static void tree_delete3(tree_t *tree, struct TreeNode *node);
+static void tree_delete4(tree_t *tree, struct TreeNode *node);
+static void tree_delete5(tree_t *tree, struct TreeNode *node);
+static void tree_delete6(tree_t *tree, struct TreeNode *node);
+
+static void tree_rotate_left(tree_t *tree, struct TreeNode *node);
+static void tree_rotate_right(tree_t *tree, struct TreeNode *node);
+
+static void tree_count_add(struct TreeNode *node, long delta);
+static void tree_red_add(tree_t *tree, long delta);
+static void tree_recount(tree_t *tree);
+
+static void * tree_node_foldl(tree_t *tree, struct TreeNode *node, void * (*fun)(void *, void *, void *), void *acc);
+static void * tree_node_foldr(tree_t *tree, struct TreeNode *node, void * (*fun)(void *, void *, void *), void *acc);
+
+static long tree_frozen_first(long size, long pos);
+static long tree_frozen_next(long size, long pos);
+
+static void tree_file_init(struct TreeFile *file, int fd);
+static void tree_file_crc(struct TreeFile *file, const unsigned char *p, long size);
+static void tree_file_put(unsigned char *p, uint64_t x, int size);
+static uint64_t tree_file_get(const unsigned char *p, int size);
+static int tree_file_write(int fd, const unsigned char *p, long size);
+static int tree_file_flush(struct TreeFile *file);
+static int tree_file_reserve(struct TreeFile *file, long size);
+static long tree_file_encode(struct TreeFile *file, long prefix, tree_encode_t encode, void *key, void *value, void *ctx);
+static int tree_file_pad(struct TreeFile *file);
+
+static uint64_t tree_image_node_offset(tree_image_t *image, long pos);
+static const unsigned char * tree_file_read(struct TreeFile *file, long size);
+
+static struct TreeNode * tree_node_create(tree_t *tree, void *key, void *value);
+static void tree_node_destroy(tree_t *tree, struct TreeNode *node);
+
+static struct TreePool * tree_pool_create(void);
+static struct TreePool * tree_pool_get(tree_t *tree);
+static void tree_pool_merge(struct TreePool *pool, struct TreePool *other);
+static void tree_pool_release(struct TreePool *pool);
+static void * tree_pool_alloc(struct TreePool *pool, size_t size);
+static int tree_pool_reserve(struct TreePool *pool, size_t size, long n);
+static int tree_pool_grow(struct TreePool *pool, size_t size, long n);
+static void tree_pool_free(struct TreePool *pool, void *ptr);
 
 static struct TreeNode * tree_node_grandparent(struct TreeNode *node);
 static struct TreeNode * tree_node_uncle(struct TreeNode *node);
 static struct TreeNode * tree_node_sibling(struct TreeNode *node);
 static struct TreeNode * tree_node_max(struct TreeNode *node);
 static struct TreeNode * tree_node_min(struct TreeNode *node);
+static struct TreeNode * tree_node_next(struct TreeNode *node);
+static struct TreeNode * tree_node_prev(struct TreeNode *node);
+
+static struct TreeNode * tree_node_walk(struct TreeNode *node, struct TreeNode *prev);
 
 static tree_info_t * tree_node_info(struct TreeNode *node, tree_info_t *info);
-static int tree_node_check_integrity(struct TreeNode *node);
+static int tree_node_check_integrity(tree_t *tree, struct TreeNode *node);
+static int tree_integrity_fail(tree_t *tree, tree_integrity_t *report, int error, struct TreeNode *node, long depth);
+
+// A zeroed tree, with TREE_STATS its counters follow it in the same block.
+static tree_t * tree_alloc(void)
+{
+    tree_t *tree;
+
+#ifdef TREE_STATS
+    tree = calloc(1, sizeof(tree_t) + sizeof(tree_stats_t));
+    if( tree )
+        tree->stats = (tree_stats_t *)(tree + 1);
+#else
+    tree = calloc(1, sizeof(tree_t));
+#endif
+    return tree;
+}
 
 tree_t * tree_create(tree_cmp_t cmp)
+{
+    return tree_create_ext(cmp, NULL);
+}
+
+tree_t * tree_create_ext(tree_cmp_t cmp, const tree_options_t *options)
+{
+    tree_t *tree;
+
+    tree = tree_alloc();
+    if( !tree )
+        return NULL;
+
+    tree->cmp = cmp;
+    if( options )
+        tree->options = *options;
+    // Comparators for what the generic code passes around: pointers to keys.
+    if( KEY_TYPE(tree) == TREE_KEY_INT64 )
+        tree->cmp = tree_cmp_int64;
+    else if( KEY_TYPE(tree) == TREE_KEY_UINT64 )
+        tree->cmp = tree_cmp_uint64;
+    tree->node_size = HAS_COUNT(tree) ? sizeof(struct TreeNodeOS) : sizeof(struct TreeNode);
+    if( !tree->options.alloc )
+        tree->pool = tree_pool_create();
+
+    return tree;
+}
+
+tree_t * tree_create_intrusive(tree_cmp_t cmp, long key_offset)
 {
     tree_t *tree;
 
-    tree = malloc(sizeof(tree_t));
-    memset(tree, 0, sizeof(*tree));
+    tree = tree_alloc();
+    if( !tree )
+        return NULL;
 
     tree->cmp = cmp;
+    tree->options.flags = TREE_INTRUSIVE;
+    tree->key_offset = key_offset;
 
     return tree;
 }
 
 void tree_destroy(tree_t *tree, void (*destructor)(void *))
 {
-    if( tree->root )
-        tree_destroy_subtree(tree->root, destructor);
+    // Hooks belong to the caller.
+    if( INTRUSIVE(tree) ) {
+        free(tree);
+        return;
+    }
+
+    // Pooled nodes are released all at once with their slabs,
+    // so there is no need to walk the tree unless there is a destructor
+    // or the pool is shared with other trees.
+    if( tree->root && (destructor || !tree->pool || tree_pool_get(tree)->refs > 1) )
+        tree_destroy_subtree(tree, tree->root, destructor);
+    if( tree->pool )
+        tree_pool_release(tree->pool);
     free(tree);
 }
 
-static void tree_destroy_subtree(struct TreeNode *node, void (*destructor)(void *))
+static void tree_destroy_subtree(tree_t *tree, struct TreeNode *node, void (*destructor)(void *))
+{
+    struct TreeNode *parent;
+
+    // Post-order walk without a stack: every destroyed leaf is unlinked
+    // from its parent so the parent becomes a leaf in turn.
+    while( node ) {
+        if( node->left )
+            node = node->left;
+        else if( node->right )
+            node = node->right;
+        else {
+            parent = PARENT(node);
+            if( parent ) {
+                if( node == parent->left )
+                    parent->left = NULL;
+                else
+                    parent->right = NULL;
+            }
+
+            if( destructor )
+                destructor(node->value);
+
+            tree_node_destroy(tree, node);
+
+            node = parent;
+        }
+    }
+}
+
+static int tree_cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static int tree_cmp_uint64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+tree_t * tree_build_sorted(tree_cmp_t cmp, void **keys, void **values, long n)
+{
+    return tree_build_sorted_ext(cmp, NULL, keys, values, n);
+}
+
+tree_t * tree_build_sorted_ext(tree_cmp_t cmp, const tree_options_t *options,
+    void **keys, void **values, long n)
+{
+    tree_t *tree;
+    long i;
+
+    tree = tree_create_ext(cmp, options);
+    for( i = 1 ; i < n ; i++ ) {
+        if( CMP(tree, keys[i-1], keys[i]) >= 0 ) {
+            tree_destroy(tree, NULL);
+            return NULL;
+        }
+    }
+
+    if( (n > 0 && !tree->options.alloc && tree_pool_reserve(tree_pool_get(tree), tree->node_size, n))
+        || tree_build(tree, NULL, keys, values, n) ) {
+        tree_destroy(tree, NULL);
+        return NULL;
+    }
+
+    return tree;
+}
+
+// Make a tree out of n ascending entries. Entries are either
+// existing nodes or keys and values to create new nodes for.
+// Return -1 if a node can't be created, the tree holds the nodes that
+// were then, for tree_destroy().
+static int tree_build(tree_t *tree, struct TreeNode **nodes, void **keys, void **values, long n)
+{
+    long levels;
+    int failed;
+
+    tree->size = n;
+    tree->root = NULL;
+    tree->black_height = 0;
+    tree->red_number = 0;
+    if( n <= 0 )
+        return 0;
+
+    // Splitting at the middle gives a tree where all missing children are
+    // on the last two levels. If the last level is incomplete its nodes
+    // are red, everything else is black.
+    for( levels = 0 ; (1L << levels) - 1 < n ; levels++ )
+        ;
+    failed = 0;
+    tree->root = tree_build_subtree(tree, nodes, keys, values, 0, n - 1, 1,
+        (1L << levels) - 1 == n ? 0 : levels, &failed);
+    if( failed )
+        return -1;
+    SET_PARENT(tree->root, NULL);
+    tree->black_height = (1L << levels) - 1 == n ? levels : levels - 1;
+    // The last level holds what doesn't fit into the complete levels above.
+    if( (1L << levels) - 1 != n )
+        tree->red_number = n - ((1L << (levels - 1)) - 1);
+
+    return 0;
+}
+
+static struct TreeNode * tree_build_subtree(tree_t *tree, struct TreeNode **nodes,
+    void **keys, void **values, long lo, long hi, long depth, long red_depth, int *failed)
 {
+    struct TreeNode *node;
+    long mid;
+
+    if( lo > hi || *failed )
+        return NULL;
+
+    mid = lo + (hi - lo)/2;
+    if( nodes )
+        node = nodes[mid];
+    else if( !(node = tree_node_create(tree, keys[mid], values ? values[mid] : NULL)) ) {
+        *failed = 1;
+        return NULL;
+    }
+    SET_COLOR(node, depth == red_depth ? RED : BLACK);
+
+    node->left = tree_build_subtree(tree, nodes, keys, values, lo, mid - 1, depth + 1, red_depth, failed);
     if( node->left )
-        tree_destroy_subtree(node->left, destructor);
+        SET_PARENT(node->left, node);
+    node->right = tree_build_subtree(tree, nodes, keys, values, mid + 1, hi, depth + 1, red_depth, failed);
     if( node->right )
-        tree_destroy_subtree(node->right, destructor);
+        SET_PARENT(node->right, node);
 
-    if( destructor )
-        destructor(node->value);
+    if( HAS_COUNT(tree) )
+        SET_COUNT(node, hi - lo + 1);
 
-    tree_node_destroy(node);
+    return node;
 }
 
 long tree_size(tree_t *tree)
 {
+    // Sizes of trees made by split and set operations are counted on demand.
+    if( tree->size < 0 )
+        tree_recount(tree);
+
     return tree->size;
 }
 
+// Count nodes and red nodes of a tree made by split or set operations.
+static void tree_recount(tree_t *tree)
+{
+    struct TreeNode *node;
+
+    tree->size = 0;
+    tree->red_number = 0;
+    for( node = tree_node_min(tree->root) ; node ; node = tree_node_next(node) ) {
+        tree->size++;
+        if( IS_RED(node) )
+            tree->red_number++;
+    }
+}
+
 void * tree_find(tree_t *tree, void *key)
 {
     struct TreeNode *node;
@@ -111,11 +539,29 @@ void * tree_find(tree_t *tree, void *key)
 static struct TreeNode * tree_find_node(tree_t *tree, void *key)
 {
     struct TreeNode *node;
+    int64_t ikey;
+    uint64_t ukey;
     int cmp;
 
+    STAT_READ(tree, lookups);
     node = tree->root;
+
+    // Inline keys are compared right here, no calls.
+    if( KEY_TYPE(tree) == TREE_KEY_INT64 ) {
+        ikey = *(int64_t *)key;
+        while( node && (STAT_READ(tree, comparisons), node->ikey != ikey) )
+            node = ikey < node->ikey ? node->left : node->right;
+        return node;
+    }
+    else if( KEY_TYPE(tree) == TREE_KEY_UINT64 ) {
+        ukey = *(uint64_t *)key;
+        while( node && (STAT_READ(tree, comparisons), node->ukey != ukey) )
+            node = ukey < node->ukey ? node->left : node->right;
+        return node;
+    }
+
     while( node ) {
-        cmp = tree->cmp(key, node->key);
+        cmp = CMP(tree, key, KEY(tree, node));
         if( cmp == 0 )
             return node;
         else if( cmp < 0 )
@@ -127,413 +573,2585 @@ static struct TreeNode * tree_find_node(tree_t *tree, void *key)
     return node;
 }
 
-void * tree_insert(tree_t *tree, void *key, void *value)
+// The leftmost node with key >= key (strict == 0) or key > key (strict != 0).
+static struct TreeNode * tree_find_bound(tree_t *tree, void *key, int strict)
 {
-    struct TreeNode **node, *parent;
+    struct TreeNode *node, *bound;
     int cmp;
 
-    node = &tree->root;
-    parent = NULL;
-    while( *node ) {
-        parent = *node;
-        cmp = tree->cmp(key, (*node)->key);
-        if( cmp < 0 )
-            node = &(*node)->left;
-        else if( cmp > 0 )
-            node = &(*node)->right;
+    STAT_READ(tree, lookups);
+    node = tree->root;
+    bound = NULL;
+    while( node ) {
+        cmp = CMP(tree, key, KEY(tree, node));
+        if( cmp < 0 || (cmp == 0 && !strict) ) {
+            bound = node;
+            node = node->left;
+        }
+        else {
+            node = node->right;
+        }
+    }
+
+    return bound;
+}
+
+// The rightmost node with key <= key.
+static struct TreeNode * tree_find_floor(tree_t *tree, void *key)
+{
+    struct TreeNode *node, *bound;
+    int cmp;
+
+    STAT_READ(tree, lookups);
+    node = tree->root;
+    bound = NULL;
+    while( node ) {
+        cmp = CMP(tree, key, KEY(tree, node));
+        if( cmp == 0 )
+            return node;
+        else if( cmp < 0 )
+            node = node->left;
+        else {
+            bound = node;
+            node = node->right;
+        }
+    }
+
+    return bound;
+}
+
+tree_iter_t * tree_lower_bound(tree_t *tree, void *key, tree_iter_t *iter)
+{
+    iter->tree = tree;
+    iter->node = tree_find_bound(tree, key, 0);
+
+    return iter->node ? iter : NULL;
+}
+
+tree_iter_t * tree_upper_bound(tree_t *tree, void *key, tree_iter_t *iter)
+{
+    iter->tree = tree;
+    iter->node = tree_find_bound(tree, key, 1);
+
+    return iter->node ? iter : NULL;
+}
+
+tree_iter_t * tree_floor(tree_t *tree, void *key, tree_iter_t *iter)
+{
+    iter->tree = tree;
+    iter->node = tree_find_floor(tree, key);
+
+    return iter->node ? iter : NULL;
+}
+
+tree_iter_t * tree_ceiling(tree_t *tree, void *key, tree_iter_t *iter)
+{
+    return tree_lower_bound(tree, key, iter);
+}
+
+tree_iter_t * tree_select(tree_t *tree, long k, tree_iter_t *iter)
+{
+    struct TreeNode *node;
+    long left;
+
+    iter->tree = tree;
+    iter->node = NULL;
+    if( k < 0 || k >= tree_size(tree) )
+        return NULL;
+
+    if( !HAS_COUNT(tree) ) {
+        // No subtree sizes, walk k steps from the minimum.
+        for( node = tree_node_min(tree->root) ; k > 0 ; k-- )
+            node = tree_node_next(node);
+        iter->node = node;
+        return iter;
+    }
+
+    node = tree->root;
+    while( node ) {
+        left = COUNT(node->left);
+        if( k < left )
+            node = node->left;
+        else if( k > left ) {
+            k -= left + 1;
+            node = node->right;
+        }
         else
-            return (*node)->value;
+            break;
+    }
+
+    iter->node = node;
+
+    return iter;
+}
+
+long tree_rank(tree_t *tree, void *key)
+{
+    struct TreeNode *node;
+    long rank;
+    int cmp;
+
+    rank = 0;
+    if( !HAS_COUNT(tree) ) {
+        // No subtree sizes, count entries from the minimum.
+        node = tree_node_min(tree->root);
+        while( node && CMP(tree, KEY(tree, node), key) < 0 ) {
+            rank++;
+            node = tree_node_next(node);
+        }
+        return rank;
     }
 
-    *node = tree_node_create(key, value);
-    (*node)->tree = tree;
-    (*node)->parent = parent;
-    (*node)->color = RED;
+    node = tree->root;
+    while( node ) {
+        cmp = CMP(tree, key, KEY(tree, node));
+        if( cmp <= 0 )
+            node = node->left;
+        else {
+            rank += COUNT(node->left) + 1;
+            node = node->right;
+        }
+    }
+
+    return rank;
+}
 
-    tree_insert1(*node);
-    tree->size++;
+void * tree_insert(tree_t *tree, void *key, void *value)
+{
+    struct TreeNode **link, *parent;
+
+    link = tree_find_link(tree, key, &parent);
+    if( *link )
+        return (*link)->value;
+
+    if( !tree_insert_at(tree, parent, link, key, value) )
+        return NULL;
 
     return value;
 }
 
-static void tree_insert1(struct TreeNode *node)
+int tree_upsert(tree_t *tree, void *key, void *value, void **old)
 {
-    if( node->parent == NULL )
-        node->color = BLACK;
-    else
-        tree_insert2(node);
+    struct TreeNode **link, *parent;
+
+    link = tree_find_link(tree, key, &parent);
+    if( *link ) {
+        if( old )
+            *old = (*link)->value;
+        (*link)->value = value;
+        return 0;
+    }
+
+    if( !tree_insert_at(tree, parent, link, key, value) )
+        return -1;
+
+    return 1;
+}
+
+void * tree_find_or_insert(tree_t *tree, void *key, void * (*factory)(void *, void *),
+    void *ctx, int *inserted)
+{
+    struct TreeNode **link, *parent, *node;
+
+    link = tree_find_link(tree, key, &parent);
+    if( inserted )
+        *inserted = 0;
+    if( *link )
+        return (*link)->value;
+
+    // The node is taken first so a value isn't made for nothing.
+    // The factory doesn't touch the tree, the slot is still there.
+    if( !(node = tree_node_create(tree, key, NULL)) )
+        return NULL;
+    node->value = factory(key, ctx);
+    tree_link_node(tree, parent, link, node);
+    if( inserted )
+        *inserted = 1;
+
+    return node->value;
+}
+
+// The link that points to the node with key, or the empty link where
+// a node with key belongs. *parent is the node the link belongs to.
+static struct TreeNode ** tree_find_link(tree_t *tree, void *key, struct TreeNode **parent)
+{
+    struct TreeNode **link;
+    int64_t ikey;
+    uint64_t ukey;
+    int cmp;
+
+    STAT_READ(tree, lookups);
+    link = &tree->root;
+    *parent = NULL;
+
+    if( KEY_TYPE(tree) == TREE_KEY_INT64 ) {
+        ikey = *(int64_t *)key;
+        while( *link && (STAT_READ(tree, comparisons), (*link)->ikey != ikey) ) {
+            *parent = *link;
+            link = ikey < (*parent)->ikey ? &(*parent)->left : &(*parent)->right;
+        }
+    }
+    else if( KEY_TYPE(tree) == TREE_KEY_UINT64 ) {
+        ukey = *(uint64_t *)key;
+        while( *link && (STAT_READ(tree, comparisons), (*link)->ukey != ukey) ) {
+            *parent = *link;
+            link = ukey < (*parent)->ukey ? &(*parent)->left : &(*parent)->right;
+        }
+    }
+    else {
+        while( *link && (cmp = CMP(tree, key, (*link)->key)) != 0 ) {
+            *parent = *link;
+            link = cmp < 0 ? &(*parent)->left : &(*parent)->right;
+        }
+    }
+
+    return link;
+}
+
+// Link a new node into the empty slot link under parent and rebalance.
+// Return NULL and leave the tree as it is if there is no memory for it.
+static struct TreeNode * tree_insert_at(tree_t *tree, struct TreeNode *parent,
+    struct TreeNode **link, void *key, void *value)
+{
+    struct TreeNode *node;
+
+    if( !(node = tree_node_create(tree, key, value)) )
+        return NULL;
+    tree_link_node(tree, parent, link, node);
+
+    return node;
 }
 
-static void tree_insert2(struct TreeNode *node)
+// Link a red node without children into the empty slot link under parent
+// and rebalance.
+static void tree_link_node(tree_t *tree, struct TreeNode *parent,
+    struct TreeNode **link, struct TreeNode *node)
 {
+    STAT(tree, inserts);
+    SET_PARENT(node, parent);
+    // Readers of ctree may walk the tree while it's being changed,
+    // they must never see the node before it's initialized.
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    *link = node;
+    if( HAS_COUNT(tree) )
+        tree_count_add(parent, 1);
+    tree_red_add(tree, 1);
+
+    tree_insert1(tree, node);
+    if( tree->size >= 0 )
+        tree->size++;
+}
+
+static void tree_insert1(tree_t *tree, struct TreeNode *node)
+{
+    STAT(tree, insert_cases[0]);
+    if( PARENT(node) == NULL ) {
+        // A red root turns black, all paths get one more black node.
+        if( IS_RED(node) )
+            tree->black_height++;
+        RECOLOR(tree, node, BLACK);
+    }
+    else {
+        tree_insert2(tree, node);
+    }
+}
+
+static void tree_insert2(tree_t *tree, struct TreeNode *node)
+{
+    STAT(tree, insert_cases[1]);
     // node->parent != NULL because we know it from tree_insert1().
-    if( IS_BLACK(node->parent) )
+    if( IS_BLACK(PARENT(node)) )
         // node->color == RED. Everything's ok.
         return;
     else
         // node->color == RED and parent->color == RED.
-        tree_insert3(node);
+        tree_insert3(tree, node);
 }
 
-static void tree_insert3(struct TreeNode *node)
+static void tree_insert3(tree_t *tree, struct TreeNode *node)
 {
     struct TreeNode *u, *g;
 
+    STAT(tree, insert_cases[2]);
     u = tree_node_uncle(node);
     // node->color == RED (initially)
     //   and parent->color == RED (known from tree_insert2())
     //   and uncle->color == RED.
     if( IS_RED(u) ) {
         // If uncle is RED it can't be NULL.
-        u->color = BLACK;
+        RECOLOR(tree, u, BLACK);
         // node->parent != NULL. We know it from tree_insert1().
-        node->parent->color = BLACK;
+        RECOLOR(tree, PARENT(node), BLACK);
 
         // g is valid because there is a valid uncle.
         g = tree_node_grandparent(node);
-        g->color = RED;
-        tree_insert1(g);
+        RECOLOR(tree, g, RED);
+        tree_insert1(tree, g);
     }
     else {
-        tree_insert4(node);
+        tree_insert4(tree, node);
+    }
+}
+
+static void tree_insert4(tree_t *tree, struct TreeNode *node)
+{
+    struct TreeNode *g;
+
+    STAT(tree, insert_cases[3]);
+    g = tree_node_grandparent(node);
+
+    // node->color == RED (still)
+    //   and parent->color == RED (tree_insert2() => tree_insert3())
+    //   and uncle->color == BLACK (known from tree_insert3()).
+    // grand is valid because parent->color == RED so the grand must exist.
+    if( node == PARENT(node)->right && PARENT(node) == g->left ) {
+        tree_rotate_left(tree, PARENT(node));
+        // Take the former parent.
+        node = node->left;
+    }
+    else if( node == PARENT(node)->left && PARENT(node) == g->right ) {
+        tree_rotate_right(tree, PARENT(node));
+        // Take the former parent.
+        node = node->right;
+    }
+
+    // Now we are working with former node's parent.
+    tree_insert5(tree, node);
+}
+
+static void tree_insert5(tree_t *tree, struct TreeNode *node)
+{
+    struct TreeNode *g;
+
+    STAT(tree, insert_cases[4]);
+    g = tree_node_grandparent(node);
+
+    // Now node = parent and parent = node.
+    // Both node and parent are left or right for their parents.
+    // grand is valid - it's the same as in (tree_insert4()).
+    // node->color == RED and parent->color == RED (as in tree_insert4())
+    //   and uncle->color == BLACK (it's the same as in tree_insert4())
+    //   and grand->color == BLACK (it was a parent of RED node).
+    RECOLOR(tree, PARENT(node), BLACK);
+    RECOLOR(tree, g, RED);
+    if( node == PARENT(node)->left && PARENT(node) == g->left )
+        tree_rotate_right(tree, g);
+    else if( node == PARENT(node)->right && PARENT(node) == g->right )
+        tree_rotate_left(tree, g);
+}
+
+void * tree_delete(tree_t *tree, void *key)
+{
+    struct TreeNode *node;
+
+    if( !(node = tree_find_node(tree, key)) )
+        return NULL;
+
+    return tree_delete_node(tree, node);
+}
+
+static void * tree_delete_node(tree_t *tree, struct TreeNode *node)
+{
+    void *value;
+
+    value = node->value;
+    tree_unlink_node(tree, node);
+    tree_node_destroy(tree, node);
+
+    return value;
+}
+
+// Take node out of the tree by relinking. No key or value moves between
+// nodes, so iterators and hooks of every other node stay valid.
+static void tree_unlink_node(tree_t *tree, struct TreeNode *node)
+{
+    struct TreeNode *child;
+
+    STAT(tree, deletes);
+    // With two children node first trades places with its predecessor,
+    // then it has at most one child.
+    if( node->left && node->right )
+        tree_swap_nodes(tree, node, tree_node_max(node->left));
+
+    if( HAS_COUNT(tree) ) {
+        SET_COUNT(node, 0);
+        tree_count_add(PARENT(node), -1);
+    }
+
+    // The only child of a node is a red leaf and the node is black.
+    // The child takes its place and turns black, paths keep their black nodes.
+    child = node->left ? node->left : node->right;
+    if( child ) {
+        if( !PARENT(node) )
+            tree->root = child;
+        else if( node == PARENT(node)->left )
+            PARENT(node)->left = child;
+        else
+            PARENT(node)->right = child;
+        child->parent_color = (uintptr_t)PARENT(node) | BLACK;
+        STAT(tree, recolorings);
+        tree_red_add(tree, -1);
+    }
+    else {
+        if( IS_BLACK(node) )
+            tree_delete1(tree, node);
+        else
+            tree_red_add(tree, -1);
+
+        if( !PARENT(node) )
+            tree->root = NULL;
+        else if( node == PARENT(node)->left )
+            PARENT(node)->left = NULL;
+        else
+            PARENT(node)->right = NULL;
+    }
+
+    if( tree->size >= 0 )
+        tree->size--;
+}
+
+// Exchange the places (links, colors and counts) of node and heir,
+// the rightmost node of its left subtree.
+static void tree_swap_nodes(tree_t *tree, struct TreeNode *node, struct TreeNode *heir)
+{
+    struct TreeNode *parent, *heir_parent, *heir_left;
+    uintptr_t color, heir_color;
+    long count;
+
+    parent = PARENT(node);
+    heir_parent = PARENT(heir);
+    heir_left = heir->left;
+    color = COLOR(node);
+    heir_color = COLOR(heir);
+
+    if( !parent )
+        tree->root = heir;
+    else if( node == parent->left )
+        parent->left = heir;
+    else
+        parent->right = heir;
+
+    heir->right = node->right;
+    SET_PARENT(heir->right, heir);
+    if( heir_parent == node ) {
+        heir->left = node;
+        heir_parent = heir;
+    }
+    else {
+        heir->left = node->left;
+        SET_PARENT(heir->left, heir);
+        heir_parent->right = node;
+    }
+    heir->parent_color = (uintptr_t)parent | color;
+
+    node->left = heir_left;
+    if( heir_left )
+        SET_PARENT(heir_left, node);
+    node->right = NULL;
+    node->parent_color = (uintptr_t)heir_parent | heir_color;
+
+    if( HAS_COUNT(tree) ) {
+        count = COUNT(heir);
+        SET_COUNT(heir, COUNT(node));
+        SET_COUNT(node, count);
+    }
+}
+
+tree_hook_t * tree_hook_find(tree_t *tree, void *key)
+{
+    struct TreeNode *node;
+    int cmp;
+
+    STAT_READ(tree, lookups);
+    node = tree->root;
+    while( node ) {
+        cmp = CMP(tree, key, HOOK_KEY(tree, node));
+        if( cmp == 0 )
+            break;
+        node = cmp < 0 ? node->left : node->right;
+    }
+
+    return (tree_hook_t *)node;
+}
+
+tree_hook_t * tree_hook_insert(tree_t *tree, tree_hook_t *hook)
+{
+    struct TreeNode **link, *parent, *node;
+    void *key;
+    int cmp;
+
+    STAT_READ(tree, lookups);
+    node = (struct TreeNode *)hook;
+    key = HOOK_KEY(tree, node);
+    link = &tree->root;
+    parent = NULL;
+    while( *link && (cmp = CMP(tree, key, HOOK_KEY(tree, *link))) != 0 ) {
+        parent = *link;
+        link = cmp < 0 ? &parent->left : &parent->right;
+    }
+
+    if( *link )
+        return (tree_hook_t *)*link;
+
+    node->parent_color = RED;
+    node->left = NULL;
+    node->right = NULL;
+    tree_link_node(tree, parent, link, node);
+
+    return hook;
+}
+
+void tree_hook_delete(tree_t *tree, tree_hook_t *hook)
+{
+    tree_unlink_node(tree, (struct TreeNode *)hook);
+}
+
+tree_hook_t * tree_hook_lower_bound(tree_t *tree, void *key)
+{
+    return (tree_hook_t *)tree_find_bound(tree, key, 0);
+}
+
+tree_hook_t * tree_hook_first(tree_t *tree)
+{
+    return tree->root ? (tree_hook_t *)tree_node_min(tree->root) : NULL;
+}
+
+tree_hook_t * tree_hook_last(tree_t *tree)
+{
+    return tree->root ? (tree_hook_t *)tree_node_max(tree->root) : NULL;
+}
+
+tree_hook_t * tree_hook_next(tree_hook_t *hook)
+{
+    return (tree_hook_t *)tree_node_next((struct TreeNode *)hook);
+}
+
+tree_hook_t * tree_hook_prev(tree_hook_t *hook)
+{
+    return (tree_hook_t *)tree_node_prev((struct TreeNode *)hook);
+}
+
+long tree_insert_batch(tree_t *tree, void **keys, void **values, long n)
+{
+    struct TreeBatchEntry *entries;
+    long inserted;
+
+    if( n <= 0 )
+        return 0;
+
+    if( !(entries = tree_batch_alloc(n)) )
+        return -1;
+    n = tree_batch_prepare(tree, entries, keys, values, n);
+
+    if( n*TREE_BATCH_REBUILD_RATIO >= tree_size(tree) )
+        inserted = tree_insert_batch_rebuild(tree, entries, n);
+    else
+        inserted = tree_insert_batch_finger(tree, entries, n);
+
+    free(entries);
+
+    return inserted;
+}
+
+long tree_delete_batch(tree_t *tree, void **keys, long n, void (*destructor)(void *))
+{
+    struct TreeBatchEntry *entries;
+    long deleted;
+
+    if( n <= 0 || !tree->root )
+        return 0;
+
+    if( !(entries = tree_batch_alloc(n)) )
+        return -1;
+    n = tree_batch_prepare(tree, entries, keys, NULL, n);
+
+    if( n*TREE_BATCH_REBUILD_RATIO >= tree_size(tree) )
+        deleted = tree_delete_batch_rebuild(tree, entries, n, destructor);
+    else
+        deleted = tree_delete_batch_finger(tree, entries, n, destructor);
+
+    free(entries);
+
+    return deleted;
+}
+
+// Room for a batch of n entries and tree_batch_prepare() to sort them.
+static struct TreeBatchEntry * tree_batch_alloc(long n)
+{
+    if( (size_t)n > SIZE_MAX/(2*sizeof(struct TreeBatchEntry)) ) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    return malloc(2*n*sizeof(struct TreeBatchEntry));
+}
+
+// Sort the batch and drop repeated keys keeping the first of them.
+// entries must have room for 2*n entries. Return the new batch size.
+static long tree_batch_prepare(tree_t *tree, struct TreeBatchEntry *entries, void **keys, void **values, long n)
+{
+    struct TreeBatchEntry *src, *dst, *tmp;
+    long i, j, k, m, lo, mid, hi, width;
+
+    src = entries;
+    dst = entries + n;
+    for( i = 0 ; i < n ; i++ ) {
+        src[i].key = keys[i];
+        src[i].value = values ? values[i] : NULL;
+    }
+
+    // Bottom-up merge sort. It is stable so the first of equal keys stays first.
+    for( width = 1 ; width < n ; width *= 2 ) {
+        for( lo = 0 ; lo < n ; lo += 2*width ) {
+            mid = lo + width < n ? lo + width : n;
+            hi = lo + 2*width < n ? lo + 2*width : n;
+            i = lo;
+            j = mid;
+            k = lo;
+            while( i < mid && j < hi ) {
+                if( CMP(tree, src[j].key, src[i].key) < 0 )
+                    dst[k++] = src[j++];
+                else
+                    dst[k++] = src[i++];
+            }
+            while( i < mid )
+                dst[k++] = src[i++];
+            while( j < hi )
+                dst[k++] = src[j++];
+        }
+        tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+
+    for( i = 0, m = 0 ; i < n ; i++ ) {
+        if( m == 0 || CMP(tree, src[i].key, entries[m-1].key) != 0 )
+            entries[m++] = src[i];
+    }
+
+    return m;
+}
+
+// Climb from the finger to the lowest ancestor whose subtree contains
+// the place for key. key is greater than the finger's key.
+static struct TreeNode * tree_finger_climb(tree_t *tree, struct TreeNode *node, void *key)
+{
+    struct TreeNode *parent;
+
+    while( (parent = PARENT(node)) ) {
+        // Everything in the subtree of a left child is less than the parent.
+        if( node == parent->left && CMP(tree, key, KEY(tree, parent)) < 0 )
+            break;
+        node = parent;
+    }
+
+    return node;
+}
+
+static long tree_insert_batch_finger(tree_t *tree, struct TreeBatchEntry *entries, long n)
+{
+    struct TreeNode **link, *node, *parent, *finger;
+    long i, inserted;
+    int cmp;
+
+    inserted = 0;
+    finger = NULL;
+    for( i = 0 ; i < n ; i++ ) {
+        // Start from where the previous key was found instead of the root.
+        node = finger ? tree_finger_climb(tree, finger, entries[i].key) : tree->root;
+        link = &tree->root;
+        parent = NULL;
+        while( node ) {
+            parent = node;
+            cmp = CMP(tree, entries[i].key, KEY(tree, node));
+            if( cmp < 0 )
+                link = &node->left;
+            else if( cmp > 0 )
+                link = &node->right;
+            else
+                break;
+            node = *link;
+        }
+
+        if( node ) {
+            finger = node;
+        }
+        else {
+            if( !(finger = tree_insert_at(tree, parent, link, entries[i].key, entries[i].value)) )
+                return -1;
+            inserted++;
+        }
+    }
+
+    return inserted;
+}
+
+// The finger is the first node past the previous key: keys less than it
+// aren't in the tree, others are looked for from below its ancestor like
+// in tree_insert_batch_finger(). Nodes are relinked on delete, the finger
+// stays valid.
+static long tree_delete_batch_finger(tree_t *tree, struct TreeBatchEntry *entries, long n,
+    void (*destructor)(void *))
+{
+    struct TreeNode *node, *bound, *finger;
+    void *value;
+    long i, deleted;
+    int cmp;
+
+    deleted = 0;
+    finger = tree_node_min(tree->root);
+    for( i = 0 ; i < n && finger ; i++ ) {
+        cmp = CMP(tree, entries[i].key, KEY(tree, finger));
+        if( cmp < 0 )
+            continue;
+
+        node = finger;
+        if( cmp > 0 ) {
+            // The climb stops under the first ancestor greater than key.
+            node = tree_finger_climb(tree, finger, entries[i].key);
+            bound = PARENT(node);
+            if( node == finger )
+                node = finger->right;
+            while( node && (cmp = CMP(tree, entries[i].key, KEY(tree, node))) != 0 ) {
+                if( cmp < 0 ) {
+                    bound = node;
+                    node = node->left;
+                }
+                else {
+                    node = node->right;
+                }
+            }
+            if( !node ) {
+                finger = bound;
+                continue;
+            }
+        }
+
+        finger = tree_node_next(node);
+        value = tree_delete_node(tree, node);
+        if( destructor )
+            destructor(value);
+        deleted++;
+    }
+
+    return deleted;
+}
+
+static long tree_insert_batch_rebuild(tree_t *tree, struct TreeBatchEntry *entries, long n)
+{
+    struct TreeNode **nodes, *node;
+    long i, k, inserted;
+    int cmp;
+
+    // Without room for the merge entries go in one by one.
+    if( !(nodes = malloc((tree_size(tree) + n)*sizeof(struct TreeNode *))) )
+        return tree_insert_batch_finger(tree, entries, n);
+    if( !tree->options.alloc )
+        tree_pool_reserve(tree_pool_get(tree), tree->node_size, n);
+
+    // Merge the tree with the batch in order.
+    node = tree_node_min(tree->root);
+    i = k = inserted = 0;
+    while( node || i < n ) {
+        cmp = !node ? 1 : i == n ? -1 : CMP(tree, KEY(tree, node), entries[i].key);
+        if( cmp <= 0 ) {
+            nodes[k++] = node;
+            node = tree_node_next(node);
+            if( cmp == 0 )
+                i++;
+        }
+        else {
+            if( !(nodes[k++] = tree_node_create(tree, entries[i].key, entries[i].value)) )
+                goto fail;
+            i++;
+            inserted++;
+        }
+    }
+
+    tree_build(tree, nodes, NULL, NULL, k);
+    free(nodes);
+
+    return inserted;
+
+fail:
+    // The tree isn't touched yet, what isn't one of its nodes is new.
+    node = tree_node_min(tree->root);
+    for( i = 0 ; i < k - 1 ; i++ ) {
+        if( nodes[i] == node )
+            node = tree_node_next(node);
+        else
+            tree_node_destroy(tree, nodes[i]);
+    }
+    free(nodes);
+
+    return -1;
+}
+
+static long tree_delete_batch_rebuild(tree_t *tree, struct TreeBatchEntry *entries, long n,
+    void (*destructor)(void *))
+{
+    struct TreeNode **nodes, *node;
+    long i, k, deleted, size;
+    int cmp;
+
+    // Kept nodes go to the front of the array, deleted ones to the back.
+    // They are destroyed after the walk since it needs their links.
+    // Without room for the kept nodes keys are deleted one by one.
+    size = tree_size(tree);
+    if( !(nodes = malloc(size*sizeof(struct TreeNode *))) )
+        return tree_delete_batch_finger(tree, entries, n, destructor);
+    node = tree_node_min(tree->root);
+    i = k = deleted = 0;
+    while( node ) {
+        cmp = i == n ? -1 : CMP(tree, KEY(tree, node), entries[i].key);
+        if( cmp < 0 ) {
+            nodes[k++] = node;
+            node = tree_node_next(node);
+        }
+        else if( cmp == 0 ) {
+            nodes[size - ++deleted] = node;
+            node = tree_node_next(node);
+            i++;
+        }
+        else {
+            i++;
+        }
+    }
+
+    tree_build(tree, nodes, NULL, NULL, k);
+
+    for( i = size - deleted ; i < size ; i++ ) {
+        if( destructor )
+            destructor(nodes[i]->value);
+        tree_node_destroy(tree, nodes[i]);
+    }
+    free(nodes);
+
+    return deleted;
+}
+
+// Trees can take each other's nodes only if nodes are allocated the same way
+// and have the same layout.
+static int tree_compatible(tree_t *tree, tree_t *other)
+{
+    return tree->cmp == other->cmp
+        && tree->options.alloc == other->options.alloc
+        && tree->options.free == other->options.free
+        && tree->options.alloc_ctx == other->options.alloc_ctx
+        && tree->options.flags == other->options.flags;
+}
+
+// Take other's nodes over: from now on they belong to tree's pool.
+static void tree_adopt(tree_t *tree, tree_t *other)
+{
+    if( tree->pool )
+        tree_pool_merge(tree_pool_get(tree), tree_pool_get(other));
+}
+
+// A piece is a subtree with a black root treated as a separate tree.
+// It shares the comparator, options, pool and counters with the tree it
+// comes from.
+// Pieces are what join, split and set operations work with.
+static void tree_piece_init(tree_t *piece, tree_t *tree, struct TreeNode *root, long black_height)
+{
+    if( piece != tree )
+        *piece = *tree;
+    piece->root = root;
+    piece->black_height = black_height;
+    if( root ) {
+        SET_PARENT(root, NULL);
+        if( IS_RED(root) ) {
+            SET_COLOR(root, BLACK);
+            piece->black_height++;
+        }
+    }
+    piece->size = HAS_COUNT(tree) ? COUNT(root) : root ? -1 : 0;
+    piece->red_number = root ? -1 : 0;
+}
+
+// Makes tree out of a piece, it keeps counting into its own counters.
+static void tree_piece_detach(tree_t *tree, tree_t *piece)
+{
+#ifdef TREE_STATS
+    tree_stats_t *stats = tree->stats;
+
+    *tree = *piece;
+    tree->stats = stats;
+#else
+    *tree = *piece;
+#endif
+}
+
+// Cut the root of the piece off its subtrees.
+static struct TreeNode * tree_piece_expose(tree_t *piece, tree_t *left, tree_t *right)
+{
+    struct TreeNode *node;
+
+    // The root is black so it's one black node less for the subtrees.
+    node = piece->root;
+    tree_piece_init(left, piece, node->left, piece->black_height - 1);
+    tree_piece_init(right, piece, node->right, piece->black_height - 1);
+    node->left = NULL;
+    node->right = NULL;
+    SET_PARENT(node, NULL);
+
+    return node;
+}
+
+// Join left, node and right into left. All keys of left are less than the
+// node's key and all keys of right are greater. Right becomes empty.
+// It takes O(|black height difference| + 1).
+static void tree_piece_join(tree_t *left, struct TreeNode *node, tree_t *right)
+{
+    struct TreeNode *child, *parent;
+    long black_height;
+
+    left->size = left->size >= 0 && right->size >= 0 ? left->size + right->size + 1 : -1;
+    left->red_number = -1;
+
+    if( left->black_height == right->black_height ) {
+        node->left = left->root;
+        node->right = right->root;
+        if( node->left )
+            SET_PARENT(node->left, node);
+        if( node->right )
+            SET_PARENT(node->right, node);
+        SET_PARENT(node, NULL);
+        SET_COLOR(node, BLACK);
+        if( HAS_COUNT(left) )
+            UPDATE_COUNT(node);
+        left->root = node;
+        left->black_height++;
+    }
+    else if( left->black_height > right->black_height ) {
+        // Go down the right spine of left to a black node with
+        // the same black height as right and hang node in its place.
+        child = left->root;
+        parent = NULL;
+        black_height = left->black_height;
+        while( IS_RED(child) || black_height > right->black_height ) {
+            black_height -= IS_BLACK(child) ? 1 : 0;
+            parent = child;
+            child = child->right;
+        }
+
+        node->left = child;
+        node->right = right->root;
+        if( child )
+            SET_PARENT(child, node);
+        if( right->root )
+            SET_PARENT(right->root, node);
+        parent->right = node;
+        SET_PARENT(node, parent);
+        SET_COLOR(node, RED);
+        if( HAS_COUNT(left) ) {
+            UPDATE_COUNT(node);
+            tree_count_add(parent, COUNT(node->right) + 1);
+        }
+
+        // The same as if node was just inserted.
+        tree_insert1(left, node);
+    }
+    else {
+        child = right->root;
+        parent = NULL;
+        black_height = right->black_height;
+        while( IS_RED(child) || black_height > left->black_height ) {
+            black_height -= IS_BLACK(child) ? 1 : 0;
+            parent = child;
+            child = child->left;
+        }
+
+        node->left = left->root;
+        node->right = child;
+        if( child )
+            SET_PARENT(child, node);
+        if( left->root )
+            SET_PARENT(left->root, node);
+        parent->left = node;
+        SET_PARENT(node, parent);
+        SET_COLOR(node, RED);
+        if( HAS_COUNT(left) ) {
+            UPDATE_COUNT(node);
+            tree_count_add(parent, COUNT(node->left) + 1);
+        }
+
+        tree_insert1(right, node);
+        left->root = right->root;
+        left->black_height = right->black_height;
+    }
+
+    right->root = NULL;
+    right->black_height = 0;
+    right->size = 0;
+    right->red_number = 0;
+}
+
+// Split piece into lo with keys less than key and hi with keys greater
+// than key. The node with key, if any, is returned and goes to neither.
+// It takes O(log n).
+static struct TreeNode * tree_piece_split(tree_t *piece, void *key, tree_t *lo, tree_t *hi)
+{
+    struct TreeNode *node, *found;
+    tree_t left, right;
+    int cmp;
+
+    if( !piece->root ) {
+        tree_piece_init(lo, piece, NULL, 0);
+        tree_piece_init(hi, piece, NULL, 0);
+        return NULL;
+    }
+
+    node = tree_piece_expose(piece, &left, &right);
+    cmp = CMP(piece, key, KEY(piece, node));
+    if( cmp < 0 ) {
+        found = tree_piece_split(&left, key, lo, hi);
+        tree_piece_join(hi, node, &right);
+    }
+    else if( cmp > 0 ) {
+        found = tree_piece_split(&right, key, lo, hi);
+        tree_piece_join(&left, node, lo);
+        *lo = left;
+    }
+    else {
+        *lo = left;
+        *hi = right;
+        found = node;
+    }
+
+    return found;
+}
+
+// Join two pieces without a node in between: the minimum of right is used.
+static void tree_piece_concat(tree_t *left, tree_t *right)
+{
+    struct TreeNode *node;
+    tree_t lo;
+
+    if( !right->root )
+        return;
+
+    if( !left->root ) {
+        *left = *right;
+    }
+    else {
+        node = tree_piece_split(right, KEY(right, tree_node_min(right->root)), &lo, right);
+        tree_piece_join(left, node, right);
+    }
+
+    tree_piece_init(right, right, NULL, 0);
+}
+
+static void tree_piece_destroy(tree_t *piece, void (*destructor)(void *))
+{
+    if( piece->root )
+        tree_destroy_subtree(piece, piece->root, destructor);
+    tree_piece_init(piece, piece, NULL, 0);
+}
+
+static void tree_piece_node_destroy(tree_t *piece, struct TreeNode *node, void (*destructor)(void *))
+{
+    if( destructor )
+        destructor(node->value);
+    tree_node_destroy(piece, node);
+}
+
+// The set operations below split t1 by the root of t2 and recurse on
+// the halves. Results go to t1, t2 is consumed. Values of t1 win.
+static void tree_piece_union(tree_t *t1, tree_t *t2, void (*destructor)(void *))
+{
+    struct TreeNode *node, *found;
+    tree_t l1, r1, l2, r2;
+
+    if( !t2->root )
+        return;
+
+    if( !t1->root ) {
+        *t1 = *t2;
+        tree_piece_init(t2, t2, NULL, 0);
+        return;
+    }
+
+    node = tree_piece_expose(t2, &l2, &r2);
+    found = tree_piece_split(t1, KEY(t1, node), &l1, &r1);
+    tree_piece_union(&l1, &l2, destructor);
+    tree_piece_union(&r1, &r2, destructor);
+    if( found ) {
+        tree_piece_node_destroy(t1, node, destructor);
+        node = found;
+    }
+    tree_piece_join(&l1, node, &r1);
+    *t1 = l1;
+}
+
+static void tree_piece_intersection(tree_t *t1, tree_t *t2, void (*destructor)(void *))
+{
+    struct TreeNode *node, *found;
+    tree_t l1, r1, l2, r2;
+
+    if( !t1->root || !t2->root ) {
+        tree_piece_destroy(t1, destructor);
+        tree_piece_destroy(t2, destructor);
+        return;
+    }
+
+    node = tree_piece_expose(t2, &l2, &r2);
+    found = tree_piece_split(t1, KEY(t1, node), &l1, &r1);
+    tree_piece_intersection(&l1, &l2, destructor);
+    tree_piece_intersection(&r1, &r2, destructor);
+    tree_piece_node_destroy(t1, node, destructor);
+    if( found )
+        tree_piece_join(&l1, found, &r1);
+    else
+        tree_piece_concat(&l1, &r1);
+    *t1 = l1;
+}
+
+static void tree_piece_difference(tree_t *t1, tree_t *t2, void (*destructor)(void *))
+{
+    struct TreeNode *node, *found;
+    tree_t l1, r1, l2, r2;
+
+    if( !t1->root || !t2->root ) {
+        tree_piece_destroy(t2, destructor);
+        return;
+    }
+
+    node = tree_piece_expose(t2, &l2, &r2);
+    found = tree_piece_split(t1, KEY(t1, node), &l1, &r1);
+    tree_piece_difference(&l1, &l2, destructor);
+    tree_piece_difference(&r1, &r2, destructor);
+    tree_piece_node_destroy(t1, node, destructor);
+    if( found )
+        tree_piece_node_destroy(t1, found, destructor);
+    tree_piece_concat(&l1, &r1);
+    *t1 = l1;
+}
+
+tree_t * tree_join(tree_t *t1, void *key, void *value, tree_t *t2)
+{
+    struct TreeNode *node;
+    tree_t right;
+
+    if( !tree_compatible(t1, t2) )
+        return NULL;
+
+    if( t1->root && CMP(t1, KEY(t1, tree_node_max(t1->root)), key) >= 0 )
+        return NULL;
+    if( t2->root && CMP(t1, key, KEY(t2, tree_node_min(t2->root))) >= 0 )
+        return NULL;
+
+    if( !(node = tree_node_create(t1, key, value)) )
+        return NULL;
+    tree_adopt(t1, t2);
+    tree_piece_init(&right, t1, t2->root, t2->black_height);
+    right.size = t2->size;
+    tree_piece_join(t1, node, &right);
+
+    t2->root = NULL;
+    tree_destroy(t2, NULL);
+
+    return t1;
+}
+
+void tree_split(tree_t *tree, void *key, tree_t **lo, tree_t **hi)
+{
+    struct TreeNode *node;
+    tree_t left, right, min;
+
+    // Nothing is detached before hi is had, tree stays whole otherwise.
+    *hi = tree_alloc();
+    if( !*hi ) {
+        *lo = NULL;
+        return;
+    }
+
+    node = tree_piece_split(tree, key, &left, &right);
+    if( node ) {
+        // The node with key goes to hi as its minimum.
+        tree_piece_init(&min, tree, NULL, 0);
+        tree_piece_join(&min, node, &right);
+        right = min;
+    }
+
+    tree_piece_detach(*hi, &right);
+    if( tree->pool )
+        tree_pool_get(*hi)->refs++;
+
+    *tree = left;
+    *lo = tree;
+}
+
+// Set operations consume t2 and put the result into t1.
+// t2 becomes a piece of t1 first so all pieces share t1's pool.
+static tree_t * tree_set_operation(tree_t *t1, tree_t *t2, void (*destructor)(void *),
+    void (*operation)(tree_t *, tree_t *, void (*)(void *)))
+{
+    tree_t piece;
+
+    if( !tree_compatible(t1, t2) )
+        return NULL;
+
+    tree_adopt(t1, t2);
+    tree_piece_init(&piece, t1, t2->root, t2->black_height);
+    operation(t1, &piece, destructor);
+
+    t2->root = NULL;
+    tree_destroy(t2, NULL);
+
+    return t1;
+}
+
+tree_t * tree_union(tree_t *t1, tree_t *t2, void (*destructor)(void *))
+{
+    return tree_set_operation(t1, t2, destructor, tree_piece_union);
+}
+
+tree_t * tree_intersection(tree_t *t1, tree_t *t2, void (*destructor)(void *))
+{
+    return tree_set_operation(t1, t2, destructor, tree_piece_intersection);
+}
+
+tree_t * tree_difference(tree_t *t1, tree_t *t2, void (*destructor)(void *))
+{
+    return tree_set_operation(t1, t2, destructor, tree_piece_difference);
+}
+
+static void tree_delete1(tree_t *tree, struct TreeNode *node)
+{
+    STAT(tree, delete_cases[0]);
+    // node->color == BLACK (known from tree_delete()).
+    // If node is root then nothing has to be done
+    // except that all paths have lost one black node.
+    if( PARENT(node) )
+        tree_delete2(tree, node);
+    else
+        tree->black_height--;
+}
+
+static void tree_delete2(tree_t *tree, struct TreeNode *node)
+{
+    struct TreeNode *s;
+
+    STAT(tree, delete_cases[1]);
+    // node->color == BLACK.
+    // node has a valid parent (tree_delete1()).
+
+    s = tree_node_sibling(node);
+    if( IS_RED(s) ) {
+        // If s->color == RED it is valid (non-null).
+        RECOLOR(tree, PARENT(node), RED);
+        RECOLOR(tree, s, BLACK);
+        if( node == PARENT(node)->left )
+            tree_rotate_left(tree, PARENT(node));
+        else
+            tree_rotate_right(tree, PARENT(node));
+    }
+
+    tree_delete3(tree, node);
+}
+
+static void tree_delete3(tree_t *tree, struct TreeNode *node)
+{
+    struct TreeNode *s;
+
+    STAT(tree, delete_cases[2]);
+    // node->color == BLACK.
+    // node has a valid parent (tree_delete1(), tree_delete2()).
+
+    s = tree_node_sibling(node);
+    // Actually if node->color == BLACK (and it is BLACK)
+    //   there must be a valid sibling for node.
+    if( IS_BLACK(PARENT(node))
+        && s && IS_BLACK(s) && IS_BLACK(s->left) && IS_BLACK(s->right) ) {
+            RECOLOR(tree, s, RED);
+            // node->parent->color == BLACK.
+            tree_delete1(tree, PARENT(node));
+    }
+    else {
+        tree_delete4(tree, node);
+    }
+}
+
+static void tree_delete4(tree_t *tree, struct TreeNode *node)
+{
+    struct TreeNode *s;
+
+    STAT(tree, delete_cases[3]);
+    // node->color == BLACK.
+    // node has a valid parent (tree_delete1(), tree_delete2()).
+
+    s = tree_node_sibling(node);
+    // Actually if node->color == BLACK (and it is BLACK)
+    //   there must be a valid sibling for it.
+    if( IS_RED(PARENT(node))
+        && s && IS_BLACK(s) && IS_BLACK(s->left) && IS_BLACK(s->right) ) {
+            RECOLOR(tree, s, RED);
+            RECOLOR(tree, PARENT(node), BLACK);
+    }
+    else {
+        tree_delete5(tree, node);
+    }
+}
+
+static void tree_delete5(tree_t *tree, struct TreeNode *node)
+{
+    struct TreeNode *s;
+
+    STAT(tree, delete_cases[4]);
+    // node->color == BLACK.
+    // node has a valid parent (tree_delete1(), tree_delete2()).
+
+    s = tree_node_sibling(node);
+    // Actually if node->color == BLACK (and it is BLACK)
+    //   there must be a valid sibling for it.
+    if( IS_BLACK(s) ) {
+        if( node == PARENT(node)->left
+            && s && IS_BLACK(s->right) && IS_RED(s->left) ) {
+                RECOLOR(tree, s, RED);
+                // s->left is valid because it's red.
+                RECOLOR(tree, s->left, BLACK);
+                tree_rotate_right(tree, s);
+        }
+        else if( node == PARENT(node)->right
+            && IS_BLACK(s->left) && IS_RED(s->right) ) {
+                RECOLOR(tree, s, RED);
+                // s->right is valid because it's red.
+                RECOLOR(tree, s->right, BLACK);
+                tree_rotate_left(tree, s);
+        }
+    }
+
+    tree_delete6(tree, node);
+}
+
+static void tree_delete6(tree_t *tree, struct TreeNode *node)
+{
+    struct TreeNode *s;
+
+    STAT(tree, delete_cases[5]);
+    // node->color == BLACK.
+    // node has a valid parent (previous cases).
+
+    s = tree_node_sibling(node);
+    // Actually if node->color == BLACK (and it is BLACK)
+    //   there must be a valid sibling for it.
+    // s->color == BLACK (tree_delete2()).
+    RECOLOR(tree, s, COLOR(PARENT(node)));
+    RECOLOR(tree, PARENT(node), BLACK);
+
+    // s must have children otherwise the tree would be unbalanced.
+    // If node == node->parent->left
+    //   then s->right->color == RED (from tree_delete5)
+    //   and s->right must have both valid black children to keep tree balanced.
+    if( node == PARENT(node)->left ) {
+        RECOLOR(tree, s->right, BLACK);
+        tree_rotate_left(tree, PARENT(node));
+    }
+    // If node == node->parent->right
+    //   then s->left->color == RED (from tree_delete5)
+    //   and s->left must have both valid black children to keep tree balanced.
+    else {
+        RECOLOR(tree, s->left, BLACK);
+        tree_rotate_right(tree, PARENT(node));
+    }
+}
+
+static void tree_rotate_left(tree_t *tree, struct TreeNode *node)
+{
+    struct TreeNode *parent, *right;
+
+    STAT(tree, rotations);
+    parent = PARENT(node);
+    right = node->right;
+
+    if( parent ) {
+        if( node == parent->left )
+            parent->left = right;
+        else
+            parent->right = right;
+    }
+    else {
+        tree->root = right;
+    }
+
+    SET_PARENT(right, parent);
+    SET_PARENT(node, right);
+    node->right = right->left;
+    right->left = node;
+    if( node->right )
+        SET_PARENT(node->right, node);
+
+    if( HAS_COUNT(tree) ) {
+        SET_COUNT(right, COUNT(node));
+        UPDATE_COUNT(node);
+    }
+}
+
+static void tree_rotate_right(tree_t *tree, struct TreeNode *node)
+{
+    struct TreeNode *parent, *left;
+
+    STAT(tree, rotations);
+    parent = PARENT(node);
+    left = node->left;
+
+    if( parent ) {
+        if( node == parent->right )
+            parent->right = left;
+        else
+            parent->left = left;
+    }
+    else {
+        tree->root = left;
+    }
+
+    SET_PARENT(left, parent);
+    SET_PARENT(node, left);
+    node->left = left->right;
+    left->right = node;
+    if( node->left )
+        SET_PARENT(node->left, node);
+
+    if( HAS_COUNT(tree) ) {
+        SET_COUNT(left, COUNT(node));
+        UPDATE_COUNT(node);
+    }
+}
+
+// Add delta to the counts of node and all of its ancestors.
+static void tree_count_add(struct TreeNode *node, long delta)
+{
+    for( ; node ; node = PARENT(node) )
+        SET_COUNT(node, COUNT(node) + delta);
+}
+
+// Unknown numbers of red nodes stay unknown.
+static void tree_red_add(tree_t *tree, long delta)
+{
+    if( tree->red_number >= 0 )
+        tree->red_number += delta;
+}
+
+void * tree_fold(tree_t *tree, void * (*fun)(void *, void *, void *), void *acc)
+{
+    return tree_foldl(tree, fun, acc);
+}
+
+void * tree_foldl(tree_t *tree, void * (*fun)(void *, void *, void *), void *acc)
+{
+    return tree_node_foldl(tree, tree->root, fun, acc);
+}
+
+static void * tree_node_foldl(tree_t *tree, struct TreeNode *node, void * (*fun)(void *, void *, void *), void *acc)
+{
+    for( node = tree_node_min(node) ; node ; node = tree_node_next(node) )
+        acc = fun(KEY(tree, node), node->value, acc);
+
+    return acc;
+}
+
+void * tree_foldr(tree_t *tree, void * (*fun)(void *, void *, void *), void *acc)
+{
+    return tree_node_foldr(tree, tree->root, fun, acc);
+}
+
+static void * tree_node_foldr(tree_t *tree, struct TreeNode *node, void * (*fun)(void *, void *, void *), void *acc)
+{
+    for( node = tree_node_max(node) ; node ; node = tree_node_prev(node) )
+        acc = fun(KEY(tree, node), node->value, acc);
+
+    return acc;
+}
+
+void * tree_foldl_until(tree_t *tree, void * (*fun)(void *, void *, void *, int *), void *acc)
+{
+    struct TreeNode *node;
+    int stop = 0;
+
+    for( node = tree_node_min(tree->root) ; node && !stop ; node = tree_node_next(node) )
+        acc = fun(KEY(tree, node), node->value, acc, &stop);
+
+    return acc;
+}
+
+void * tree_foldr_until(tree_t *tree, void * (*fun)(void *, void *, void *, int *), void *acc)
+{
+    struct TreeNode *node;
+    int stop = 0;
+
+    for( node = tree_node_max(tree->root) ; node && !stop ; node = tree_node_prev(node) )
+        acc = fun(KEY(tree, node), node->value, acc, &stop);
+
+    return acc;
+}
+
+void * tree_fold_range(tree_t *tree, void *lo, void *hi, void * (*fun)(void *, void *, void *), void *acc)
+{
+    struct TreeNode *node;
+
+    // One descent to the start of the range, then in-order steps.
+    node = tree_find_bound(tree, lo, 0);
+    while( node && CMP(tree, KEY(tree, node), hi) <= 0 ) {
+        acc = fun(KEY(tree, node), node->value, acc);
+        node = tree_node_next(node);
+    }
+
+    return acc;
+}
+
+tree_iter_t * tree_iter_first(tree_t *tree, tree_iter_t *iter)
+{
+    iter->tree = tree;
+    iter->node = tree_node_min(tree->root);
+
+    return iter->node ? iter : NULL;
+}
+
+tree_iter_t * tree_iter_last(tree_t *tree, tree_iter_t *iter)
+{
+    iter->tree = tree;
+    iter->node = tree_node_max(tree->root);
+
+    return iter->node ? iter : NULL;
+}
+
+tree_iter_t * tree_iter_next(tree_iter_t *iter)
+{
+    if( iter->node )
+        iter->node = tree_node_next(iter->node);
+
+    return iter->node ? iter : NULL;
+}
+
+tree_iter_t * tree_iter_prev(tree_iter_t *iter)
+{
+    if( iter->node )
+        iter->node = tree_node_prev(iter->node);
+
+    return iter->node ? iter : NULL;
+}
+
+void * tree_delete_at(tree_iter_t *iter)
+{
+    struct TreeNode *node;
+
+    if( !(node = iter->node) )
+        return NULL;
+
+    iter->node = tree_node_next(node);
+
+    return tree_delete_node(iter->tree, node);
+}
+
+void * tree_iter_key(tree_iter_t *iter)
+{
+    return iter->node ? KEY(iter->tree, iter->node) : NULL;
+}
+
+void * tree_iter_value(tree_iter_t *iter)
+{
+    return iter->node ? iter->node->value : NULL;
+}
+
+tree_frozen_t * tree_freeze(tree_t *tree)
+{
+    tree_frozen_t *frozen;
+    struct TreeNode *node;
+    long pos;
+    size_t bytes;
+
+    frozen = malloc(sizeof(tree_frozen_t));
+    if( !frozen )
+        return NULL;
+    frozen->cmp = tree->cmp;
+    frozen->size = tree_size(tree);
+    frozen->key_type = KEY_TYPE(tree);
+
+    // Position 0 is unused, it's where the search lands on a miss.
+    // Keys are aligned so the blocks to prefetch start at a cache line.
+    // Pointers and inline keys are both 8 bytes.
+    bytes = (frozen->size + 1)*sizeof(void *);
+    bytes = (bytes + TREE_CACHE_LINE - 1)/TREE_CACHE_LINE*TREE_CACHE_LINE;
+    frozen->keys = aligned_alloc(TREE_CACHE_LINE, bytes);
+    frozen->values = malloc((frozen->size + 1)*sizeof(void *));
+    frozen->ikeys = frozen->key_type ? aligned_alloc(TREE_CACHE_LINE, bytes) : NULL;
+    if( !frozen->keys || !frozen->values || (frozen->key_type && !frozen->ikeys) ) {
+        tree_frozen_destroy(frozen);
+        errno = ENOMEM;
+        return NULL;
+    }
+    frozen->keys[0] = NULL;
+    frozen->values[0] = NULL;
+
+    // Visiting positions in key order and nodes in key order side by side.
+    node = tree->root ? tree_node_min(tree->root) : NULL;
+    for( pos = tree_frozen_first(frozen->size, 1) ; pos ; pos = tree_frozen_next(frozen->size, pos) ) {
+        if( frozen->key_type ) {
+            frozen->ikeys[pos] = node->ikey;
+            frozen->keys[pos] = &frozen->ikeys[pos];
+        }
+        else
+            frozen->keys[pos] = node->key;
+        frozen->values[pos] = node->value;
+        node = tree_node_next(node);
+    }
+
+    return frozen;
+}
+
+void tree_frozen_destroy(tree_frozen_t *frozen)
+{
+    free(frozen->keys);
+    free(frozen->values);
+    free(frozen->ikeys);
+    free(frozen);
+}
+
+long tree_frozen_size(tree_frozen_t *frozen)
+{
+    return frozen->size;
+}
+
+void * tree_frozen_find(tree_frozen_t *frozen, void *key)
+{
+    tree_frozen_iter_t iter;
+
+    if( tree_frozen_lower_bound(frozen, key, &iter) && frozen->cmp(key, frozen->keys[iter.pos]) == 0 )
+        return frozen->values[iter.pos];
+
+    return NULL;
+}
+
+tree_frozen_iter_t * tree_frozen_lower_bound(tree_frozen_t *frozen, void *key, tree_frozen_iter_t *iter)
+{
+    int64_t ikey;
+    uint64_t ukey;
+    long pos;
+
+    // Go right past keys less than key, left otherwise.
+    // The way down is a path of bits, the answer is where it turned left last.
+    pos = 1;
+    if( frozen->key_type == TREE_KEY_INT64 ) {
+        ikey = *(int64_t *)key;
+        while( pos <= frozen->size ) {
+            FROZEN_PREFETCH(frozen, frozen->ikeys, pos);
+            pos = 2*pos + (frozen->ikeys[pos] < ikey);
+        }
+    }
+    else if( frozen->key_type == TREE_KEY_UINT64 ) {
+        ukey = *(uint64_t *)key;
+        while( pos <= frozen->size ) {
+            FROZEN_PREFETCH(frozen, frozen->ikeys, pos);
+            pos = 2*pos + ((uint64_t)frozen->ikeys[pos] < ukey);
+        }
+    }
+    else {
+        while( pos <= frozen->size ) {
+            FROZEN_PREFETCH(frozen, frozen->keys, pos);
+            pos = 2*pos + (frozen->cmp(frozen->keys[pos], key) < 0);
+        }
+    }
+    pos >>= __builtin_ffsl(~pos);
+
+    iter->frozen = frozen;
+    iter->pos = pos;
+
+    return pos ? iter : NULL;
+}
+
+tree_frozen_iter_t * tree_frozen_iter_next(tree_frozen_iter_t *iter)
+{
+    if( iter->pos )
+        iter->pos = tree_frozen_next(iter->frozen->size, iter->pos);
+
+    return iter->pos ? iter : NULL;
+}
+
+void * tree_frozen_iter_key(tree_frozen_iter_t *iter)
+{
+    return iter->frozen->keys[iter->pos];
+}
+
+void * tree_frozen_iter_value(tree_frozen_iter_t *iter)
+{
+    return iter->frozen->values[iter->pos];
+}
+
+// The leftmost position of the subtree at pos, 0 if it's empty.
+static long tree_frozen_first(long size, long pos)
+{
+    if( pos > size )
+        return 0;
+    while( 2*pos <= size )
+        pos = 2*pos;
+
+    return pos;
+}
+
+// The position of the next key, 0 after the last one.
+static long tree_frozen_next(long size, long pos)
+{
+    // The leftmost position of the right subtree if there is one,
+    // otherwise up to the first ancestor entered from the left.
+    if( 2*pos + 1 <= size )
+        return tree_frozen_first(size, 2*pos + 1);
+    pos >>= __builtin_ffsl(~pos);
+
+    return pos;
+}
+
+// Image written by tree_save(), integers are little-endian:
+//   "RBTF", version (4 bytes), number of entries (8 bytes),
+//   every entry as its size (4 bytes) and what the encoder made of it,
+//   CRC-32 of everything above (4 bytes).
+#define TREE_FILE_MAGIC     "RBTF"
+#define TREE_FILE_VERSION   1
+#define TREE_FILE_HEADER    16
+#define TREE_FILE_BUFFER    65536
+// tree_load() takes nodes for at least that many entries at once.
+#define TREE_FILE_CHUNK     65536
+
+int tree_save(tree_t *tree, int fd, tree_encode_t encode, void *ctx)
+{
+    struct TreeFile file;
+    struct TreeNode *node;
+    unsigned char header[TREE_FILE_HEADER], trailer[4];
+    long size;
+
+    // Hooks belong to the caller, there is nothing to encode them with.
+    if( INTRUSIVE(tree) ) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memcpy(header, TREE_FILE_MAGIC, 4);
+    tree_file_put(header + 4, TREE_FILE_VERSION, 4);
+    tree_file_put(header + 8, tree_size(tree), 8);
+
+    tree_file_init(&file, fd);
+    memcpy(file.buf, header, TREE_FILE_HEADER);
+    file.len = TREE_FILE_HEADER;
+    for( node = tree_node_min(tree->root) ; node ; node = tree_node_next(node) ) {
+        if( (size = tree_file_encode(&file, 4, encode, KEY(tree, node), node->value, ctx)) < 0 )
+            goto fail;
+        if( size > UINT32_MAX ) {
+            errno = EINVAL;
+            goto fail;
+        }
+        tree_file_put(file.buf + file.len, size, 4);
+        file.len += size + 4;
+    }
+
+    if( tree_file_flush(&file) )
+        goto fail;
+    tree_file_put(trailer, file.crc, 4);
+    if( tree_file_write(fd, trailer, 4) )
+        goto fail;
+
+    free(file.buf);
+    return 0;
+
+fail:
+    free(file.buf);
+    return -1;
+}
+
+tree_t * tree_load(tree_cmp_t cmp, const tree_options_t *options, int fd,
+    tree_decode_t decode, void (*destructor)(void *), void *ctx)
+{
+    struct TreeFile file;
+    struct TreeNode **nodes, **grown;
+    struct stat st;
+    const unsigned char *p;
+    tree_t *tree;
+    void *key, *value;
+    uint32_t crc;
+    long n, i, size, capacity, left;
+    off_t start;
+
+    nodes = NULL;
+    tree = NULL;
+    i = 0;
+    tree_file_init(&file, fd);
+
+    if( !(p = tree_file_read(&file, TREE_FILE_HEADER)) )
+        goto fail;
+    if( memcmp(p, TREE_FILE_MAGIC, 4) || tree_file_get(p + 4, 4) != TREE_FILE_VERSION ) {
+        errno = EINVAL;
+        goto fail;
+    }
+    // Bytes of a regular file past what's read, -1 if unknown.
+    left = -1;
+    if( fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && (start = lseek(fd, 0, SEEK_CUR)) >= 0 )
+        left = (long)(st.st_size - start) + (file.len - file.pos);
+    // Every entry takes at least 4 bytes, a damaged count must not
+    // reserve more nodes than a file of that size may have.
+    n = (long)tree_file_get(p + 8, 8);
+    if( n < 0 || (unsigned long)n > SIZE_MAX/sizeof(struct TreeNode *)
+        || (left >= 0 && n > left/4) ) {
+        errno = EINVAL;
+        goto fail;
+    }
+
+    tree = tree_create_ext(cmp, options);
+    capacity = 0;
+
+    // Entries come in order, so nodes are made as they are decoded and
+    // the tree is built from them at once like tree_build_sorted() does.
+    // The count of a pipe can't be checked against its size: room for
+    // nodes grows with the entries that really come.
+    for( i = 0 ; i < n ; ) {
+        if( i == capacity ) {
+            capacity = capacity < TREE_FILE_CHUNK ? TREE_FILE_CHUNK : 2*capacity;
+            if( capacity > n )
+                capacity = n;
+            if( !(grown = realloc(nodes, capacity*sizeof(struct TreeNode *))) )
+                goto fail;
+            nodes = grown;
+            if( !tree->options.alloc
+                && tree_pool_reserve(tree_pool_get(tree), tree->node_size, capacity - i) )
+                goto fail;
+        }
+        if( !(p = tree_file_read(&file, 4)) )
+            goto fail;
+        size = (long)tree_file_get(p, 4);
+        // Nor a damaged length allocate more than the file has left.
+        if( left >= 0 ) {
+            left -= 4;
+            if( size > left ) {
+                errno = EINVAL;
+                goto fail;
+            }
+            left -= size;
+        }
+        if( !(p = tree_file_read(&file, size)) )
+            goto fail;
+        if( decode(p, size, &key, &value, ctx) ) {
+            errno = EINVAL;
+            goto fail;
+        }
+        if( !(nodes[i] = tree_node_create(tree, key, value)) ) {
+            if( destructor )
+                destructor(value);
+            errno = ENOMEM;
+            goto fail;
+        }
+        i++;
+        if( i > 1 && CMP(tree, KEY(tree, nodes[i - 2]), KEY(tree, nodes[i - 1])) >= 0 ) {
+            errno = EINVAL;
+            goto fail;
+        }
+    }
+
+    crc = file.crc;
+    if( !(p = tree_file_read(&file, 4)) )
+        goto fail;
+    if( tree_file_get(p, 4) != crc ) {
+        errno = EINVAL;
+        goto fail;
+    }
+
+    tree_build(tree, nodes, NULL, NULL, n);
+    // Give back what was read past the image if fd can seek.
+    if( file.len > file.pos )
+        lseek(fd, file.pos - file.len, SEEK_CUR);
+    free(nodes);
+    free(file.buf);
+
+    return tree;
+
+fail:
+    while( i > 0 ) {
+        i--;
+        if( destructor )
+            destructor(nodes[i]->value);
+        tree_node_destroy(tree, nodes[i]);
+    }
+    if( tree )
+        tree_destroy(tree, NULL);
+    free(nodes);
+    free(file.buf);
+
+    return NULL;
+}
+
+// Images of tree_image_save(): the header, keys and values as the
+// encoders made them in key order, then nodes in breadth-first order so
+// the first levels of every search share a few pages. Nodes refer to
+// each other, keys and values by offsets from the start of the image,
+// 0 is none. Everything is 8 bytes aligned and in the host byte order.
+#define TREE_IMAGE_MAGIC        "RBTI"
+#define TREE_IMAGE_VERSION      1
+#define TREE_IMAGE_BYTE_ORDER   0x01020304
+
+struct TreeImageHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t byte_order;
+    // CRC-32 of everything after the header.
+    uint32_t crc;
+    uint64_t size;
+    uint64_t count;
+    uint64_t nodes;
+    uint64_t root;
+};
+
+struct TreeImageNode {
+    uint64_t left;
+    uint64_t right;
+    // The next node in key order.
+    uint64_t next;
+    uint64_t key;
+    uint64_t value;
+};
+
+struct TreeImage {
+    tree_cmp_t cmp;
+    const char *base;
+    size_t size;
+    long count;
+};
+
+#define IMAGE_NODE(image, offset) \
+    ((const struct TreeImageNode *)((image)->base + (offset)))
+// Offsets of nodes must be aligned for them, offsets of keys and values
+// the way tree_file_pad() aligns them, or reads through them are undefined.
+#define TREE_IMAGE_NODE_ALIGN   _Alignof(struct TreeImageNode)
+#define TREE_IMAGE_DATA_ALIGN   8
+
+int tree_image_save(tree_t *tree, int fd, tree_encode_t encode_key, tree_encode_t encode_value, void *ctx)
+{
+    struct TreeImageHeader header;
+    struct TreeImageNode *nodes;
+    struct TreeFile file;
+    struct TreeNode *node;
+    long n, pos, size, i;
+
+    if( INTRUSIVE(tree) ) {
+        errno = EINVAL;
+        return -1;
+    }
+    // Images are mapped as whole files.
+    if( lseek(fd, 0, SEEK_CUR) != 0 ) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    n = tree_size(tree);
+    nodes = NULL;
+    if( n > 0 && !(nodes = calloc(n, sizeof(struct TreeImageNode))) )
+        return -1;
+    // The header is written last, when the checksum is known.
+    memset(&header, 0, sizeof(header));
+    if( tree_file_write(fd, (unsigned char *)&header, sizeof(header)) ) {
+        free(nodes);
+        return -1;
+    }
+    tree_file_init(&file, fd);
+    file.offset = sizeof(header);
+
+    // Positions of the breadth-first layout in key order, see tree_freeze().
+    node = tree_node_min(tree->root);
+    for( pos = tree_frozen_first(n, 1) ; pos ; pos = tree_frozen_next(n, pos) ) {
+        for( i = 0 ; i < 2 ; i++ ) {
+            if( i == 1 && !encode_value )
+                break;
+            size = tree_file_encode(&file, 0, i ? encode_value : encode_key, KEY(tree, node), node->value, ctx);
+            if( size < 0 )
+                goto fail;
+            if( i == 0 )
+                nodes[pos - 1].key = file.offset + file.len;
+            else
+                nodes[pos - 1].value = file.offset + file.len;
+            file.len += size;
+            if( tree_file_pad(&file) )
+                goto fail;
+        }
+        node = tree_node_next(node);
+    }
+
+    header.nodes = file.offset + file.len;
+    for( pos = tree_frozen_first(n, 1) ; pos ; pos = tree_frozen_next(n, pos) ) {
+        nodes[pos - 1].left = 2*pos <= n ? header.nodes + (2*pos - 1)*sizeof(struct TreeImageNode) : 0;
+        nodes[pos - 1].right = 2*pos + 1 <= n ? header.nodes + 2*pos*sizeof(struct TreeImageNode) : 0;
+        i = tree_frozen_next(n, pos);
+        nodes[pos - 1].next = i ? header.nodes + (i - 1)*sizeof(struct TreeImageNode) : 0;
+    }
+    if( tree_file_flush(&file) )
+        goto fail;
+    tree_file_crc(&file, (unsigned char *)nodes, n*sizeof(struct TreeImageNode));
+    if( tree_file_write(fd, (unsigned char *)nodes, n*sizeof(struct TreeImageNode)) )
+        goto fail;
+
+    memcpy(header.magic, TREE_IMAGE_MAGIC, 4);
+    header.version = TREE_IMAGE_VERSION;
+    header.byte_order = TREE_IMAGE_BYTE_ORDER;
+    header.size = header.nodes + n*sizeof(struct TreeImageNode);
+    header.count = n;
+    header.root = n > 0 ? header.nodes : 0;
+    header.crc = file.crc;
+    if( pwrite(fd, &header, sizeof(header), 0) != sizeof(header) || ftruncate(fd, header.size) )
+        goto fail;
+
+    free(nodes);
+    free(file.buf);
+    return 0;
+
+fail:
+    free(nodes);
+    free(file.buf);
+    return -1;
+}
+
+tree_image_t * tree_image_map(int fd, tree_cmp_t cmp)
+{
+    const struct TreeImageHeader *header;
+    tree_image_t *image;
+    struct stat st;
+    void *base;
+
+    if( fstat(fd, &st) )
+        return NULL;
+    if( st.st_size < (off_t)sizeof(struct TreeImageHeader) ) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if( (base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED )
+        return NULL;
+
+    header = base;
+    if( memcmp(header->magic, TREE_IMAGE_MAGIC, 4) || header->version != TREE_IMAGE_VERSION
+        || header->byte_order != TREE_IMAGE_BYTE_ORDER || header->size != (uint64_t)st.st_size
+        || header->nodes < sizeof(*header) || header->nodes % TREE_IMAGE_NODE_ALIGN
+        || header->nodes > header->size
+        || header->count > (header->size - header->nodes)/sizeof(struct TreeImageNode)
+        || header->nodes + header->count*sizeof(struct TreeImageNode) != header->size
+        || (header->root != 0) != (header->count != 0) || header->root % TREE_IMAGE_NODE_ALIGN
+        || (header->root && (header->root < header->nodes || header->root >= header->size)) ) {
+        munmap(base, st.st_size);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    image = malloc(sizeof(tree_image_t));
+    image->cmp = cmp;
+    image->base = base;
+    image->size = st.st_size;
+    image->count = header->count;
+
+    return image;
+}
+
+void tree_image_unmap(tree_image_t *image)
+{
+    munmap((void *)image->base, image->size);
+    free(image);
+}
+
+long tree_image_size(tree_image_t *image)
+{
+    return image->count;
+}
+
+void * tree_image_find(tree_image_t *image, void *key)
+{
+    const struct TreeImageNode *node;
+    uint64_t offset;
+    long depth;
+    int cmp;
+
+    // No path is longer than count nodes, links of a damaged image
+    // that isn't checked can't make a search go round.
+    offset = ((const struct TreeImageHeader *)image->base)->root;
+    for( depth = 0 ; offset && depth < image->count ; depth++ ) {
+        node = IMAGE_NODE(image, offset);
+        cmp = image->cmp(key, image->base + node->key);
+        if( cmp == 0 )
+            return node->value ? (void *)(image->base + node->value) : NULL;
+        offset = cmp < 0 ? node->left : node->right;
     }
+
+    return NULL;
 }
 
-static void tree_insert4(struct TreeNode *node)
+tree_image_iter_t * tree_image_lower_bound(tree_image_t *image, void *key, tree_image_iter_t *iter)
 {
-    struct TreeNode *g;
-
-    g = tree_node_grandparent(node);
-
-    // node->color == RED (still)
-    //   and parent->color == RED (tree_insert2() => tree_insert3())
-    //   and uncle->color == BLACK (known from tree_insert3()).
-    // grand is valid because parent->color == RED so the grand must exist.
-    if( node == node->parent->right && node->parent == g->left ) {
-        tree_rotate_left(node->parent);
-        // Take the former parent.
-        node = node->left;
-    }
-    else if( node == node->parent->left && node->parent == g->right ) {
-        tree_rotate_right(node->parent);
-        // Take the former parent.
-        node = node->right;
+    const struct TreeImageNode *node;
+    uint64_t offset;
+    long depth;
+
+    iter->image = image;
+    iter->node = 0;
+    offset = ((const struct TreeImageHeader *)image->base)->root;
+    for( depth = 0 ; offset && depth < image->count ; depth++ ) {
+        node = IMAGE_NODE(image, offset);
+        if( image->cmp(key, image->base + node->key) <= 0 ) {
+            iter->node = offset;
+            offset = node->left;
+        }
+        else
+            offset = node->right;
     }
 
-    // Now we are working with former node's parent.
-    tree_insert5(node);
+    return iter->node ? iter : NULL;
 }
 
-static void tree_insert5(struct TreeNode *node)
+tree_image_iter_t * tree_image_iter_next(tree_image_iter_t *iter)
 {
-    struct TreeNode *g;
+    if( iter->node )
+        iter->node = IMAGE_NODE(iter->image, iter->node)->next;
 
-    g = tree_node_grandparent(node);
+    return iter->node ? iter : NULL;
+}
 
-    // Now node = parent and parent = node.
-    // Both node and parent are left or right for their parents.
-    // grand is valid - it's the same as in (tree_insert4()).
-    // node->color == RED and parent->color == RED (as in tree_insert4())
-    //   and uncle->color == BLACK (it's the same as in tree_insert4())
-    //   and grand->color == BLACK (it was a parent of RED node).
-    node->parent->color = BLACK;
-    g->color = RED;
-    if( node == node->parent->left && node->parent == g->left )
-        tree_rotate_right(g);
-    else if( node == node->parent->right && node->parent == g->right )
-        tree_rotate_left(g);
+void * tree_image_iter_key(tree_image_iter_t *iter)
+{
+    return (void *)(iter->image->base + IMAGE_NODE(iter->image, iter->node)->key);
 }
 
-void * tree_delete(tree_t *tree, void *key)
+void * tree_image_iter_value(tree_image_iter_t *iter)
 {
-    struct TreeNode *node, *heir;
-    void *value;
+    uint64_t value;
 
-    if( !(node = tree_find_node(tree, key)) )
-        return NULL;
+    value = IMAGE_NODE(iter->image, iter->node)->value;
 
-    value = node->value;
-    if( node->left )
-        heir = tree_node_max(node->left);
-    else if( node->right )
-        heir = tree_node_min(node->right);
-    else
-        heir = NULL;
+    return value ? (void *)(iter->image->base + value) : NULL;
+}
+
+void * tree_image_fold_range(tree_image_t *image, void *lo, void *hi, void * (*fun)(void *, void *, void *), void *acc)
+{
+    tree_image_iter_t iter, *it;
 
-    if( heir ) {
-        node->key = heir->key;
-        node->value = heir->value;
-        node = heir;
+    for( it = tree_image_lower_bound(image, lo, &iter) ; it ; it = tree_image_iter_next(it) ) {
+        if( image->cmp(tree_image_iter_key(it), hi) > 0 )
+            break;
+        acc = fun(tree_image_iter_key(it), tree_image_iter_value(it), acc);
     }
 
-    // It follows from above that node has at most 1 non-null branch.
-    heir = node->left ? node->left : node->right;
-    if( heir ) {
-        node->key = heir->key;
-        node->value = heir->value;
+    return acc;
+}
 
-        if( IS_BLACK(heir) ) {
-            if( IS_RED(node) )
-                node->color = BLACK;
-            else
-                // heir->color == BLACK and node->color == BLACK.
-                // Hence correction is required.
-                tree_delete1(node);
-        }
+int tree_image_check(tree_image_t *image)
+{
+    const struct TreeImageHeader *header;
+    const struct TreeImageNode *node;
+    struct TreeFile file;
+    const char *last;
+    long pos, next;
+    uint32_t crc;
+
+    header = (const struct TreeImageHeader *)image->base;
+    tree_file_init(&file, -1);
+    tree_file_crc(&file, (const unsigned char *)image->base + sizeof(*header), image->size - sizeof(*header));
+    crc = file.crc;
+    free(file.buf);
+    if( crc != header->crc )
+        return 0;
 
-        node = heir;
-    }
-    else {
-        if( IS_BLACK(node) )
-            // Hence correction is required.
-            tree_delete1(node);
+    // Nodes link up breadth-first the way tree_image_save() lays them
+    // out, so searches only go down and the walk in key order sees every
+    // node once. Keys and values are aligned in the data and keys ascend.
+    if( header->root != tree_image_node_offset(image, 1) )
+        return 0;
+    last = NULL;
+    for( pos = tree_frozen_first(image->count, 1) ; pos ; pos = next ) {
+        next = tree_frozen_next(image->count, pos);
+        node = IMAGE_NODE(image, tree_image_node_offset(image, pos));
+        if( node->left != tree_image_node_offset(image, 2*pos)
+            || node->right != tree_image_node_offset(image, 2*pos + 1)
+            || node->next != tree_image_node_offset(image, next)
+            || node->key < sizeof(*header) || node->key >= header->nodes
+            || node->key % TREE_IMAGE_DATA_ALIGN || node->value % TREE_IMAGE_DATA_ALIGN
+            || (node->value && (node->value < sizeof(*header) || node->value >= header->nodes)) )
+            return 0;
+        if( last && image->cmp(last, image->base + node->key) >= 0 )
+            return 0;
+        last = image->base + node->key;
     }
 
-    if( !node->parent )
-        tree->root = NULL;
-    else if( node == node->parent->left )
-        node->parent->left = NULL;
-    else
-        node->parent->right = NULL;
+    return 1;
+}
 
-    tree_node_destroy(node);
-    tree->size--;
+// Offset of the node at position pos of the breadth-first layout,
+// positions start from 1. 0 if there is no such node.
+static uint64_t tree_image_node_offset(tree_image_t *image, long pos)
+{
+    const struct TreeImageHeader *header;
 
-    return value;
+    header = (const struct TreeImageHeader *)image->base;
+    if( pos < 1 || pos > image->count )
+        return 0;
+
+    return header->nodes + (pos - 1)*sizeof(struct TreeImageNode);
 }
 
-static void tree_delete1(struct TreeNode *node)
+static void tree_file_init(struct TreeFile *file, int fd)
 {
-    // node->color == BLACK (known from tree_delete()).
-    // If node is root then nothing has to be done.
-    if( node->parent )
-        tree_delete2(node);
+    uint32_t c;
+    int i, k;
+
+    memset(file, 0, sizeof(*file));
+    file->fd = fd;
+    file->size = TREE_FILE_BUFFER;
+    file->buf = malloc(file->size);
+    for( i = 0 ; i < 256 ; i++ ) {
+        c = i;
+        for( k = 0 ; k < 8 ; k++ )
+            c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        file->crc_table[i] = c;
+    }
 }
 
-static void tree_delete2(struct TreeNode *node)
+static void tree_file_crc(struct TreeFile *file, const unsigned char *p, long size)
 {
-    struct TreeNode *s;
+    uint32_t c;
 
-    // node->color == BLACK.
-    // node has a valid parent (tree_delete1()).
+    c = ~file->crc;
+    while( size-- > 0 )
+        c = file->crc_table[(c ^ *p++) & 0xff] ^ (c >> 8);
+    file->crc = ~c;
+}
 
-    s = tree_node_sibling(node);
-    if( IS_RED(s) ) {
-        // If s->color == RED it is valid (non-null).
-        node->parent->color = RED;
-        s->color = BLACK;
-        if( node == node->parent->left )
-            tree_rotate_left(node->parent);
-        else
-            tree_rotate_right(node->parent);
-    }
+static void tree_file_put(unsigned char *p, uint64_t x, int size)
+{
+    int i;
 
-    tree_delete3(node);
+    for( i = 0 ; i < size ; i++ )
+        p[i] = (unsigned char)(x >> 8*i);
 }
 
-static void tree_delete3(struct TreeNode *node)
+static uint64_t tree_file_get(const unsigned char *p, int size)
 {
-    struct TreeNode *s;
+    uint64_t x;
+    int i;
 
-    // node->color == BLACK.
-    // node has a valid parent (tree_delete1(), tree_delete2()).
+    x = 0;
+    for( i = 0 ; i < size ; i++ )
+        x |= (uint64_t)p[i] << 8*i;
 
-    s = tree_node_sibling(node);
-    // Actually if node->color == BLACK (and it is BLACK)
-    //   there must be a valid sibling for node.
-    if( IS_BLACK(node->parent)
-        && s && IS_BLACK(s) && IS_BLACK(s->left) && IS_BLACK(s->right) ) {
-            s->color = RED;
-            // node->parent->color == BLACK.
-            tree_delete1(node->parent);
-    }
-    else {
-        tree_delete4(node);
-    }
+    return x;
 }
 
-static void tree_delete4(struct TreeNode *node)
+static int tree_file_write(int fd, const unsigned char *p, long size)
 {
-    struct TreeNode *s;
+    ssize_t n;
 
-    // node->color == BLACK.
-    // node has a valid parent (tree_delete1(), tree_delete2()).
-
-    s = tree_node_sibling(node);
-    // Actually if node->color == BLACK (and it is BLACK)
-    //   there must be a valid sibling for it.
-    if( IS_RED(node->parent)
-        && s && IS_BLACK(s) && IS_BLACK(s->left) && IS_BLACK(s->right) ) {
-            s->color = RED;
-            node->parent->color = BLACK;
-    }
-    else {
-        tree_delete5(node);
+    while( size > 0 ) {
+        if( (n = write(fd, p, size)) < 0 ) {
+            if( errno == EINTR )
+                continue;
+            return -1;
+        }
+        p += n;
+        size -= n;
     }
+
+    return 0;
 }
 
-static void tree_delete5(struct TreeNode *node)
+static int tree_file_flush(struct TreeFile *file)
 {
-    struct TreeNode *s;
+    tree_file_crc(file, file->buf, file->len);
+    if( tree_file_write(file->fd, file->buf, file->len) )
+        return -1;
+    file->offset += file->len;
+    file->len = 0;
 
-    // node->color == BLACK.
-    // node has a valid parent (tree_delete1(), tree_delete2()).
+    return 0;
+}
 
-    s = tree_node_sibling(node);
-    // Actually if node->color == BLACK (and it is BLACK)
-    //   there must be a valid sibling for it.
-    if( IS_BLACK(s) ) {
-        if( node == node->parent->left
-            && s && IS_BLACK(s->right) && IS_RED(s->left) ) {
-                s->color = RED;
-                // s->left is valid because it's red.
-                s->left->color = BLACK;
-                tree_rotate_right(s);
-        }
-        else if( node == node->parent->right
-            && IS_BLACK(s->left) && IS_RED(s->right) ) {
-                s->color = RED;
-                // s->right is valid because it's red.
-                s->right->color = BLACK;
-                tree_rotate_left(s);
-        }
+// Make room for size more bytes in the write buffer.
+static int tree_file_reserve(struct TreeFile *file, long size)
+{
+    unsigned char *buf;
+
+    if( tree_file_flush(file) )
+        return -1;
+    if( size > file->size ) {
+        if( !(buf = realloc(file->buf, size)) )
+            return -1;
+        file->buf = buf;
+        file->size = size;
     }
 
-    tree_delete6(node);
+    return 0;
 }
 
-static void tree_delete6(struct TreeNode *node)
+// Zeros up to the next multiple of 8 bytes written.
+static int tree_file_pad(struct TreeFile *file)
 {
-    struct TreeNode *s;
+    long pad;
 
-    // node->color == BLACK.
-    // node has a valid parent (previous cases).
+    pad = (8 - (file->offset + file->len) % 8) % 8;
+    if( file->size - file->len < pad && tree_file_reserve(file, pad) )
+        return -1;
+    memset(file->buf + file->len, 0, pad);
+    file->len += pad;
 
-    s = tree_node_sibling(node);
-    // Actually if node->color == BLACK (and it is BLACK)
-    //   there must be a valid sibling for it.
-    // s->color == BLACK (tree_delete2()).
-    s->color = node->parent->color;
-    node->parent->color = BLACK;
+    return 0;
+}
 
-    // s must have children otherwise the tree would be unbalanced.
-    // If node == node->parent->left
-    //   then s->right->color == RED (from tree_delete5)
-    //   and s->right must have both valid black children to keep tree balanced.
-    if( node == node->parent->left ) {
-        s->right->color = BLACK;
-        tree_rotate_left(node->parent);
-    }
-    // If node == node->parent->right
-    //   then s->left->color == RED (from tree_delete5)
-    //   and s->left must have both valid black children to keep tree balanced.
-    else {
-        s->left->color = BLACK;
-        tree_rotate_right(node->parent);
+// Let encode write right into the buffer after prefix bytes kept for
+// the caller. If it doesn't fit it's done again once there is room.
+// Return the size of what was written, the buffer's length isn't changed.
+static long tree_file_encode(struct TreeFile *file, long prefix, tree_encode_t encode, void *key, void *value, void *ctx)
+{
+    long avail, need;
+
+    for( ;; ) {
+        if( file->size - file->len < prefix && tree_file_reserve(file, prefix) )
+            return -1;
+        avail = file->size - file->len - prefix;
+        need = encode(key, value, file->buf + file->len + prefix, avail, ctx);
+        if( need < 0 ) {
+            errno = EINVAL;
+            return -1;
+        }
+        if( need <= avail )
+            return need;
+        if( tree_file_reserve(file, need + prefix) )
+            return -1;
     }
 }
 
-static void tree_rotate_left(struct TreeNode *node)
+// The next size bytes of fd, valid until the next call.
+// NULL on errors, errno is EINVAL if the image ends too early.
+static const unsigned char * tree_file_read(struct TreeFile *file, long size)
 {
-    if( node->parent ) {
-        if( node == node->parent->left )
-            node->parent->left = node->right;
-        else
-            node->parent->right = node->right;
+    unsigned char *buf;
+    const unsigned char *p;
+    ssize_t n;
+
+    if( file->len - file->pos < size ) {
+        memmove(file->buf, file->buf + file->pos, file->len - file->pos);
+        file->len -= file->pos;
+        file->pos = 0;
+        if( size > file->size ) {
+            if( !(buf = realloc(file->buf, size)) )
+                return NULL;
+            file->buf = buf;
+            file->size = size;
+        }
+        while( file->len < size ) {
+            if( (n = read(file->fd, file->buf + file->len, file->size - file->len)) < 0 ) {
+                if( errno == EINTR )
+                    continue;
+                return NULL;
+            }
+            if( n == 0 ) {
+                errno = EINVAL;
+                return NULL;
+            }
+            file->len += n;
+        }
     }
-    else {
-        node->tree->root = node->right;
+
+    p = file->buf + file->pos;
+    file->pos += size;
+    tree_file_crc(file, p, size);
+
+    return p;
+}
+
+static struct TreeNode * tree_node_create(tree_t *tree, void *key, void *value)
+{
+    struct TreeNode *node;
+
+    if( tree->options.alloc )
+        node = tree->options.alloc(tree->node_size, tree->options.alloc_ctx);
+    else
+        node = tree_pool_alloc(tree_pool_get(tree), tree->node_size);
+    if( !node ) {
+        errno = ENOMEM;
+        return NULL;
     }
 
-    node->right->parent = node->parent;
-    node->parent = node->right;
-    node->right = node->right->left;
-    node->parent->left = node;
-    if( node->right )
-        node->right->parent = node;
+    node->parent_color = RED;
+    node->left = NULL;
+    node->right = NULL;
+    if( KEY_TYPE(tree) == TREE_KEY_INT64 )
+        node->ikey = *(int64_t *)key;
+    else if( KEY_TYPE(tree) == TREE_KEY_UINT64 )
+        node->ukey = *(uint64_t *)key;
+    else
+        node->key = key;
+    node->value = value;
+    if( HAS_COUNT(tree) )
+        SET_COUNT(node, 1);
+
+    return node;
 }
 
-static void tree_rotate_right(struct TreeNode *node)
+static void tree_node_destroy(tree_t *tree, struct TreeNode *node)
 {
-    if( node->parent ) {
-        if( node == node->parent->right )
-            node->parent->right = node->left;
-        else
-            node->parent->left = node->left;
+    if( tree->options.alloc ) {
+        if( tree->options.free )
+            tree->options.free(node, tree->options.alloc_ctx);
     }
     else {
-        node->tree->root = node->left;
+        tree_pool_free(tree_pool_get(tree), node);
     }
-
-    node->left->parent = node->parent;
-    node->parent = node->left;
-    node->left = node->left->right;
-    node->parent->right = node;
-    if( node->left )
-        node->left->parent = node;
 }
 
-void * tree_fold(tree_t *tree, void * (*fun)(void *, void *, void *), void *acc)
+static struct TreePool * tree_pool_create(void)
 {
-    return tree_foldl(tree, fun, acc);
+    struct TreePool *pool;
+
+    pool = malloc(sizeof(struct TreePool));
+    memset(pool, 0, sizeof(*pool));
+    pool->refs = 1;
+
+    return pool;
 }
 
-void * tree_foldl(tree_t *tree, void * (*fun)(void *, void *, void *), void *acc)
+// The pool the tree allocates from, following merged pools.
+static struct TreePool * tree_pool_get(tree_t *tree)
 {
-    return tree_node_foldl(tree->root, fun, acc);
+    struct TreePool *pool;
+
+    if( !tree->pool->merged )
+        return tree->pool;
+
+    for( pool = tree->pool ; pool->merged ; pool = pool->merged )
+        ;
+
+    // Point the tree directly to the pool so the next lookup is O(1).
+    pool->refs++;
+    tree_pool_release(tree->pool);
+    tree->pool = pool;
+
+    return pool;
 }
 
-static void * tree_node_foldl(struct TreeNode *node, void * (*fun)(void *, void *, void *), void *acc)
+// Hand slabs and free nodes of other over to pool and forward other to it.
+// Both pools must not be forwarded already.
+static void tree_pool_merge(struct TreePool *pool, struct TreePool *other)
 {
-    if( node ) {
-        acc = tree_node_foldl(node->left, fun, acc);
-        acc = fun(node->key, node->value, acc);
-        acc = tree_node_foldl(node->right, fun, acc);
+    if( pool == other )
+        return;
+
+    if( other->slabs ) {
+        other->last_slab->next = pool->slabs;
+        if( !pool->slabs )
+            pool->last_slab = other->last_slab;
+        pool->slabs = other->slabs;
     }
 
-    return acc;
+    if( other->free_list ) {
+        other->last_free->next = pool->free_list;
+        if( !pool->free_list )
+            pool->last_free = other->last_free;
+        pool->free_list = other->free_list;
+    }
+
+    // Keep the bigger of the unused slab tails.
+    if( other->end - other->next > pool->end - pool->next ) {
+        pool->next = other->next;
+        pool->end = other->end;
+    }
+    if( other->slab_nodes > pool->slab_nodes )
+        pool->slab_nodes = other->slab_nodes;
+
+    other->slabs = other->last_slab = NULL;
+    other->free_list = other->last_free = NULL;
+    other->next = other->end = NULL;
+    other->merged = pool;
+    pool->refs++;
 }
 
-void * tree_foldr(tree_t *tree, void * (*fun)(void *, void *, void *), void *acc)
+static void tree_pool_release(struct TreePool *pool)
 {
-    return tree_node_foldr(tree->root, fun, acc);
+    struct TreePool *merged;
+    struct TreePoolSlab *slab;
+
+    while( pool && --pool->refs == 0 ) {
+        while( (slab = pool->slabs) ) {
+            pool->slabs = slab->next;
+            free(slab);
+        }
+
+        merged = pool->merged;
+        free(pool);
+        pool = merged;
+    }
 }
 
-static void * tree_node_foldr(struct TreeNode *node, void * (*fun)(void *, void *, void *), void *acc)
+static void * tree_pool_alloc(struct TreePool *pool, size_t size)
 {
-    if( node ) {
-        acc = tree_node_foldr(node->right, fun, acc);
-        acc = fun(node->key, node->value, acc);
-        acc = tree_node_foldr(node->left, fun, acc);
+    void *ptr;
+
+    if( pool->free_list ) {
+        ptr = pool->free_list;
+        if( !(pool->free_list = pool->free_list->next) )
+            pool->last_free = NULL;
+        return ptr;
     }
 
-    return acc;
+    if( pool->next == pool->end ) {
+        // Every new slab is twice as big as the previous one
+        // up to TREE_POOL_SLAB_MAX nodes.
+        if( pool->slab_nodes == 0 )
+            pool->slab_nodes = TREE_POOL_SLAB_MIN;
+        else if( pool->slab_nodes < TREE_POOL_SLAB_MAX )
+            pool->slab_nodes *= 2;
+
+        if( tree_pool_grow(pool, size, pool->slab_nodes) )
+            return NULL;
+    }
+
+    ptr = pool->next;
+    pool->next += size;
+
+    return ptr;
 }
 
-static struct TreeNode * tree_node_create(void *key, void *value)
+// Make sure the next n allocations are contiguous.
+// Return -1 if there is no memory for them.
+static int tree_pool_reserve(struct TreePool *pool, size_t size, long n)
 {
-    struct TreeNode *node;
+    if( n > 0 && (pool->end - pool->next)/(long)size < n )
+        return tree_pool_grow(pool, size, n);
 
-    node = malloc(sizeof(struct TreeNode));
-    memset(node, 0, sizeof(*node));
+    return 0;
+}
 
-    node->key = key;
-    node->value = value;
-    node->color = RED;
+static int tree_pool_grow(struct TreePool *pool, size_t size, long n)
+{
+    struct TreePoolSlab *slab;
 
-    return node;
+    // The header is padded to the node size so nodes stay aligned.
+    if( (size_t)n > SIZE_MAX/size - 1 ) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if( !(slab = malloc(size + n*size)) )
+        return -1;
+    slab->next = pool->slabs;
+    if( !pool->slabs )
+        pool->last_slab = slab;
+    pool->slabs = slab;
+    pool->next = (char *)slab + size;
+    pool->end = pool->next + n*size;
+
+    return 0;
 }
 
-static void tree_node_destroy(struct TreeNode *node)
+static void tree_pool_free(struct TreePool *pool, void *ptr)
 {
-    free(node);
+    struct TreePoolItem *item = ptr;
+
+    item->next = pool->free_list;
+    if( !pool->free_list )
+        pool->last_free = item;
+    pool->free_list = item;
 }
 
 static struct TreeNode * tree_node_grandparent(struct TreeNode *node)
 {
     if( node ) {
-        if( node->parent )
-            return node->parent->parent;
+        if( PARENT(node) )
+            return PARENT(PARENT(node));
     }
 
     return NULL;
@@ -544,7 +3162,7 @@ static struct TreeNode * tree_node_uncle(struct TreeNode *node)
     struct TreeNode *g;
 
     if( (g = tree_node_grandparent(node)) ) {
-        if( node->parent == g->left )
+        if( PARENT(node) == g->left )
             return g->right;
         else
             return g->left;
@@ -556,11 +3174,11 @@ static struct TreeNode * tree_node_uncle(struct TreeNode *node)
 static struct TreeNode * tree_node_sibling(struct TreeNode *node)
 {
     if( node ) {
-        if( node->parent ) {
-            if( node == node->parent->left )
-                return node->parent->right;
+        if( PARENT(node) ) {
+            if( node == PARENT(node)->left )
+                return PARENT(node)->right;
             else
-                return node->parent->left;
+                return PARENT(node)->left;
         }
     }
 
@@ -591,37 +3209,130 @@ static struct TreeNode * tree_node_min(struct TreeNode *node)
     return node;
 }
 
+// In-order successor. Every edge is passed at most twice during
+// a full walk so the step is O(1) amortized.
+static struct TreeNode * tree_node_next(struct TreeNode *node)
+{
+    struct TreeNode *parent;
+
+    if( node->right )
+        return tree_node_min(node->right);
+
+    while( (parent = PARENT(node)) && node == parent->right )
+        node = parent;
+
+    return parent;
+}
+
+// In-order predecessor.
+static struct TreeNode * tree_node_prev(struct TreeNode *node)
+{
+    struct TreeNode *parent;
+
+    if( node->left )
+        return tree_node_max(node->left);
+
+    while( (parent = PARENT(node)) && node == parent->left )
+        node = parent;
+
+    return parent;
+}
+
+// One step of a depth-first walk without a stack.
+// prev is the node the walk came from: the parent when node is entered
+// for the first time or one of the children when the walk returns to it.
+static struct TreeNode * tree_node_walk(struct TreeNode *node, struct TreeNode *prev)
+{
+    if( prev == PARENT(node) ) {
+        if( node->left )
+            return node->left;
+        if( node->right )
+            return node->right;
+    }
+    else if( prev == node->left && node->right ) {
+        return node->right;
+    }
+
+    return PARENT(node);
+}
+
+tree_stats_t * tree_stats(tree_t *tree, tree_stats_t *stats)
+{
+#ifdef TREE_STATS
+    *stats = *tree->stats;
+    return stats;
+#else
+    (void)tree;
+    memset(stats, 0, sizeof(*stats));
+    return NULL;
+#endif
+}
+
 tree_info_t * tree_info(tree_t *tree, tree_info_t *info)
 {
     return tree_node_info(tree->root, info);
 }
 
-static tree_info_t * tree_node_info(struct TreeNode *node, tree_info_t *info)
+tree_info_t * tree_counts(tree_t *tree, tree_info_t *info)
 {
-    tree_info_t left_info, right_info;
+    if( tree->size < 0 || tree->red_number < 0 )
+        tree_recount(tree);
 
     memset(info, 0, sizeof(*info));
-    if( node ) {
-        tree_node_info(node->left, &left_info);
-        tree_node_info(node->right, &right_info);
-
-        info->size = left_info.size + right_info.size + 1;
+    info->size = tree->size;
+    info->black_height = tree->black_height;
+    info->red_number = tree->red_number;
+    info->black_number = tree->size - tree->red_number;
+    info->height = -1;
+    info->min_height = -1;
 
-        info->height = left_info.height > right_info.height
-            ? left_info.height + 1 : right_info.height + 1;
+    return info;
+}
 
-        info->min_height = left_info.min_height <= right_info.min_height
-            ? left_info.min_height + 1 : right_info.min_height + 1;
+static tree_info_t * tree_node_info(struct TreeNode *node, tree_info_t *info)
+{
+    struct TreeNode *top, *prev, *next;
+    long depth, black_depth;
 
-        info->black_height = (left_info.black_height > right_info.black_height
-            ? left_info.black_height : right_info.black_height)
-            + (IS_BLACK(node) ? 1 : 0);
+    memset(info, 0, sizeof(*info));
+    if( !node )
+        return info;
+
+    top = PARENT(node);
+    prev = top;
+    depth = 1;
+    black_depth = IS_BLACK(node) ? 1 : 0;
+    while( node != top ) {
+        if( prev == PARENT(node) ) {
+            // First visit of the node.
+            info->size++;
+            if( IS_RED(node) )
+                info->red_number++;
+            else
+                info->black_number++;
+
+            if( depth > info->height )
+                info->height = depth;
+            if( black_depth > info->black_height )
+                info->black_height = black_depth;
+            // The shortest path ends at a node with a missing child.
+            if( (!node->left || !node->right)
+                && (info->min_height == 0 || depth < info->min_height) )
+                info->min_height = depth;
+        }
 
-        info->red_number = (IS_RED(node) ? 1 : 0)
-            + left_info.red_number + right_info.red_number;
+        next = tree_node_walk(node, prev);
+        if( next == PARENT(node) ) {
+            depth--;
+            black_depth -= IS_BLACK(node) ? 1 : 0;
+        }
+        else {
+            depth++;
+            black_depth += IS_BLACK(next) ? 1 : 0;
+        }
 
-        info->black_number = (IS_BLACK(node) ? 1 : 0)
-            + left_info.black_number + right_info.black_number;
+        prev = node;
+        node = next;
     }
 
     return info;
@@ -629,41 +3340,145 @@ static tree_info_t * tree_node_info(struct TreeNode *node, tree_info_t *info)
 
 int tree_check_integrity(tree_t *tree)
 {
-    if( !IS_BLACK(tree->root) )
-        return 0;
+    tree_integrity_t report;
 
-    return tree_node_check_integrity(tree->root);
+    return tree_check_integrity_report(tree, &report);
 }
 
-static int tree_node_check_integrity(struct TreeNode *node)
+static int tree_integrity_fail(tree_t *tree, tree_integrity_t *report, int error, struct TreeNode *node, long depth)
 {
-    tree_info_t left_info, right_info;
-    long height, min_height;
+    report->error = error;
+    report->key = node ? KEY(tree, node) : NULL;
+    if( node )
+        report->value = INTRUSIVE(tree) ? (void *)node : node->value;
+    else
+        report->value = NULL;
+    report->depth = depth;
 
-    if( !node )
-        return 1;
+    return 0;
+}
 
-    if( node->left && node->left->parent != node )
-        return 0;
+int tree_check_integrity_report(tree_t *tree, tree_integrity_t *report)
+{
+    struct TreeNode *node, *prev, *next, *last;
+    long size, red_number, depth, height, min_height, black_depth, leaf_black_depth;
+    int error;
 
-    if( node->right && node->right->parent != node )
-        return 0;
+    memset(report, 0, sizeof(*report));
 
-    if( IS_RED(node) && !(IS_BLACK(node->parent) && IS_BLACK(node->left) && IS_BLACK(node->right)) )
-        return 0;
+    if( !IS_BLACK(tree->root) || (tree->root && PARENT(tree->root)) )
+        return tree_integrity_fail(tree, report, TREE_INTEGRITY_ROOT, tree->root, 1);
 
-    tree_node_info(node->left, &left_info);
-    tree_node_info(node->right, &right_info);
-    if( left_info.black_height != right_info.black_height )
-        return 0;
+    // Everything is checked in one walk over the tree.
+    // Every path from the root to a missing child must have the same
+    // number of black nodes, keys must ascend in order.
+    node = tree->root;
+    prev = last = NULL;
+    size = red_number = 0;
+    depth = 1;
+    height = min_height = 0;
+    black_depth = 1;
+    leaf_black_depth = -1;
+    while( node ) {
+        if( prev == PARENT(node) ) {
+            size++;
+            red_number += IS_RED(node);
+            if( (error = tree_node_check_integrity(tree, node)) )
+                return tree_integrity_fail(tree, report, error, node, depth);
+
+            if( !node->left || !node->right ) {
+                if( leaf_black_depth < 0 )
+                    leaf_black_depth = black_depth;
+                else if( black_depth != leaf_black_depth )
+                    return tree_integrity_fail(tree, report, TREE_INTEGRITY_BLACK_HEIGHT, node, depth);
+
+                if( min_height == 0 || depth < min_height )
+                    min_height = depth;
+            }
+
+            if( depth > height )
+                height = depth;
+        }
 
-    height = left_info.height > right_info.height
-        ? left_info.height + 1 : right_info.height + 1;
-    min_height = left_info.min_height <= right_info.min_height
-        ? left_info.min_height + 1 : right_info.min_height + 1;
-    if( !(height <= min_height*2) )
-        return 0;
+        // In-order position: the left subtree is done.
+        if( prev == node->left || (prev == PARENT(node) && !node->left) ) {
+            if( last && tree->cmp(KEY(tree, last), KEY(tree, node)) >= 0 )
+                return tree_integrity_fail(tree, report, TREE_INTEGRITY_ORDER, node, depth);
+            last = node;
+        }
+
+        next = tree_node_walk(node, prev);
+        if( next == PARENT(node) ) {
+            depth--;
+            black_depth -= IS_BLACK(node) ? 1 : 0;
+        }
+        else {
+            depth++;
+            black_depth += IS_BLACK(next) ? 1 : 0;
+        }
+
+        prev = node;
+        node = next;
+    }
+
+    if( tree->root && leaf_black_depth != tree->black_height )
+        return tree_integrity_fail(tree, report, TREE_INTEGRITY_BLACK_HEIGHT, NULL, 0);
+
+    // The longest path is at most twice as long as the shortest one.
+    if( height > min_height*2 )
+        return tree_integrity_fail(tree, report, TREE_INTEGRITY_HEIGHT, NULL, height);
+
+    if( size != tree_size(tree) )
+        return tree_integrity_fail(tree, report, TREE_INTEGRITY_SIZE, NULL, 0);
+
+    if( tree->red_number >= 0 && red_number != tree->red_number )
+        return tree_integrity_fail(tree, report, TREE_INTEGRITY_RED_NUMBER, NULL, 0);
+
+    return 1;
+}
+
+// Local properties of a single node.
+static int tree_node_check_integrity(tree_t *tree, struct TreeNode *node)
+{
+    if( node->left && PARENT(node->left) != node )
+        return TREE_INTEGRITY_PARENT;
+
+    if( node->right && PARENT(node->right) != node )
+        return TREE_INTEGRITY_PARENT;
+
+    if( IS_RED(node) && !(IS_BLACK(node->left) && IS_BLACK(node->right)) )
+        return TREE_INTEGRITY_RED_RED;
+
+    if( HAS_COUNT(tree) && COUNT(node) != COUNT(node->left) + COUNT(node->right) + 1 )
+        return TREE_INTEGRITY_COUNT;
+
+    return TREE_INTEGRITY_OK;
+}
+
+const char * tree_integrity_error(int error)
+{
+    switch( error ) {
+        case TREE_INTEGRITY_OK:
+            return "ok";
+        case TREE_INTEGRITY_ROOT:
+            return "root is red or has a parent";
+        case TREE_INTEGRITY_PARENT:
+            return "child does not point to its parent";
+        case TREE_INTEGRITY_RED_RED:
+            return "red node has a red child";
+        case TREE_INTEGRITY_BLACK_HEIGHT:
+            return "black height differs between paths";
+        case TREE_INTEGRITY_HEIGHT:
+            return "longest path is more than twice the shortest one";
+        case TREE_INTEGRITY_ORDER:
+            return "keys are out of order";
+        case TREE_INTEGRITY_COUNT:
+            return "wrong subtree size";
+        case TREE_INTEGRITY_SIZE:
+            return "number of nodes differs from tree size";
+        case TREE_INTEGRITY_RED_NUMBER:
+            return "number of red nodes differs from the tracked one";
+    }
 
-    return tree_node_check_integrity(node->left)
-        && tree_node_check_integrity(node->right);
+    return "unknown error";
 }
@@ -2,6 +2,9 @@
 #ifndef TREE_H
 #define TREE_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -9,19 +12,240 @@ extern "C" {
 typedef struct Tree tree_t;
 typedef int (*tree_cmp_t)(const void *, const void *);
 
+// Keep subtree sizes in nodes so tree_select() and tree_rank() are O(log n).
+#define TREE_ORDER_STATISTICS   0x01
+// Keys are int64_t or uint64_t kept in the node itself and compared
+// directly, the comparator isn't used and may be NULL. Keys are still
+// passed by pointer; keys handed back (folds, iterators) point into nodes.
+#define TREE_KEY_INT64          0x02
+#define TREE_KEY_UINT64         0x04
+// The tree is read concurrently (ctree, stree), TREE_STATS builds count
+// only what writers do: no lookups and comparisons.
+#define TREE_SHARED             0x08
+
+typedef struct TreeOptions {
+    // Custom node allocator. If alloc is NULL nodes are taken from
+    // the tree's own pool.
+    void * (*alloc)(size_t size, void *ctx);
+    void (*free)(void *ptr, void *ctx);
+    void *alloc_ctx;
+    int flags;
+} tree_options_t;
+
 tree_t * tree_create(tree_cmp_t cmp);
+tree_t * tree_create_ext(tree_cmp_t cmp, const tree_options_t *options);
 void tree_destroy(tree_t *tree, void (*destructor)(void *));
+
+// Build a tree from n strictly ascending keys in O(n).
+// values may be NULL. Return NULL if keys are not sorted, or with errno set
+// to ENOMEM if there is no memory for the nodes.
+tree_t * tree_build_sorted(tree_cmp_t cmp, void **keys, void **values, long n);
+tree_t * tree_build_sorted_ext(tree_cmp_t cmp, const tree_options_t *options,
+    void **keys, void **values, long n);
 long tree_size(tree_t *tree);
 void * tree_find(tree_t *tree, void *key);
+// Return value, or the value of key if it's there already. NULL with
+// errno set to ENOMEM if there is no memory for a node.
 void * tree_insert(tree_t *tree, void *key, void *value);
 void * tree_delete(tree_t *tree, void *key);
+// Insert key/value or, if key is there, put value in place of its value
+// (the key in the tree stays). Either way it's one descent.
+// Return 1 if inserted, 0 if replaced, -1 without memory for a node;
+// the replaced value goes to *old if old isn't NULL.
+int tree_upsert(tree_t *tree, void *key, void *value, void **old);
+// Value of key. If key isn't there, factory(key, ctx) makes the value and
+// the entry is inserted without another descent, factory must not change
+// the tree. *inserted (if inserted isn't NULL) is set to 1 if it was,
+// 0 otherwise. Without memory for a node the factory isn't called and
+// NULL is returned with errno set to ENOMEM.
+void * tree_find_or_insert(tree_t *tree, void *key, void * (*factory)(void *, void *),
+    void *ctx, int *inserted);
+
+// Insert n entries at once. Keys that are already in the tree keep their
+// values, of equal keys in the batch the first one wins.
+// Return the number of inserted entries, -1 with errno set to ENOMEM if
+// memory runs out. Entries inserted by then stay.
+long tree_insert_batch(tree_t *tree, void **keys, void **values, long n);
+// Delete n keys at once, destructor (if not NULL) is called for the values
+// of deleted entries. Return the number of deleted entries, -1 with errno
+// set to ENOMEM if there is no memory to sort the keys (nothing is deleted).
+long tree_delete_batch(tree_t *tree, void **keys, long n, void (*destructor)(void *));
 
 void * tree_fold(tree_t *tree, void * (*fun)(void *, void *, void *), void *acc);
 void * tree_foldl(tree_t *tree, void * (*fun)(void *, void *, void *), void *acc);
 void * tree_foldr(tree_t *tree, void * (*fun)(void *, void *, void *), void *acc);
 
+// Folds that stop as soon as fun sets *stop to non-zero.
+// Only the visited entries are paid for.
+void * tree_foldl_until(tree_t *tree, void * (*fun)(void *, void *, void *, int *), void *acc);
+void * tree_foldr_until(tree_t *tree, void * (*fun)(void *, void *, void *, int *), void *acc);
+
+// Join t1, the entry key/value and t2 into t1 in O(log n). All keys of t1
+// must be less than key and all keys of t2 greater than key.
+// t2 is destroyed. Return NULL (and leave both trees as they are)
+// if keys are out of order, the trees are created with different options
+// or there is no memory for the entry.
+tree_t * tree_join(tree_t *t1, void *key, void *value, tree_t *t2);
+// Split tree in O(log n) into lo with keys less than key and hi with
+// the rest. tree itself becomes lo. If there is no memory for hi, lo and hi
+// are set to NULL with errno ENOMEM and tree is left as it is.
+void tree_split(tree_t *tree, void *key, tree_t **lo, tree_t **hi);
+
+// Set operations in O(m log(n/m + 1)). The result is put into t1 and
+// returned, t2 is destroyed. Values of t1 win, destructor (if not NULL)
+// is called for the values of entries that don't make it into the result.
+// Return NULL if the trees are created with different options.
+tree_t * tree_union(tree_t *t1, tree_t *t2, void (*destructor)(void *));
+tree_t * tree_intersection(tree_t *t1, tree_t *t2, void (*destructor)(void *));
+tree_t * tree_difference(tree_t *t1, tree_t *t2, void (*destructor)(void *));
+
+typedef struct TreeIter {
+    tree_t *tree;
+    struct TreeNode *node;
+} tree_iter_t;
+
+tree_iter_t * tree_iter_first(tree_t *tree, tree_iter_t *iter);
+tree_iter_t * tree_iter_last(tree_t *tree, tree_iter_t *iter);
+tree_iter_t * tree_iter_next(tree_iter_t *iter);
+tree_iter_t * tree_iter_prev(tree_iter_t *iter);
+void * tree_iter_key(tree_iter_t *iter);
+void * tree_iter_value(tree_iter_t *iter);
+// Delete the entry at iter without looking it up and move iter to the
+// next entry (iter's node becomes NULL past the last one).
+// Return the value of the deleted entry, NULL if iter is past the end.
+// Iterators on other entries stay valid: deletes never move entries
+// between nodes.
+void * tree_delete_at(tree_iter_t *iter);
+
+// Position iter on the first entry with key >= key (lower_bound, ceiling),
+// the first entry with key > key (upper_bound)
+// or the last entry with key <= key (floor).
+// Return NULL if there is no such entry.
+tree_iter_t * tree_lower_bound(tree_t *tree, void *key, tree_iter_t *iter);
+tree_iter_t * tree_upper_bound(tree_t *tree, void *key, tree_iter_t *iter);
+tree_iter_t * tree_floor(tree_t *tree, void *key, tree_iter_t *iter);
+tree_iter_t * tree_ceiling(tree_t *tree, void *key, tree_iter_t *iter);
+
+// Position iter on the k-th smallest entry (starting from 0).
+// Return NULL if k is out of range.
+tree_iter_t * tree_select(tree_t *tree, long k, tree_iter_t *iter);
+// Number of entries with key less than key.
+long tree_rank(tree_t *tree, void *key);
+
+// Fold over the entries with lo <= key <= hi in ascending order.
+void * tree_fold_range(tree_t *tree, void *lo, void *hi, void * (*fun)(void *, void *, void *), void *acc);
+
+// Intrusive trees link hooks embedded in the caller's objects: insert and
+// delete don't allocate anything and lookups reach the object's key right
+// next to the hook. The key is found at key_offset bytes from the hook,
+// see TREE_HOOK_KEY_OFFSET(), and cmp gets pointers to keys as usual.
+// A hook must stay where it is and must not be touched while it's linked.
+// Besides tree_hook_*(), intrusive trees work with tree_size(), tree_info(),
+// tree_check_integrity() (the report's value is the hook) and tree_destroy()
+// (hooks are left as they are, destructor is ignored).
+typedef struct TreeHook {
+    uintptr_t parent_color;
+    struct TreeHook *left;
+    struct TreeHook *right;
+} tree_hook_t;
+
+#define TREE_HOOK_KEY_OFFSET(type, hook_member, key_member) \
+    ((long)offsetof(type, key_member) - (long)offsetof(type, hook_member))
+// The object of type that embeds hook as hook_member.
+#define TREE_HOOK_ENTRY(hook, type, hook_member) \
+    ((type *)((char *)(hook) - offsetof(type, hook_member)))
+
+tree_t * tree_create_intrusive(tree_cmp_t cmp, long key_offset);
+tree_hook_t * tree_hook_find(tree_t *tree, void *key);
+// Link hook in. Return hook or, if its key is already there, the hook
+// that has it (and hook isn't linked).
+tree_hook_t * tree_hook_insert(tree_t *tree, tree_hook_t *hook);
+// Unlink hook, there's no lookup. Other hooks stay where they are.
+void tree_hook_delete(tree_t *tree, tree_hook_t *hook);
+// The first hook with key >= key, NULL if there is none.
+tree_hook_t * tree_hook_lower_bound(tree_t *tree, void *key);
+tree_hook_t * tree_hook_first(tree_t *tree);
+tree_hook_t * tree_hook_last(tree_t *tree);
+tree_hook_t * tree_hook_next(tree_hook_t *hook);
+tree_hook_t * tree_hook_prev(tree_hook_t *hook);
+
+// Read-only copy of a tree laid out for cache-friendly lookups: keys are
+// kept in one array in Eytzinger (breadth-first) order, so the first
+// levels of every search share a few cache lines and the lines of the
+// levels below are prefetched while comparing.
+// The frozen copy doesn't depend on the tree, which may change or go away.
+typedef struct TreeFrozen tree_frozen_t;
+
+typedef struct TreeFrozenIter {
+    tree_frozen_t *frozen;
+    long pos;
+} tree_frozen_iter_t;
+
+// Return NULL with errno ENOMEM if there is no memory for the copy.
+tree_frozen_t * tree_freeze(tree_t *tree);
+void tree_frozen_destroy(tree_frozen_t *frozen);
+long tree_frozen_size(tree_frozen_t *frozen);
+void * tree_frozen_find(tree_frozen_t *frozen, void *key);
+// Position iter on the first entry with key >= key.
+// Return NULL if there is no such entry.
+tree_frozen_iter_t * tree_frozen_lower_bound(tree_frozen_t *frozen, void *key, tree_frozen_iter_t *iter);
+tree_frozen_iter_t * tree_frozen_iter_next(tree_frozen_iter_t *iter);
+void * tree_frozen_iter_key(tree_frozen_iter_t *iter);
+void * tree_frozen_iter_value(tree_frozen_iter_t *iter);
+
+// Save entries in order to fd: a versioned image with a checksum.
+// encode puts an entry into size bytes at buf and returns the number of
+// bytes it takes. If that's more than size it's called again with enough
+// room. A negative result fails the save.
+// Keys of TREE_KEY_INT64 and TREE_KEY_UINT64 trees are pointers to the number.
+typedef long (*tree_encode_t)(void *key, void *value, void *buf, long size, void *ctx);
+// Make an entry out of size bytes at buf, return nonzero on errors.
+// Inline keys are copied at once, key may point to a temporary then.
+typedef int (*tree_decode_t)(const void *buf, long size, void **key, void **value, void *ctx);
+
+// Return 0 or -1 with errno set. Intrusive trees can't be saved.
+int tree_save(tree_t *tree, int fd, tree_encode_t encode, void *ctx);
+// Read an image of tree_save() in O(n) without rebalancing. Return NULL
+// with errno set on errors, EINVAL if the image is damaged or keys aren't
+// ascending under cmp. Values decoded so far go to destructor then.
+tree_t * tree_load(tree_cmp_t cmp, const tree_options_t *options, int fd,
+    tree_decode_t decode, void (*destructor)(void *), void *ctx);
+
+// Read-only image of a tree to search right where it's mapped: nodes refer
+// to each other by offsets, so the image works at any address and the page
+// cache is shared by every process that maps the same file.
+// The encoders make the keys and values of the image. Keys are compared
+// as they are in the image, cmp of tree_image_map() and keys passed to
+// lookups must take the encoded form. Both land 8 bytes aligned.
+typedef struct TreeImage tree_image_t;
+
+typedef struct TreeImageIter {
+    tree_image_t *image;
+    uint64_t node;
+} tree_image_iter_t;
+
+// Write the image to an empty file, fd at its start. encode_value may be
+// NULL, values of the image are NULL then. Return 0 or -1 with errno set.
+int tree_image_save(tree_t *tree, int fd, tree_encode_t encode_key, tree_encode_t encode_value, void *ctx);
+// Map the whole file read-only. Only the header is checked, in O(1).
+// Return NULL with errno set on errors, EINVAL if it's not an image.
+tree_image_t * tree_image_map(int fd, tree_cmp_t cmp);
+void tree_image_unmap(tree_image_t *image);
+long tree_image_size(tree_image_t *image);
+// Keys and values handed back point into the mapping.
+void * tree_image_find(tree_image_t *image, void *key);
+tree_image_iter_t * tree_image_lower_bound(tree_image_t *image, void *key, tree_image_iter_t *iter);
+tree_image_iter_t * tree_image_iter_next(tree_image_iter_t *iter);
+void * tree_image_iter_key(tree_image_iter_t *iter);
+void * tree_image_iter_value(tree_image_iter_t *iter);
+void * tree_image_fold_range(tree_image_t *image, void *lo, void *hi, void * (*fun)(void *, void *, void *), void *acc);
+// Checksum, links between nodes, offsets and key order in O(n).
+// Return 1 if the image is valid.
+int tree_image_check(tree_image_t *image);
+
 typedef struct TreeInfo {
     long size;
+    // -1 from tree_counts(), see there.
     long height;
     long min_height;
     long black_height;
@@ -30,8 +254,62 @@ typedef struct TreeInfo {
 } tree_info_t;
 
 tree_info_t * tree_info(tree_t *tree, tree_info_t *info);
+// What tree_info() finds by a walk, except heights, which are set to -1.
+// Size, black height and the number of red and black nodes are kept up to
+// date by every change, so it's O(1). Except after split and set operations:
+// then the first call counts nodes in O(n) like tree_size().
+tree_info_t * tree_counts(tree_t *tree, tree_info_t *info);
+
+// Work done by a tree since it was created. Counted only if the library is
+// built with TREE_STATS, otherwise tree_stats() zeroes stats and returns NULL.
+// Lookups and comparisons of TREE_SHARED trees stay 0.
+typedef struct TreeStats {
+    // Descents from the root, nodes linked and unlinked.
+    long lookups;
+    long inserts;
+    long deletes;
+    long comparisons;
+    long rotations;
+    // Nodes recolored while rebalancing.
+    long recolorings;
+    // Times each step of the insert and delete fix-ups ran,
+    // insert_cases[0] is the first step.
+    long insert_cases[5];
+    long delete_cases[6];
+} tree_stats_t;
+
+// A copy of the counters in O(1).
+tree_stats_t * tree_stats(tree_t *tree, tree_stats_t *stats);
+
 int tree_check_integrity(tree_t *tree);
 
+// Which invariant tree_check_integrity_report() found broken.
+enum {
+    TREE_INTEGRITY_OK = 0,
+    TREE_INTEGRITY_ROOT,          // The root is red or has a parent.
+    TREE_INTEGRITY_PARENT,        // A child doesn't point back to its parent.
+    TREE_INTEGRITY_RED_RED,       // A red node has a red child.
+    TREE_INTEGRITY_BLACK_HEIGHT,  // Paths with different number of black nodes.
+    TREE_INTEGRITY_HEIGHT,        // The longest path is more than twice the shortest.
+    TREE_INTEGRITY_ORDER,         // Keys are not ascending in order.
+    TREE_INTEGRITY_COUNT,         // Wrong subtree size (TREE_ORDER_STATISTICS).
+    TREE_INTEGRITY_SIZE,          // Number of nodes differs from tree_size().
+    TREE_INTEGRITY_RED_NUMBER     // Number of red nodes differs from tree_counts().
+};
+
+typedef struct TreeIntegrity {
+    int error;
+    // The node where the error was found (NULL for tree-wide errors)
+    // and its depth, the root is at depth 1.
+    void *key;
+    void *value;
+    long depth;
+} tree_integrity_t;
+
+// Check everything in one O(n) pass. Return 1 if the tree is valid.
+int tree_check_integrity_report(tree_t *tree, tree_integrity_t *report);
+const char * tree_integrity_error(int error);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
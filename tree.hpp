@@ -0,0 +1,1040 @@
+#ifndef TREE_HPP
+#define TREE_HPP
+
+// Header-only C++ counterpart of tree.h: rbtree::map keeps keys and values
+// of any type in the nodes, compares them with Compare and gets memory from
+// Alloc. Rebalancing is the one of tree.c, case by case.
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+namespace rbtree {
+
+template<class Key, class T, class Compare, class Alloc>
+class map;
+
+namespace detail {
+
+// The color is kept in the lowest bit of the parent pointer, like in tree.c.
+// The root hangs as the left child under the map's header node, the only
+// node without a parent, which is also end().
+struct node_base {
+    enum { RED = 0, BLACK = 1 };
+
+    std::uintptr_t parent_color;
+    node_base *left;
+    node_base *right;
+
+    node_base * parent() const { return reinterpret_cast<node_base *>(parent_color & ~std::uintptr_t(1)); }
+    int color() const { return int(parent_color & 1); }
+    void set_parent(node_base *p) { parent_color = reinterpret_cast<std::uintptr_t>(p) | (parent_color & 1); }
+    void set_color(int c) { parent_color = (parent_color & ~std::uintptr_t(1)) | std::uintptr_t(c); }
+    void set_parent_color(node_base *p, int c) { parent_color = reinterpret_cast<std::uintptr_t>(p) | std::uintptr_t(c); }
+};
+
+inline bool is_red(const node_base *node)
+{
+    return node != nullptr && node->color() == node_base::RED;
+}
+
+inline bool is_black(const node_base *node)
+{
+    return node == nullptr || node->color() == node_base::BLACK;
+}
+
+inline node_base * node_min(node_base *node)
+{
+    while( node->left )
+        node = node->left;
+    return node;
+}
+
+inline node_base * node_max(node_base *node)
+{
+    while( node->right )
+        node = node->right;
+    return node;
+}
+
+inline node_base * node_next(node_base *node)
+{
+    node_base *parent;
+
+    if( node->right )
+        return node_min(node->right);
+
+    while( (parent = node->parent()) && node == parent->right )
+        node = parent;
+
+    return parent;
+}
+
+inline node_base * node_prev(node_base *node)
+{
+    node_base *parent;
+
+    if( node->left )
+        return node_max(node->left);
+
+    while( (parent = node->parent()) && node == parent->left )
+        node = parent;
+
+    return parent;
+}
+
+inline node_base * node_grandparent(node_base *node)
+{
+    return node->parent() ? node->parent()->parent() : nullptr;
+}
+
+inline node_base * node_uncle(node_base *node)
+{
+    node_base *g = node_grandparent(node);
+
+    if( !g )
+        return nullptr;
+
+    return node->parent() == g->left ? g->right : g->left;
+}
+
+inline node_base * node_sibling(node_base *node)
+{
+    node_base *parent = node->parent();
+
+    return node == parent->left ? parent->right : parent->left;
+}
+
+// Put child where node hangs under parent (or at the root).
+inline void replace_child(node_base *&root, node_base *parent, node_base *node, node_base *child)
+{
+    if( !parent )
+        root = child;
+    else if( node == parent->left )
+        parent->left = child;
+    else
+        parent->right = child;
+}
+
+inline void rotate_left(node_base *&root, node_base *node)
+{
+    node_base *parent = node->parent(), *right = node->right;
+
+    replace_child(root, parent, node, right);
+    right->set_parent(parent);
+    node->set_parent(right);
+    node->right = right->left;
+    right->left = node;
+    if( node->right )
+        node->right->set_parent(node);
+}
+
+inline void rotate_right(node_base *&root, node_base *node)
+{
+    node_base *parent = node->parent(), *left = node->left;
+
+    replace_child(root, parent, node, left);
+    left->set_parent(parent);
+    node->set_parent(left);
+    node->left = left->right;
+    left->right = node;
+    if( node->left )
+        node->left->set_parent(node);
+}
+
+// Insert cases of tree.c, see tree_insert1() .. tree_insert5() there.
+inline void insert1(node_base *&root, node_base *node);
+
+inline void insert5(node_base *&root, node_base *node)
+{
+    node_base *g = node_grandparent(node);
+
+    node->parent()->set_color(node_base::BLACK);
+    g->set_color(node_base::RED);
+    if( node == node->parent()->left && node->parent() == g->left )
+        rotate_right(root, g);
+    else if( node == node->parent()->right && node->parent() == g->right )
+        rotate_left(root, g);
+}
+
+inline void insert4(node_base *&root, node_base *node)
+{
+    node_base *g = node_grandparent(node);
+
+    if( node == node->parent()->right && node->parent() == g->left ) {
+        rotate_left(root, node->parent());
+        node = node->left;
+    }
+    else if( node == node->parent()->left && node->parent() == g->right ) {
+        rotate_right(root, node->parent());
+        node = node->right;
+    }
+
+    insert5(root, node);
+}
+
+inline void insert3(node_base *&root, node_base *node)
+{
+    node_base *u = node_uncle(node), *g;
+
+    if( is_red(u) ) {
+        u->set_color(node_base::BLACK);
+        node->parent()->set_color(node_base::BLACK);
+        g = node_grandparent(node);
+        g->set_color(node_base::RED);
+        insert1(root, g);
+    }
+    else {
+        insert4(root, node);
+    }
+}
+
+inline void insert2(node_base *&root, node_base *node)
+{
+    if( is_black(node->parent()) )
+        return;
+    else
+        insert3(root, node);
+}
+
+inline void insert1(node_base *&root, node_base *node)
+{
+    if( node == root )
+        node->set_color(node_base::BLACK);
+    else
+        insert2(root, node);
+}
+
+// Link node into the empty slot link under parent and rebalance.
+inline void insert_at(node_base *&root, node_base *parent, node_base *&link, node_base *node)
+{
+    node->set_parent_color(parent, node_base::RED);
+    node->left = node->right = nullptr;
+    link = node;
+    insert1(root, node);
+}
+
+// Delete cases of tree.c, see tree_delete1() .. tree_delete6() there.
+inline void delete6(node_base *&root, node_base *node)
+{
+    node_base *s = node_sibling(node);
+
+    s->set_color(node->parent()->color());
+    node->parent()->set_color(node_base::BLACK);
+    if( node == node->parent()->left ) {
+        s->right->set_color(node_base::BLACK);
+        rotate_left(root, node->parent());
+    }
+    else {
+        s->left->set_color(node_base::BLACK);
+        rotate_right(root, node->parent());
+    }
+}
+
+inline void delete5(node_base *&root, node_base *node)
+{
+    node_base *s = node_sibling(node);
+
+    if( is_black(s) ) {
+        if( node == node->parent()->left
+            && s && is_black(s->right) && is_red(s->left) ) {
+                s->set_color(node_base::RED);
+                s->left->set_color(node_base::BLACK);
+                rotate_right(root, s);
+        }
+        else if( node == node->parent()->right
+            && is_black(s->left) && is_red(s->right) ) {
+                s->set_color(node_base::RED);
+                s->right->set_color(node_base::BLACK);
+                rotate_left(root, s);
+        }
+    }
+
+    delete6(root, node);
+}
+
+inline void delete4(node_base *&root, node_base *node)
+{
+    node_base *s = node_sibling(node);
+
+    if( is_red(node->parent())
+        && s && is_black(s) && is_black(s->left) && is_black(s->right) ) {
+            s->set_color(node_base::RED);
+            node->parent()->set_color(node_base::BLACK);
+    }
+    else {
+        delete5(root, node);
+    }
+}
+
+inline void delete1(node_base *&root, node_base *node);
+
+inline void delete3(node_base *&root, node_base *node)
+{
+    node_base *s = node_sibling(node);
+
+    if( is_black(node->parent())
+        && s && is_black(s) && is_black(s->left) && is_black(s->right) ) {
+            s->set_color(node_base::RED);
+            delete1(root, node->parent());
+    }
+    else {
+        delete4(root, node);
+    }
+}
+
+inline void delete2(node_base *&root, node_base *node)
+{
+    node_base *s = node_sibling(node);
+
+    if( is_red(s) ) {
+        node->parent()->set_color(node_base::RED);
+        s->set_color(node_base::BLACK);
+        if( node == node->parent()->left )
+            rotate_left(root, node->parent());
+        else
+            rotate_right(root, node->parent());
+    }
+
+    delete3(root, node);
+}
+
+inline void delete1(node_base *&root, node_base *node)
+{
+    if( node != root )
+        delete2(root, node);
+}
+
+// Swap node with heir, the rightmost node of its left subtree: heir takes
+// the place and the color of node and the other way round. Values can't be
+// moved between nodes as tree.c moves keys, so nodes are relinked instead.
+inline void swap_with_heir(node_base *&root, node_base *node, node_base *heir)
+{
+    node_base *parent = node->parent(), *heir_parent = heir->parent(), *heir_left = heir->left;
+    int color = node->color(), heir_color = heir->color();
+
+    replace_child(root, parent, node, heir);
+    heir->right = node->right;
+    heir->right->set_parent(heir);
+    if( heir_parent == node ) {
+        heir->left = node;
+        heir_parent = heir;
+    }
+    else {
+        heir->left = node->left;
+        heir->left->set_parent(heir);
+        heir_parent->right = node;
+    }
+    heir->set_parent_color(parent, color);
+
+    node->left = heir_left;
+    if( heir_left )
+        heir_left->set_parent(node);
+    node->right = nullptr;
+    node->set_parent_color(heir_parent, heir_color);
+}
+
+// Unlink node from the tree and rebalance. The node isn't destroyed.
+inline void erase(node_base *&root, node_base *node)
+{
+    node_base *child;
+
+    if( node->left && node->right )
+        swap_with_heir(root, node, node_max(node->left));
+
+    // node has at most 1 non-null branch. If there is one it's a red leaf
+    // under a black node, it takes the place of node and turns black.
+    child = node->left ? node->left : node->right;
+    if( child ) {
+        replace_child(root, node->parent(), node, child);
+        child->set_parent_color(node->parent(), node_base::BLACK);
+        return;
+    }
+
+    if( is_black(node) )
+        delete1(root, node);
+    replace_child(root, node->parent(), node, nullptr);
+}
+
+// Black height of the subtree or -1 if it breaks the red-black rules.
+inline long check_subtree(const node_base *node, const node_base *parent)
+{
+    long left, right;
+
+    if( !node )
+        return 1;
+    if( node->parent() != parent )
+        return -1;
+    if( is_red(node) && (is_red(node->left) || is_red(node->right)) )
+        return -1;
+
+    left = check_subtree(node->left, node);
+    right = check_subtree(node->right, node);
+    if( left < 0 || left != right )
+        return -1;
+
+    return left + (is_black(node) ? 1 : 0);
+}
+
+template<class Value>
+struct node : node_base {
+    // Constructed and destroyed by the map through its allocator.
+    union {
+        Value value;
+    };
+
+    node() {}
+    ~node() {}
+};
+
+template<class Value, bool Const>
+class map_iterator {
+    template<class, class, class, class> friend class rbtree::map;
+    template<class, bool> friend class map_iterator;
+
+    typedef node<Value> node_type;
+
+public:
+    typedef std::bidirectional_iterator_tag iterator_category;
+    typedef Value value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef typename std::conditional<Const, const Value *, Value *>::type pointer;
+    typedef typename std::conditional<Const, const Value &, Value &>::type reference;
+
+    map_iterator() : node_(nullptr) {}
+
+    // iterator converts to const_iterator.
+    template<bool C, class = typename std::enable_if<Const && !C>::type>
+    map_iterator(const map_iterator<Value, C> &other) : node_(other.node_) {}
+
+    reference operator*() const { return static_cast<node_type *>(node_)->value; }
+    pointer operator->() const { return std::addressof(static_cast<node_type *>(node_)->value); }
+
+    map_iterator & operator++()
+    {
+        node_ = node_next(node_);
+        return *this;
+    }
+
+    map_iterator operator++(int)
+    {
+        map_iterator it = *this;
+        ++*this;
+        return it;
+    }
+
+    // Stepping back from end(), the header, lands on the last entry.
+    map_iterator & operator--()
+    {
+        node_ = node_->parent() ? node_prev(node_) : node_max(node_->left);
+        return *this;
+    }
+
+    map_iterator operator--(int)
+    {
+        map_iterator it = *this;
+        --*this;
+        return it;
+    }
+
+    template<bool C>
+    bool operator==(const map_iterator<Value, C> &other) const { return node_ == other.node_; }
+    template<bool C>
+    bool operator!=(const map_iterator<Value, C> &other) const { return node_ != other.node_; }
+
+private:
+    explicit map_iterator(node_base *node) : node_(node) {}
+
+    node_base *node_;
+};
+
+} // namespace detail
+
+template<class Key, class T, class Compare = std::less<Key>,
+    class Alloc = std::allocator<std::pair<const Key, T> > >
+class map;
+
+template<class Key, class T, class Compare, class Alloc>
+class map {
+public:
+    typedef Key key_type;
+    typedef T mapped_type;
+    typedef std::pair<const Key, T> value_type;
+    typedef std::size_t size_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef Compare key_compare;
+    typedef Alloc allocator_type;
+    typedef value_type & reference;
+    typedef const value_type & const_reference;
+    typedef typename std::allocator_traits<Alloc>::pointer pointer;
+    typedef typename std::allocator_traits<Alloc>::const_pointer const_pointer;
+    typedef detail::map_iterator<value_type, false> iterator;
+    typedef detail::map_iterator<value_type, true> const_iterator;
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+    typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+private:
+    typedef detail::node_base node_base;
+    typedef detail::node<value_type> node_type;
+    typedef std::allocator_traits<Alloc> value_traits;
+    typedef typename value_traits::template rebind_alloc<node_type> node_allocator;
+    typedef std::allocator_traits<node_allocator> node_traits;
+
+public:
+    map() : map(Compare()) {}
+
+    explicit map(const Compare &cmp, const Alloc &alloc = Alloc())
+        : head_(), size_(0), cmp_(cmp), alloc_(alloc)
+    {
+        head_.set_color(node_base::BLACK);
+    }
+
+    explicit map(const Alloc &alloc) : map(Compare(), alloc) {}
+
+    template<class InputIt>
+    map(InputIt first, InputIt last, const Compare &cmp = Compare(), const Alloc &alloc = Alloc())
+        : map(cmp, alloc)
+    {
+        insert(first, last);
+    }
+
+    map(std::initializer_list<value_type> init, const Compare &cmp = Compare(), const Alloc &alloc = Alloc())
+        : map(init.begin(), init.end(), cmp, alloc) {}
+
+    map(const map &other)
+        : map(other.cmp_, node_traits::select_on_container_copy_construction(other.alloc_))
+    {
+        set_root(copy_subtree(other.head_.left, &head_));
+        size_ = other.size_;
+    }
+
+    map(const map &other, const Alloc &alloc) : map(other.cmp_, alloc)
+    {
+        set_root(copy_subtree(other.head_.left, &head_));
+        size_ = other.size_;
+    }
+
+    map(map &&other) noexcept
+        : head_(), size_(other.size_), cmp_(std::move(other.cmp_)), alloc_(std::move(other.alloc_))
+    {
+        head_.set_color(node_base::BLACK);
+        set_root(other.head_.left);
+        other.head_.left = nullptr;
+        other.size_ = 0;
+    }
+
+    map(map &&other, const Alloc &alloc) : map(other.cmp_, alloc)
+    {
+        if( alloc_ == other.alloc_ ) {
+            swap_nodes(other);
+        }
+        else {
+            for( auto &value : other )
+                emplace(std::move(const_cast<Key &>(value.first)), std::move(value.second));
+            other.clear();
+        }
+    }
+
+    ~map()
+    {
+        clear();
+    }
+
+    map & operator=(const map &other)
+    {
+        if( this == &other )
+            return *this;
+
+        clear();
+        if( node_traits::propagate_on_container_copy_assignment::value )
+            alloc_ = other.alloc_;
+        cmp_ = other.cmp_;
+        set_root(copy_subtree(other.head_.left, &head_));
+        size_ = other.size_;
+
+        return *this;
+    }
+
+    map & operator=(map &&other) noexcept(node_traits::propagate_on_container_move_assignment::value
+        || node_traits::is_always_equal::value)
+    {
+        if( this == &other )
+            return *this;
+
+        clear();
+        cmp_ = std::move(other.cmp_);
+        // Nodes can change hands only if this allocator can free them. A
+        // propagated allocator can, whatever is left of other's after the move.
+        if( node_traits::propagate_on_container_move_assignment::value ) {
+            alloc_ = std::move(other.alloc_);
+            swap_nodes(other);
+        }
+        else if( alloc_ == other.alloc_ ) {
+            swap_nodes(other);
+        }
+        else {
+            for( auto &value : other )
+                emplace(std::move(const_cast<Key &>(value.first)), std::move(value.second));
+            other.clear();
+        }
+
+        return *this;
+    }
+
+    map & operator=(std::initializer_list<value_type> init)
+    {
+        clear();
+        insert(init);
+        return *this;
+    }
+
+    allocator_type get_allocator() const { return allocator_type(alloc_); }
+    key_compare key_comp() const { return cmp_; }
+
+    iterator begin() noexcept { return make_iterator(head_.left ? detail::node_min(head_.left) : nullptr); }
+    const_iterator begin() const noexcept { return make_iterator(head_.left ? detail::node_min(head_.left) : nullptr); }
+    const_iterator cbegin() const noexcept { return begin(); }
+    iterator end() noexcept { return make_iterator(nullptr); }
+    const_iterator end() const noexcept { return make_iterator(nullptr); }
+    const_iterator cend() const noexcept { return end(); }
+    reverse_iterator rbegin() noexcept { return reverse_iterator(end()); }
+    const_reverse_iterator rbegin() const noexcept { return const_reverse_iterator(end()); }
+    const_reverse_iterator crbegin() const noexcept { return rbegin(); }
+    reverse_iterator rend() noexcept { return reverse_iterator(begin()); }
+    const_reverse_iterator rend() const noexcept { return const_reverse_iterator(begin()); }
+    const_reverse_iterator crend() const noexcept { return rend(); }
+
+    bool empty() const noexcept { return size_ == 0; }
+    size_type size() const noexcept { return size_; }
+    size_type max_size() const noexcept { return node_traits::max_size(alloc_); }
+
+    void clear() noexcept
+    {
+        destroy_subtree(head_.left);
+        head_.left = nullptr;
+        size_ = 0;
+    }
+
+    std::pair<iterator, bool> insert(const value_type &value)
+    {
+        return emplace(value);
+    }
+
+    std::pair<iterator, bool> insert(value_type &&value)
+    {
+        return emplace(std::move(value));
+    }
+
+    template<class P, class = typename std::enable_if<std::is_constructible<value_type, P &&>::value>::type>
+    std::pair<iterator, bool> insert(P &&value)
+    {
+        return emplace(std::forward<P>(value));
+    }
+
+    iterator insert(const_iterator, const value_type &value)
+    {
+        return emplace(value).first;
+    }
+
+    iterator insert(const_iterator, value_type &&value)
+    {
+        return emplace(std::move(value)).first;
+    }
+
+    template<class InputIt>
+    void insert(InputIt first, InputIt last)
+    {
+        for( ; first != last ; ++first )
+            emplace(*first);
+    }
+
+    void insert(std::initializer_list<value_type> init)
+    {
+        insert(init.begin(), init.end());
+    }
+
+    template<class M>
+    std::pair<iterator, bool> insert_or_assign(const Key &key, M &&obj)
+    {
+        std::pair<iterator, bool> res = try_emplace(key, std::forward<M>(obj));
+
+        if( !res.second )
+            res.first->second = std::forward<M>(obj);
+
+        return res;
+    }
+
+    template<class M>
+    std::pair<iterator, bool> insert_or_assign(Key &&key, M &&obj)
+    {
+        std::pair<iterator, bool> res = try_emplace(std::move(key), std::forward<M>(obj));
+
+        if( !res.second )
+            res.first->second = std::forward<M>(obj);
+
+        return res;
+    }
+
+    // The entry is built right in a new node, the key to look for is
+    // only known then. The node is dropped if the key is already there.
+    template<class... Args>
+    std::pair<iterator, bool> emplace(Args &&... args)
+    {
+        node_type *node = create_node(std::forward<Args>(args)...);
+        node_base *parent, **link;
+
+        if( !find_slot(node->value.first, parent, link) ) {
+            destroy_node(node);
+            return std::make_pair(make_iterator(parent), false);
+        }
+
+        link_node(parent, *link, node);
+
+        return std::make_pair(make_iterator(node), true);
+    }
+
+    template<class... Args>
+    iterator emplace_hint(const_iterator, Args &&... args)
+    {
+        return emplace(std::forward<Args>(args)...).first;
+    }
+
+    // Unlike emplace() nothing is built if the key is already there,
+    // key and args aren't moved from then.
+    template<class... Args>
+    std::pair<iterator, bool> try_emplace(const Key &key, Args &&... args)
+    {
+        node_base *parent, **link;
+
+        if( !find_slot(key, parent, link) )
+            return std::make_pair(make_iterator(parent), false);
+
+        node_type *node = create_node(std::piecewise_construct, std::forward_as_tuple(key),
+            std::forward_as_tuple(std::forward<Args>(args)...));
+        link_node(parent, *link, node);
+
+        return std::make_pair(make_iterator(node), true);
+    }
+
+    template<class... Args>
+    std::pair<iterator, bool> try_emplace(Key &&key, Args &&... args)
+    {
+        node_base *parent, **link;
+
+        if( !find_slot(key, parent, link) )
+            return std::make_pair(make_iterator(parent), false);
+
+        node_type *node = create_node(std::piecewise_construct, std::forward_as_tuple(std::move(key)),
+            std::forward_as_tuple(std::forward<Args>(args)...));
+        link_node(parent, *link, node);
+
+        return std::make_pair(make_iterator(node), true);
+    }
+
+    T & operator[](const Key &key)
+    {
+        return try_emplace(key).first->second;
+    }
+
+    T & operator[](Key &&key)
+    {
+        return try_emplace(std::move(key)).first->second;
+    }
+
+    T & at(const Key &key)
+    {
+        iterator it = find(key);
+
+        if( it == end() )
+            throw std::out_of_range("rbtree::map::at");
+
+        return it->second;
+    }
+
+    const T & at(const Key &key) const
+    {
+        const_iterator it = find(key);
+
+        if( it == end() )
+            throw std::out_of_range("rbtree::map::at");
+
+        return it->second;
+    }
+
+    // Other iterators stay valid: nodes are relinked, not copied.
+    iterator erase(const_iterator pos)
+    {
+        node_base *node = pos.node_, *next = detail::node_next(node);
+
+        detail::erase(head_.left, node);
+        destroy_node(static_cast<node_type *>(node));
+        size_--;
+
+        return make_iterator(next);
+    }
+
+    iterator erase(iterator pos)
+    {
+        return erase(const_iterator(pos));
+    }
+
+    iterator erase(const_iterator first, const_iterator last)
+    {
+        while( first != last )
+            first = erase(first);
+
+        return make_iterator(last.node_);
+    }
+
+    size_type erase(const Key &key)
+    {
+        iterator it = find(key);
+
+        if( it == end() )
+            return 0;
+
+        erase(it);
+
+        return 1;
+    }
+
+    void swap(map &other) noexcept
+    {
+        using std::swap;
+
+        if( node_traits::propagate_on_container_swap::value )
+            swap(alloc_, other.alloc_);
+        swap(cmp_, other.cmp_);
+        swap_nodes(other);
+    }
+
+    iterator find(const Key &key) { return make_iterator(find_node(key)); }
+    const_iterator find(const Key &key) const { return make_iterator(find_node(key)); }
+    size_type count(const Key &key) const { return find_node(key) ? 1 : 0; }
+    bool contains(const Key &key) const { return find_node(key) != nullptr; }
+
+    iterator lower_bound(const Key &key) { return make_iterator(find_bound(key, false)); }
+    const_iterator lower_bound(const Key &key) const { return make_iterator(find_bound(key, false)); }
+    iterator upper_bound(const Key &key) { return make_iterator(find_bound(key, true)); }
+    const_iterator upper_bound(const Key &key) const { return make_iterator(find_bound(key, true)); }
+
+    std::pair<iterator, iterator> equal_range(const Key &key)
+    {
+        return std::make_pair(lower_bound(key), upper_bound(key));
+    }
+
+    std::pair<const_iterator, const_iterator> equal_range(const Key &key) const
+    {
+        return std::make_pair(lower_bound(key), upper_bound(key));
+    }
+
+    // Same checks as tree_check_integrity(): parent links, no red node with
+    // a red child, the same number of black nodes down every path, keys
+    // in order and the right size.
+    bool check_integrity() const
+    {
+        const_iterator it, prev;
+        size_type n = 0;
+
+        if( detail::is_red(head_.left) || detail::check_subtree(head_.left, &head_) < 0 )
+            return false;
+
+        for( it = begin() ; it != end() ; prev = it, ++it, n++ )
+            if( n > 0 && !cmp_(prev->first, it->first) )
+                return false;
+
+        return n == size_;
+    }
+
+private:
+    // A null node is end(), the header.
+    iterator make_iterator(node_base *node) { return iterator(node ? node : &head_); }
+    const_iterator make_iterator(node_base *node) const
+    {
+        return const_iterator(node ? node : const_cast<node_base *>(&head_));
+    }
+
+    // The root's parent link has to follow the nodes to another header.
+    void set_root(node_base *root)
+    {
+        head_.left = root;
+        if( root )
+            root->set_parent(&head_);
+    }
+
+    void swap_nodes(map &other)
+    {
+        node_base *root = head_.left;
+
+        set_root(other.head_.left);
+        other.set_root(root);
+        std::swap(size_, other.size_);
+    }
+
+    const Key & node_key(const node_base *node) const
+    {
+        return static_cast<const node_type *>(node)->value.first;
+    }
+
+    node_base * find_node(const Key &key) const
+    {
+        node_base *node = head_.left;
+
+        while( node ) {
+            if( cmp_(key, node_key(node)) )
+                node = node->left;
+            else if( cmp_(node_key(node), key) )
+                node = node->right;
+            else
+                return node;
+        }
+
+        return nullptr;
+    }
+
+    // The first node not less than key (strict == false)
+    // or greater than key (strict == true).
+    node_base * find_bound(const Key &key, bool strict) const
+    {
+        node_base *node = head_.left, *bound = nullptr;
+
+        while( node ) {
+            if( strict ? cmp_(key, node_key(node)) : !cmp_(node_key(node), key) ) {
+                bound = node;
+                node = node->left;
+            }
+            else
+                node = node->right;
+        }
+
+        return bound;
+    }
+
+    // Find the empty slot for key. If key is there already, parent is
+    // its node and false is returned.
+    bool find_slot(const Key &key, node_base *&parent, node_base **&link)
+    {
+        node_base *node;
+
+        parent = &head_;
+        link = &head_.left;
+        while( (node = *link) ) {
+            if( cmp_(key, node_key(node)) )
+                link = &node->left;
+            else if( cmp_(node_key(node), key) )
+                link = &node->right;
+            else {
+                parent = node;
+                return false;
+            }
+            parent = node;
+        }
+
+        return true;
+    }
+
+    void link_node(node_base *parent, node_base *&link, node_type *node)
+    {
+        detail::insert_at(head_.left, parent, link, node);
+        size_++;
+    }
+
+    template<class... Args>
+    node_type * create_node(Args &&... args)
+    {
+        node_type *node = node_traits::allocate(alloc_, 1);
+
+        ::new (static_cast<void *>(node)) node_type();
+        try {
+            node_traits::construct(alloc_, std::addressof(node->value), std::forward<Args>(args)...);
+        }
+        catch( ... ) {
+            node->~node_type();
+            node_traits::deallocate(alloc_, node, 1);
+            throw;
+        }
+
+        return node;
+    }
+
+    void destroy_node(node_type *node)
+    {
+        node_traits::destroy(alloc_, std::addressof(node->value));
+        node->~node_type();
+        node_traits::deallocate(alloc_, node, 1);
+    }
+
+    void destroy_subtree(node_base *node)
+    {
+        node_base *left;
+
+        // Down the left spine recursively, right children in the loop.
+        while( node ) {
+            destroy_subtree(node->right);
+            left = node->left;
+            destroy_node(static_cast<node_type *>(node));
+            node = left;
+        }
+    }
+
+    // Copy the shape and the colors, no rebalancing needed.
+    node_base * copy_subtree(const node_base *node, node_base *parent)
+    {
+        node_base *copy;
+
+        if( !node )
+            return nullptr;
+
+        copy = create_node(static_cast<const node_type *>(node)->value);
+        copy->set_parent_color(parent, node->color());
+        copy->left = copy->right = nullptr;
+        try {
+            copy->left = copy_subtree(node->left, copy);
+            copy->right = copy_subtree(node->right, copy);
+        }
+        catch( ... ) {
+            destroy_subtree(copy);
+            throw;
+        }
+
+        return copy;
+    }
+
+    // Holds the root in its left link and stands for end().
+    node_base head_;
+    size_type size_;
+    Compare cmp_;
+    node_allocator alloc_;
+};
+
+template<class Key, class T, class Compare, class Alloc>
+bool operator==(const map<Key, T, Compare, Alloc> &a, const map<Key, T, Compare, Alloc> &b)
+{
+    return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin());
+}
+
+template<class Key, class T, class Compare, class Alloc>
+bool operator!=(const map<Key, T, Compare, Alloc> &a, const map<Key, T, Compare, Alloc> &b)
+{
+    return !(a == b);
+}
+
+template<class Key, class T, class Compare, class Alloc>
+void swap(map<Key, T, Compare, Alloc> &a, map<Key, T, Compare, Alloc> &b) noexcept
+{
+    a.swap(b);
+}
+
+} // namespace rbtree
+
+#endif /* TREE_HPP */